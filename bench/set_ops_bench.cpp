@@ -0,0 +1,153 @@
+/*
+ * set_ops 的 micro-benchmark, 与 std::set_intersection/std::set_difference 比较.
+ * make bench && ./set_ops_bench.bin [重复次数]
+ *
+ * 先用随机数据核对所有实现的结果与 STL 一致, 再对几种典型的集合大小计时.
+ */
+#include "../src/set_ops.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <random>
+#include <vector>
+
+typedef std::vector<uint32_t>   Set;
+
+// 从 [0, universe) 中随机取n个不同的数, 升序
+static
+Set random_set( std::mt19937 &rng, std::size_t n, uint32_t universe )
+{
+    Set s;
+    if (n * 2 >= universe) {
+        // 稠密时随机抽样, 反复补足会很慢
+        s.resize( universe );
+        for (uint32_t i = 0; i != universe; ++i)
+            s[i] = i;
+        std::shuffle( s.begin(), s.end(), rng );
+        s.resize( n );
+        std::sort( s.begin(), s.end() );
+        return s;
+    } // if
+
+    s.reserve( n * 2 );
+    std::uniform_int_distribution<uint32_t> dist( 0, universe - 1 );
+    while (s.size() < n) {
+        for (std::size_t i = s.size(); i < n; ++i)
+            s.push_back( dist(rng) );
+        std::sort( s.begin(), s.end() );
+        s.erase( std::unique(s.begin(), s.end()), s.end() );
+    } // while
+    s.resize( n );
+    return s;
+}
+
+static
+bool verify( std::mt19937 &rng )
+{
+    Set out, expect;
+    for (int round = 0; round != 2000; ++round) {
+        std::size_t na = rng() % 300, nb = rng() % 300;
+        if (round % 10 == 0)
+            nb = rng() % 20000;     // 大小悬殊, 走 galloping
+        uint32_t universe = 16 + rng() % 4000;
+        Set a = random_set( rng, std::min<std::size_t>(na, universe), universe );
+        Set b = random_set( rng, std::min<std::size_t>(nb, universe * 4), universe * 4 );
+        if (round & 1)
+            std::swap( a, b );
+
+        for (int k = 0; k != N_SET_OPS_KERNEL; ++k) {
+            if (!set_ops_use((SetOpsKernel)k))
+                continue;
+
+            expect.clear();
+            std::set_intersection( a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expect) );
+            sorted_intersect( a, b, out );
+            if (out != expect || sorted_intersect_count(a, b) != expect.size()) {
+                printf( "intersect mismatch: kernel %s, |a| = %zu, |b| = %zu\n",
+                        set_ops_kernel_name((SetOpsKernel)k), a.size(), b.size() );
+                return false;
+            } // if
+
+            expect.clear();
+            std::set_difference( a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expect) );
+            sorted_difference( a, b, out );
+            if (out != expect) {
+                printf( "difference mismatch: kernel %s, |a| = %zu, |b| = %zu\n",
+                        set_ops_kernel_name((SetOpsKernel)k), a.size(), b.size() );
+                return false;
+            } // if
+        } // for k
+    } // for round
+    return true;
+}
+
+template < typename Func >
+static
+double time_ns( std::size_t repeat, Func f )
+{
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i != repeat; ++i)
+        f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / repeat;
+}
+
+int main( int argc, char **argv )
+{
+    std::size_t repeat = argc > 1 ? (std::size_t)atol(argv[1]) : 2000;
+    std::mt19937 rng( 20160501 );
+
+    SetOpsKernel best = set_ops_kernel();
+    printf( "default kernel: %s\n", set_ops_kernel_name(best) );
+    if (!verify(rng))
+        return 1;
+    printf( "all kernels match STL\n\n" );
+
+    // {|a|, |b|, 取值范围}
+    struct Case { std::size_t na, nb; uint32_t universe; } cases[] = {
+        { 64, 64, 1000 },
+        { 1000, 1000, 10000 },
+        { 1000, 1000, 2000 },
+        { 10000, 10000, 100000 },
+        { 50, 50000, 1000000 },
+        { 50000, 50, 1000000 },
+    };
+
+    printf( "%8s %8s %8s  %-12s %12s %12s %12s\n",
+            "|a|", "|b|", "universe", "kernel", "intersect", "count", "difference" );
+    Set out;
+    volatile std::size_t sink = 0;
+    for (const Case &c : cases) {
+        Set a = random_set( rng, c.na, c.universe );
+        Set b = random_set( rng, c.nb, c.universe );
+        out.reserve( std::max(a.size(), b.size()) );
+
+        double tInter = time_ns( repeat, [&] {
+            out.clear();
+            std::set_intersection( a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out) );
+            sink += out.size();
+        } );
+        double tDiff = time_ns( repeat, [&] {
+            out.clear();
+            std::set_difference( a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out) );
+            sink += out.size();
+        } );
+        printf( "%8zu %8zu %8u  %-12s %10.0fns %12s %10.0fns\n",
+                c.na, c.nb, c.universe, "stl", tInter, "-", tDiff );
+
+        for (int k = 0; k != N_SET_OPS_KERNEL; ++k) {
+            if (!set_ops_use((SetOpsKernel)k))
+                continue;
+            tInter = time_ns( repeat, [&] { sorted_intersect( a, b, out ); sink += out.size(); } );
+            double tCount = time_ns( repeat, [&] { sink += sorted_intersect_count( a, b ); } );
+            tDiff = time_ns( repeat, [&] { sorted_difference( a, b, out ); sink += out.size(); } );
+            printf( "%8s %8s %8s  %-12s %10.0fns %10.0fns %10.0fns\n",
+                    "", "", "", set_ops_kernel_name((SetOpsKernel)k), tInter, tCount, tDiff );
+        } // for k
+    } // for c
+
+    set_ops_use( best );
+    return 0;
+}
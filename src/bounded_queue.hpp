@@ -0,0 +1,99 @@
+#ifndef _BOUNDED_QUEUE_HPP_
+#define _BOUNDED_QUEUE_HPP_
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+
+/**
+ * @brief 定长无锁队列, 支持多个生产者和多个消费者 (Dmitry Vyukov 的 bounded MPMC queue)
+ *
+ * 每个位置有一个序号, 生产者和消费者各自用 CAS 领取位置, 不加锁.
+ * 队列满时 try_push 返回false, 空时 try_pop 返回false, 由调用者决定等待方式.
+ */
+template < typename T >
+class BoundedQueue {
+    struct Cell {
+        std::atomic<std::size_t>    seq;
+        T                           data;
+    };
+
+public:
+    // 容量向上取整为2的幂
+    explicit BoundedQueue( std::size_t capacity )
+            : m_nMask(0), m_nEnqueuePos(0), m_nDequeuePos(0)
+    {
+        std::size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        m_nMask = n - 1;
+        m_arrCells.reset( new Cell[n] );
+        for (std::size_t i = 0; i != n; ++i)
+            m_arrCells[i].seq.store( i, std::memory_order_relaxed );
+    }
+
+    std::size_t capacity() const
+    { return m_nMask + 1; }
+
+    bool try_push( const T &value )
+    {
+        std::size_t pos = m_nEnqueuePos.load( std::memory_order_relaxed );
+        Cell *pCell;
+        while (true) {
+            pCell = &m_arrCells[pos & m_nMask];
+            std::size_t seq = pCell->seq.load( std::memory_order_acquire );
+            std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+            if (diff == 0) {
+                if (m_nEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;   // full
+            } else {
+                pos = m_nEnqueuePos.load( std::memory_order_relaxed );
+            } // if
+        } // while
+
+        pCell->data = value;
+        pCell->seq.store( pos + 1, std::memory_order_release );
+        return true;
+    }
+
+    bool try_pop( T &value )
+    {
+        std::size_t pos = m_nDequeuePos.load( std::memory_order_relaxed );
+        Cell *pCell;
+        while (true) {
+            pCell = &m_arrCells[pos & m_nMask];
+            std::size_t seq = pCell->seq.load( std::memory_order_acquire );
+            std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+            if (diff == 0) {
+                if (m_nDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;   // empty
+            } else {
+                pos = m_nDequeuePos.load( std::memory_order_relaxed );
+            } // if
+        } // while
+
+        value = pCell->data;
+        pCell->seq.store( pos + m_nMask + 1, std::memory_order_release );
+        return true;
+    }
+
+private:
+    BoundedQueue( const BoundedQueue& );
+    BoundedQueue& operator = ( const BoundedQueue& );
+
+    std::unique_ptr<Cell[]>         m_arrCells;
+    std::size_t                     m_nMask;
+    char                            m_Pad1[64];   // 生产者和消费者的位置不在同一 cache line
+    std::atomic<std::size_t>        m_nEnqueuePos;
+    char                            m_Pad2[64];
+    std::atomic<std::size_t>        m_nDequeuePos;
+};
+
+
+#endif
+
@@ -1,8 +1,11 @@
 #include "common.h"
+#include "interaction_graph.h"
+#include "similarity_cache.h"
+#include <cassert>
+#include <stdexcept>
 #include <glog/logging.h>
 
 
-FAST_ALLOCATOR( InteractionRecord )  InteractionRecord::s_allocator;
 FAST_ALLOCATOR( User )  User::s_allocator;
 FAST_ALLOCATOR( Item )  Item::s_allocator;
 
@@ -34,125 +37,176 @@ bool UserPtrCmp::operator() (const User *lhs,
                              const User *rhs) const
 { return lhs->ID() < rhs->ID(); };
 
+User* InteractionRecord::user() const
+{ return g_pUserDB->userAt( m_nUser ); }
+
 uint32_t InteractionRecord::userID() const
 { return user()->ID(); }
 
+Item* InteractionRecord::item() const
+{ return g_pItemDB->itemAt( m_nItem ); }
+
 uint32_t InteractionRecord::itemID() const
 { return item()->ID(); }
 
-/*
- * void User::sortInteractions( const InteractionRecordCmpFunc &cmp )
- * {
- *     for( uint32_t i = 1; i < N_INTERACTION_TYPE; ++i )
- *         sort( m_InteractionTable[i].begin(), m_InteractionTable[i].end(), cmp );
- * }
- *
- * void Item::sortInteractions( const InteractionRecordCmpFunc &cmp )
- * {
- *     for( uint32_t i = 1; i < N_INTERACTION_TYPE; ++i )
- *         sort( m_InteractionTable[i].begin(), m_InteractionTable[i].end(), cmp );
- * }
- */
 
-void User::addInteraction( InteractionRecord *p )
+InteractionStore::InteractionStore()
+        : m_nSize(0)
+        , m_arrChunks(new std::atomic<Chunk*>[MAX_CHUNKS])
 {
-    Item *pItem = p->item();
-    uint32_t  itemID = pItem->ID();
-    InteractionMap& _map = m_InteractionTable[ p->type() ];
-    boost::unique_lock< InteractionMap > lock(_map);
-    InteractionVector &vec = _map[ itemID ];
-    vec.push_back(p);
+    static std::atomic<uint64_t> s_nSerial(0);
+    m_nSerial = ++s_nSerial;
+
+    for (uint32_t i = 0; i != MAX_CHUNKS; ++i)
+        m_arrChunks[i].store( NULL, std::memory_order_relaxed );
 }
 
-ItemSet& User::interestedItemSet( bool update )
+InteractionStore::~InteractionStore()
 {
-    //!! double check
-    if (m_setInterestedItemPtrs.empty() || update) {
-        boost::unique_lock<User> lock(*this);
-        if (m_setInterestedItemPtrs.empty() || update)
-            updateInterest();
-    } // if
-    return m_setInterestedItemPtrs;
+    for (uint32_t i = 0; i != MAX_CHUNKS; ++i)
+        delete m_arrChunks[i].load( std::memory_order_relaxed );
 }
 
-std::set<uint32_t>& User::interestedItemIdSet( bool update )
+void InteractionStore::add( const InteractionRecord &rec )
 {
-    if (m_setInterestedItemIds.empty() || update) {
-        boost::unique_lock<User> lock(*this);
-        if (m_setInterestedItemIds.empty() || update)    
-            updateInterest();
+    AppendBuffer &buf = localBuffer();
+    buf.records[buf.n++] = rec;
+    if (buf.n == APPEND_BATCH) {
+        append( buf.records, buf.n );
+        buf.n = 0;
     } // if
-    return m_setInterestedItemIds;
 }
 
-void User::updateInterest()
+void InteractionStore::flush()
 {
-    m_setInterestedItemPtrs.clear();
-    m_setInterestedItemIds.clear();
-
-    for (uint32_t i = CLICK; i != DELETE; ++i) {
-        InteractionMap &iMap = this->interactionMap( i );
-        if (iMap.empty())
-            continue;
-        for (auto it = iMap.begin(); it != iMap.end(); ++it) {
-            InteractionVector &vec = it->second;
-            // assert( !vec.empty() );
-            InteractionRecord *pInt = vec[0];
-            Item* pItem = pInt->item();
-            m_setInterestedItemPtrs.insert( pItem );
-            m_setInterestedItemIds.insert( pItem->ID() );
-        } // for
+    boost::lock_guard<boost::mutex> lk( m_BufferMtx );
+    for (auto &pBuf : m_arrBuffers) {
+        append( pBuf->records, pBuf->n );
+        pBuf->n = 0;
     } // for
 }
 
-UserSet& Item::interestedUserSet( bool update )
+InteractionStore::AppendBuffer& InteractionStore::localBuffer()
 {
-    if (m_setInterestedUserPtrs.empty() || update) {
-        boost::unique_lock<Item> lock(*this);
-        if (m_setInterestedUserPtrs.empty() || update)
-            updateInterest();
+    // 本线程最近使用的 store 和缓冲区
+    static thread_local struct {
+        uint64_t        serial;
+        AppendBuffer    *pBuf;
+    } s_Local = { 0, NULL };
+
+    if (s_Local.serial == m_nSerial)
+        return *s_Local.pBuf;
+
+    boost::thread::id self = boost::this_thread::get_id();
+    boost::lock_guard<boost::mutex> lk( m_BufferMtx );
+    AppendBuffer *pBuf = NULL;
+    for (auto &p : m_arrBuffers) {
+        if (p->owner == self) {
+            pBuf = p.get();
+            break;
+        } // if
+    } // for
+    if (!pBuf) {
+        m_arrBuffers.push_back( std::unique_ptr<AppendBuffer>(new AppendBuffer) );
+        pBuf = m_arrBuffers.back().get();
+        pBuf->owner = self;
     } // if
-    return m_setInterestedUserPtrs;
+
+    s_Local.serial = m_nSerial;
+    s_Local.pBuf = pBuf;
+    return *pBuf;
 }
 
-std::set<uint32_t>& Item::interestedUserIdSet( bool update )
+void InteractionStore::append( const InteractionRecord *pRecords, std::size_t n )
 {
-    if (m_setInterestedUserIds.empty() || update) {
-        boost::unique_lock<Item> lock(*this);
-        if (m_setInterestedUserIds.empty() || update)
-            updateInterest();
-    } // if
-    return m_setInterestedUserIds;
+    if (!n)
+        return;
+
+    std::size_t pos = m_nSize.fetch_add( n, std::memory_order_acq_rel );
+    if (pos + n > (std::size_t)MAX_CHUNKS * CHUNK_SIZE)
+        throw std::runtime_error( "Too many interaction records!" );
+
+    for (std::size_t i = 0; i != n; ) {
+        std::size_t idx = pos + i;
+        Chunk *pChunk = getChunk( idx >> CHUNK_BITS );
+        std::size_t off = idx & (CHUNK_SIZE - 1);
+        std::size_t len = std::min( n - i, (std::size_t)CHUNK_SIZE - off );
+        for (std::size_t j = 0; j != len; ++j, ++off) {
+            const InteractionRecord &rec = pRecords[i + j];
+            pChunk->users[off] = rec.userIndex();
+            pChunk->items[off] = rec.itemIndex();
+            pChunk->times[off] = (uint32_t)rec.time();
+            pChunk->types[off] = (uint8_t)rec.type();
+        } // for j
+        i += len;
+    } // for i
 }
 
-void Item::updateInterest()
+// 第i个 Chunk, 不存在时分配, 多个线程同时分配时只保留一个
+InteractionStore::Chunk* InteractionStore::getChunk( std::size_t i )
 {
-    m_setInterestedUserPtrs.clear();
-    m_setInterestedUserIds.clear();
-
-    for (uint32_t i = CLICK; i != DELETE; ++i) {
-        InteractionMap &iMap = this->interactionMap( i );
-        if (iMap.empty())
-            continue;
-        for (auto it = iMap.begin(); it != iMap.end(); ++it) {
-            InteractionVector &vec = it->second;
-            // assert( !vec.empty() );
-            InteractionRecord *pInt = vec[0];
-            User *pUser = pInt->user();
-            m_setInterestedUserPtrs.insert( pUser );
-            m_setInterestedUserIds.insert( pUser->ID() );
-        } // for
-    } // for
+    Chunk *pChunk = m_arrChunks[i].load( std::memory_order_acquire );
+    if (pChunk)
+        return pChunk;
+
+    Chunk *pNew = new Chunk;
+    if (m_arrChunks[i].compare_exchange_strong(pChunk, pNew, std::memory_order_acq_rel))
+        return pNew;
+    delete pNew;
+    return pChunk;
 }
 
-void Item::addInteraction( InteractionRecord *p )
+/*
+ * void User::sortInteractions( const InteractionRecordCmpFunc &cmp )
+ * {
+ *     for( uint32_t i = 1; i < N_INTERACTION_TYPE; ++i )
+ *         sort( m_InteractionTable[i].begin(), m_InteractionTable[i].end(), cmp );
+ * }
+ *
+ * void Item::sortInteractions( const InteractionRecordCmpFunc &cmp )
+ * {
+ *     for( uint32_t i = 1; i < N_INTERACTION_TYPE; ++i )
+ *         sort( m_InteractionTable[i].begin(), m_InteractionTable[i].end(), cmp );
+ * }
+ */
+
+User::User( User &&rhs )
+    : m_ID(rhs.m_ID), m_nIndex(rhs.m_nIndex)
+    , m_nsetJobRoles(std::move(rhs.m_nsetJobRoles))
+    , m_nCareerLevel(rhs.m_nCareerLevel), m_DiscplineID(rhs.m_DiscplineID)
+    , m_IndustryID(rhs.m_IndustryID), m_strCountry(std::move(rhs.m_strCountry))
+    , m_nRegion(rhs.m_nRegion), m_nExperienceEntries(rhs.m_nExperienceEntries)
+    , m_nExperienceYears(rhs.m_nExperienceYears)
+    , m_nExperienceYearsCurrent(rhs.m_nExperienceYearsCurrent)
+    , m_nEduDegree(rhs.m_nEduDegree), m_nsetEduFields(std::move(rhs.m_nsetEduFields))
 {
-    User *pUser = p->user();
-    uint32_t  userID = pUser->ID();
-    InteractionMap& _map = m_InteractionTable[ p->type() ];
-    boost::unique_lock< InteractionMap > lock(_map);
-    InteractionVector &vec = _map[ userID ];
-    vec.push_back(p);
+    // 相似用户列表中的指针指向搬移前的位置, 只能在 buildIndex 之后计算
+    assert( rhs.m_arrSimilarUsers.empty() );
+}
+
+Span<uint32_t> User::interestedItemSet() const
+{
+    assert( g_pGraph && g_pGraph->interestsBuilt() );
+    return g_pGraph->userInterests( m_nIndex );
+}
+
+Item::Item( Item &&rhs )
+    : m_ID(rhs.m_ID), m_nIndex(rhs.m_nIndex)
+    , m_nsetTitle(std::move(rhs.m_nsetTitle))
+    , m_nCareerLevel(rhs.m_nCareerLevel), m_DiscplineID(rhs.m_DiscplineID)
+    , m_IndustryID(rhs.m_IndustryID), m_strCountry(std::move(rhs.m_strCountry))
+    , m_nRegion(rhs.m_nRegion), m_fLatitude(rhs.m_fLatitude)
+    , m_fLongitude(rhs.m_fLongitude), m_nEmploymentType(rhs.m_nEmploymentType)
+    , m_nsetTags(std::move(rhs.m_nsetTags)), m_tCreateTime(rhs.m_tCreateTime)
+    , m_bActive(rhs.m_bActive)
+{
+    assert( rhs.m_arrSimilarItems.empty() );
+}
+
+Span<uint32_t> Item::interestedUserSet() const
+{
+    assert( g_pGraph && g_pGraph->interestsBuilt() );
+    return g_pGraph->itemInterests( m_nIndex );
 }
 
 
@@ -172,6 +226,35 @@ void UserDB::addUser( const User_sptr &pUser )
         // LOG(WARNING) << errstr;
 }
 
+void UserDB::buildIndex( bool dense )
+{
+    assert( m_arrUsers.empty() );
+
+    m_arrUsers.reserve( size(true) );
+    for (uint32_t i = 0; i < HASH_SIZE; ++i) {
+        for (auto &v : m_UserDB[i])
+            m_arrUsers.push_back( v.second.get() );
+    } // for i
+    std::sort( m_arrUsers.begin(), m_arrUsers.end(), UserPtrCmp() );
+
+    if (dense) {
+        m_arrDenseUsers.reserve( m_arrUsers.size() );
+        for (User *pUser : m_arrUsers)
+            m_arrDenseUsers.emplace_back( std::move(*pUser) );
+        for (std::size_t i = 0; i != m_arrUsers.size(); ++i)
+            m_arrUsers[i] = &m_arrDenseUsers[i];
+        for (uint32_t i = 0; i < HASH_SIZE; ++i)
+            m_UserDB[i].clear();
+    } // if dense
+
+    uint32_t maxID = m_arrUsers.empty() ? 0 : m_arrUsers.back()->ID();
+    m_arrIdIndex.assign( maxID + 1, INVALID_INDEX );
+    for (uint32_t i = 0; i != (uint32_t)m_arrUsers.size(); ++i) {
+        m_arrUsers[i]->index() = i;
+        m_arrIdIndex[ m_arrUsers[i]->ID() ] = i;
+    } // for i
+}
+
 /*
  * void UserDB::sortInteractionsThreadFunc( uint32_t &index, boost::mutex &mtx,
  *                                     const InteractionRecordCmpFunc &cmp )
@@ -218,22 +301,33 @@ void ItemDB::addItem( const Item_sptr &pItem )
         // LOG(WARNING) << errstr;
 }
 
-float get_factor(std::size_t n)
+void ItemDB::buildIndex( bool dense )
 {
-    static const uint32_t SIZE = 1000;
-    static std::vector<float> values;
-    static std::once_flag onceFlag;
-
-    std::call_once(onceFlag, []{
-        values.resize(SIZE + 1);
-        for (std::size_t i = 1; i <= SIZE; ++i)
-            values[i] = 1.0 / std::log(1.0 + i);
-    });
-
-    if (n <= SIZE)
-        return values[n];
-
-    return (1.0 / std::log(1.0 + n));
+    assert( m_arrItems.empty() );
+
+    m_arrItems.reserve( size(true) );
+    for (uint32_t i = 0; i < HASH_SIZE; ++i) {
+        for (auto &v : m_ItemDB[i])
+            m_arrItems.push_back( v.second.get() );
+    } // for i
+    std::sort( m_arrItems.begin(), m_arrItems.end(), ItemPtrCmp() );
+
+    if (dense) {
+        m_arrDenseItems.reserve( m_arrItems.size() );
+        for (Item *pItem : m_arrItems)
+            m_arrDenseItems.emplace_back( std::move(*pItem) );
+        for (std::size_t i = 0; i != m_arrItems.size(); ++i)
+            m_arrItems[i] = &m_arrDenseItems[i];
+        for (uint32_t i = 0; i < HASH_SIZE; ++i)
+            m_ItemDB[i].clear();
+    } // if dense
+
+    uint32_t maxID = m_arrItems.empty() ? 0 : m_arrItems.back()->ID();
+    m_arrIdIndex.assign( maxID + 1, INVALID_INDEX );
+    for (uint32_t i = 0; i != (uint32_t)m_arrItems.size(); ++i) {
+        m_arrItems[i]->index() = i;
+        m_arrIdIndex[ m_arrItems[i]->ID() ] = i;
+    } // for i
 }
 
 /*
@@ -266,3 +360,91 @@ float get_factor(std::size_t n)
  * }
  */
 
+
+ModelGeneration::ModelGeneration()
+        : pUserDB(new UserDB)
+        , pItemDB(new ItemDB)
+        , pInteractStore(new InteractionStore)
+        , pGraph(new GraphHandle)
+        , nSimilarItemsK(0)
+        , nSimilarUsersK(0)
+        , nBaseRecords(0)
+        , id(0)
+{}
+
+// 在这里析构, 这时 GraphHandle 和 SimilarityCache 是完整类型
+ModelGeneration::~ModelGeneration()
+{}
+
+void ModelHandle::publish( Ptr pGen )
+{
+    pGen->id = m_nGeneration.load() + 1;
+    Ptr pOld = std::atomic_exchange( &m_pCurrent, pGen );
+    m_pRaw.store( pGen.get(), std::memory_order_release );
+    m_nGeneration.store( pGen->id, std::memory_order_release );
+
+    if (pOld) {
+        boost::lock_guard<boost::mutex> lk( m_RetiredMtx );
+        m_arrRetired.push_back( std::move(pOld) );
+    } // if
+    reclaim();
+}
+
+std::size_t ModelHandle::reclaim()
+{
+    // 与 GraphHandle::reclaim 相同, 计数为1说明已没有请求固定它, 宽限期结束
+    std::vector<Ptr> expired;
+    boost::unique_lock<boost::mutex> lk( m_RetiredMtx );
+    auto last = std::partition( m_arrRetired.begin(), m_arrRetired.end(),
+                                []( const Ptr &p ) { return p.use_count() > 1; } );
+    std::move( last, m_arrRetired.end(), std::back_inserter(expired) );
+    m_arrRetired.erase( last, m_arrRetired.end() );
+    std::size_t nLeft = m_arrRetired.size();
+    lk.unlock();
+
+    // 在锁外释放整个版本
+    for (const Ptr &pGen : expired)
+        LOG(INFO) << "Model generation " << pGen->id << " reclaimed.";
+    expired.clear();
+    return nLeft;
+}
+
+void ModelHandle::unpinnedAccess( const char *what )
+{
+    LOG(FATAL) << what << " accessed without a ModelPin while another thread is publishing.";
+}
+
+ModelPin::ModelPin( ModelHandle::Ptr pGen )
+        : m_pGen(std::move(pGen))
+        , m_pSaved(thread_context())
+{
+    m_pGraph = m_pGen->pGraph->current();
+    thread_context() = this;
+}
+
+ModelPin::ModelPin( ModelHandle::Ptr pGen, std::shared_ptr<InteractionGraph> pGraph )
+        : m_pGen(std::move(pGen))
+        , m_pGraph(std::move(pGraph))
+        , m_pSaved(thread_context())
+{
+    thread_context() = this;
+}
+
+ModelPin::~ModelPin()
+{
+    thread_context() = m_pSaved;
+}
+
+void ModelPin::run( const std::function<void()> &fn ) const
+{
+    ModelPin pin( m_pGen, m_pGraph );
+    fn();
+}
+
+void ModelPin::follow( std::shared_ptr<InteractionGraph> pGraph )
+{
+    // thread_context() 只会指向 ModelPin
+    ModelPin *pPin = const_cast<ModelPin*>( current() );
+    if (pPin)
+        pPin->m_pGraph = std::move( pGraph );
+}
@@ -5,6 +5,7 @@
 #include <string>
 #include <cstring>
 #include <memory>
+#include <atomic>
 #include <ctime>
 #include <set>
 #include <map>
@@ -15,10 +16,10 @@
 #include <functional>
 #include <ctime>
 #include <cmath>
-// #include <boost/pool/pool_alloc.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/lockable_adapter.hpp>
 #include "thread_pool.hpp"
+#include "slab_allocator.hpp"
 
 /*
  * About the allocator usage:
@@ -26,19 +27,27 @@
  * when dealing with containers such as std::list, and use pool_allocator when
  * dealing with containers such as std::vector.
  */
-// ?? even slower than STL's
-// #define FAST_ALLOCATOR(type)     boost::fast_pool_allocator<type>
-// #define POOL_ALLOCATOR(type)     boost::pool_allocator<type>
-#define FAST_ALLOCATOR(type)     std::allocator<type>
+// boost 的 pool allocator 每次分配都要加全局锁, 比 STL 的还慢.
+// FAST_ALLOCATOR 改用线程本地的 SlabAllocator, 见 slab_allocator.hpp,
+// 用于按节点分配的容器和 User, Item 的 operator new;
+// vector, string 等一次分配多个元素的仍用 std::allocator.
+#define FAST_ALLOCATOR(type)     SlabAllocator<type>
 #define POOL_ALLOCATOR(type)     std::allocator<type>
 
 
 class Item;
 class User;
 class InteractionRecord;
+class InteractionGraph;
+class GraphHandle;
+class GraphRef;
+class SimilarityCache;
+
+// UserDB/ItemDB 中表示ID不存在的下标
+const uint32_t INVALID_INDEX = (uint32_t)-1;
 
 /*
- * shared_ptr 仅用于存储数据，如 UserDB ItemDB InteractionStore.
+ * shared_ptr 仅用于存储数据，如 UserDB ItemDB.
  * 全局只存储一份。
  * 其他地方用到 User Item Interaction 等数据时一律用普通指针。
  */
@@ -51,6 +60,29 @@ typedef std::shared_ptr<const User> User_csptr;
 // typedef std::weak_ptr<User>         User_wptr;
 // typedef std::weak_ptr<const User>   User_cwptr;
 
+// 连续数组上的只读视图, 用于返回 InteractionGraph 中的数据
+template < typename T >
+class Span {
+public:
+    typedef T               value_type;
+    typedef const T*        iterator;
+    typedef const T*        const_iterator;
+
+    Span() : m_pData(NULL), m_nSize(0) {}
+    Span( const T *pData, std::size_t n ) : m_pData(pData), m_nSize(n) {}
+
+    const T* begin() const { return m_pData; }
+    const T* end() const { return m_pData + m_nSize; }
+    const T* data() const { return m_pData; }
+    std::size_t size() const { return m_nSize; }
+    bool empty() const { return !m_nSize; }
+    const T& operator[] ( std::size_t i ) const { return m_pData[i]; }
+
+private:
+    const T         *m_pData;
+    std::size_t     m_nSize;
+};
+
 // 存储推荐结果
 struct RcmdItem {
     Item          *pItem;   // 推荐的item
@@ -60,8 +92,8 @@ struct RcmdItem {
     RcmdItem( Item *_pItem, float _weight )
                : pItem(_pItem), weight(_weight) {}
 
-    bool operator < (const RcmdItem &rhs) const 
-    { return (weight > rhs.weight); }
+    // 按权重降序, 权重相同时按itemID升序, 保证排序结果唯一. 定义在Item之后
+    bool operator < (const RcmdItem &rhs) const;
 };
 
 
@@ -101,136 +133,128 @@ struct UserPtrCmp {
                      const User *rhs) const;
 };
 
-typedef std::set<Item*, ItemPtrCmp, FAST_ALLOCATOR(Item*)>   ItemSet;
-typedef std::set<User*, UserPtrCmp, FAST_ALLOCATOR(User*)>   UserSet;
-
 // 用户网站交互行为数据结构, 依据 interactions.csv
-// 包括user，item的指针，交互类型，时间
+// 值类型, user 和 item 用 UserDB/ItemDB 中的下标表示, 由 InteractionStore::record() 返回
 class InteractionRecord {
 public:
-    InteractionRecord() {}
-    InteractionRecord( User *pUser, Item *pItem,
-                    uint32_t type, const time_t &ts )
-        : m_pUser(pUser), m_pItem(pItem), m_nType(type), m_tTime(ts)
+    InteractionRecord()
+        : m_nUser(0), m_nItem(0), m_nType(0), m_nTime(0)
+    {}
+    InteractionRecord( uint32_t userIdx, uint32_t itemIdx,
+                    uint32_t type, uint32_t ts )
+        : m_nUser(userIdx), m_nItem(itemIdx), m_nType(type), m_nTime(ts)
     {}
 
-    User* user()
-    { return m_pUser; }
-    const User* user() const
-    { return m_pUser; }
+    uint32_t userIndex() const
+    { return m_nUser; }
+    User* user() const;
     uint32_t userID() const;
 
-    Item* item()
-    { return m_pItem; }
-    const Item* item() const
-    { return m_pItem; }
+    uint32_t itemIndex() const
+    { return m_nItem; }
+    Item* item() const;
     uint32_t itemID() const;
 
-    uint32_t& type()
-    { return m_nType; }
     uint32_t type() const
     { return m_nType; }
 
-    time_t& time()
-    { return m_tTime; }
-    const time_t& time() const
-    { return m_tTime; }
-
-    static void* operator new( std::size_t sz )
-    { return s_allocator.allocate( 1 ); }
-
-    static void operator delete( void *p )
-    { s_allocator.deallocate( static_cast<InteractionRecord*>(p), 1 ); }
+    time_t time() const
+    { return (time_t)m_nTime; }
 
 private:
-    User            *m_pUser;
-    Item            *m_pItem;
+    uint32_t        m_nUser;
+    uint32_t        m_nItem;
     uint32_t        m_nType;
-    time_t          m_tTime;
-
-    // not used memory op
-    static void* operator new[]( std::size_t sz );
-    static void operator delete[]( void *p );
-
-    static FAST_ALLOCATOR( InteractionRecord )  s_allocator;
+    uint32_t        m_nTime;
 };
 
-typedef std::shared_ptr< InteractionRecord >       InteractionRecord_sptr;
-typedef std::shared_ptr< const InteractionRecord > InteractionRecord_csptr;
-// typedef std::weak_ptr< InteractionRecord >         InteractionRecord_wptr;
-// typedef std::weak_ptr< const InteractionRecord >   InteractionRecord_cwptr;
-// typedef std::function<bool(const InteractionRecord*, const InteractionRecord*)>
-            // InteractionRecordCmpFunc;    // for sorting interactions
-
-// 存储 Interaction 记录, 仅作存储用途,使同一个interaction记录只存一份(new一次)，
-// 不提供查询服务
+/*
+ * 存储 Interaction 记录, 只追加的列式日志, 仅作存储用途, 不提供查询服务.
+ *
+ * 记录按追加顺序编号(32位), 每 CHUNK_SIZE 条一个 Chunk, Chunk 内按列存放
+ * user下标, item下标, 类型, 时间. Chunk 按需分配, 已分配的不会移动.
+ * 多线程 add 时先写入本线程的缓冲区, 满 APPEND_BATCH 条后一次领取一段连续编号写入日志,
+ * 不加锁. 各线程缓冲区中剩余的记录在 flush 之后才进入日志.
+ */
 class InteractionStore {
 public:
-    static const uint32_t HASH_SIZE = 10000;
+    static const uint32_t CHUNK_BITS = 16;
+    static const uint32_t CHUNK_SIZE = 1U << CHUNK_BITS;
+    static const uint32_t MAX_CHUNKS = 1U << (32 - CHUNK_BITS);
+    static const uint32_t APPEND_BATCH = 1024;
+
+    struct Chunk {
+        uint32_t    users[CHUNK_SIZE];
+        uint32_t    items[CHUNK_SIZE];
+        uint32_t    times[CHUNK_SIZE];
+        uint8_t     types[CHUNK_SIZE];
+    };
 
-    struct InteractArray
-        : std::vector< InteractionRecord_sptr, POOL_ALLOCATOR(InteractionRecord_sptr) >
-        , boost::basic_lockable_adapter< boost::mutex > {};
+public:
+    InteractionStore();
+    ~InteractionStore();
 
-    typedef InteractArray       InteractMatrix[ HASH_SIZE ];
+    // 可以多线程同时调用
+    void add( const InteractionRecord &rec );
 
-public:
-    InteractionStore() : m_nSize(0) {}
+    /**
+     * @brief 把各线程缓冲区中的记录写入日志, 之后 size() 和 record() 包含所有已 add 的记录.
+     *        调用时不能有其他线程在 add, 一般在导入完成后调用一次.
+     */
+    void flush();
 
-    InteractionStore( uint32_t reserveSize )
-    {
-        for( uint32_t i = 0; i < HASH_SIZE; ++i )
-            m_Store[i].reserve( reserveSize );
-    }
+    // 日志中的记录数, 不包括尚未 flush 的
+    std::size_t size() const
+    { return m_nSize.load( std::memory_order_acquire ); }
 
-    void add( const InteractionRecord_sptr &p )
+    InteractionRecord record( uint32_t idx ) const
     {
-        uint32_t ts = (uint32_t)(p->time());
-        InteractArray& arr = m_Store[ ts % HASH_SIZE ];
-        boost::unique_lock< InteractArray > lock( arr );
-        arr.push_back( p );
+        const Chunk &c = chunk( idx >> CHUNK_BITS );
+        uint32_t i = idx & (CHUNK_SIZE - 1);
+        return InteractionRecord( c.users[i], c.items[i], c.types[i], c.times[i] );
     }
 
-    std::size_t size( bool update = false )
-    {
-        if (!m_nSize || update) {
-            for( uint32_t i = 0; i < HASH_SIZE; ++i )
-                m_nSize += m_Store[i].size();
-        } // if
+    // 按列遍历: 第i个 Chunk 中有 chunkLength(i) 条记录
+    std::size_t nChunks() const
+    { return (size() + CHUNK_SIZE - 1) >> CHUNK_BITS; }
+    const Chunk& chunk( std::size_t i ) const
+    { return *m_arrChunks[i].load( std::memory_order_acquire ); }
+    std::size_t chunkLength( std::size_t i ) const
+    { return std::min( (std::size_t)CHUNK_SIZE, size() - (i << CHUNK_BITS) ); }
 
-        return m_nSize;
-    }
+private:
+    struct AppendBuffer {
+        AppendBuffer() : n(0) {}
+
+        boost::thread::id       owner;
+        uint32_t                n;
+        InteractionRecord       records[APPEND_BATCH];
+    };
 
-    InteractMatrix& content()
-    { return m_Store; }
-    const InteractMatrix& content() const
-    { return m_Store; }
+    InteractionStore( const InteractionStore& );
+    InteractionStore& operator = ( const InteractionStore& );
+
+    AppendBuffer& localBuffer();
+    void append( const InteractionRecord *pRecords, std::size_t n );
+    Chunk* getChunk( std::size_t i );
 
 private:
-    std::size_t                 m_nSize;
-    InteractMatrix              m_Store;
+    std::atomic<std::size_t>                    m_nSize;        // 已领取的编号数
+    std::unique_ptr< std::atomic<Chunk*>[] >    m_arrChunks;    // MAX_CHUNKS 个
+    uint64_t                                    m_nSerial;      // 区分不同的 store, 用于线程本地缓存
+    boost::mutex                                m_BufferMtx;
+    std::vector< std::unique_ptr<AppendBuffer> > m_arrBuffers;  // 各线程的缓冲区
 };
 
 
-/**
- * @brief 以下结构用于user和item的interaction记录
- * 每个user都有一个InteractionTable，记录着他交互过的items
- * 同样，每个item也有一个InteractionTable，记录着与它有过交互的users
- *
- * InteractionTable 是InteractionMap型的一维数组，数组长度是 N_INTERACTION_TYPE,
- * 数组下标代表某一类交互类型（如点击）的所有交互记录。
- *
- * InteractionMap 定义： {key = userid 或 itemid, value = InteractionRecord*[]}
+/*
+ * user 和 item 的交互记录不再存放在各自的对象中,
+ * interaction 数据导入后统一建立 InteractionGraph (CSR格式), 见 interaction_graph.h
  */
-struct InteractionVector
-        : std::vector< InteractionRecord*, POOL_ALLOCATOR(InteractionRecord*) >
-        , boost::basic_lockable_adapter< boost::mutex > {};
-// typedef std::vector< InteractionRecord_wptr, POOL_ALLOCATOR(InteractionRecord_wptr) > InteractionVector;
-typedef std::pair< uint32_t, InteractionVector > _InteractionMapValue;
-// InteractionMap {key=user/item id : value=interactionRecord ptr array}
-struct InteractionMap : std::map< uint32_t, InteractionVector, std::less<uint32_t>, FAST_ALLOCATOR(_InteractionMapValue) >
-                      , boost::basic_lockable_adapter< boost::mutex > {};
-typedef InteractionMap    InteractionTable[ N_INTERACTION_TYPE ];
+
+
+// 通用的线程池, 任务为无参函数
+typedef ThreadPool< std::function<void(void)> >     JobPool;
 
 
 // redefine the basic STL containers, replace their allocators
@@ -239,7 +263,7 @@ typedef std::basic_string< char, std::char_traits<char>, POOL_ALLOCATOR(char) >
 
 
 // 用户信息，依据 users.csv
-class User : public boost::basic_lockable_adapter< boost::mutex > {
+class User {
 public:
     enum EDU_DEGREE {
         UNKNOWN,
@@ -250,14 +274,45 @@ public:
     };
 
 public:
-    User() : m_ID(0), m_nCareerLevel(0), m_DiscplineID(0), m_IndustryID(0)
-           , m_nRegion(0), m_nExperienceEntries(0), m_nExperienceYears(0)
+    // 和该用户有相似度的用户
+    struct SimilarUser {
+        User *pOther;
+        float similarity;
+
+        SimilarUser() : pOther(NULL), similarity(0.0) {}
+        SimilarUser( User *_other, float _similarity )
+                : pOther(_other), similarity(_similarity) {}
+    };
+
+    /*
+     * 前k个最相似的用户, 按相似度从大到小, 相同时按ID升序.
+     * 由 get_all_users_similarity 整体写入(或从快照导入), 不会并发修改, 不加锁.
+     */
+    typedef std::vector<SimilarUser>    SimilarUserArray;
+
+    SimilarUserArray& similarUsers()
+    { return m_arrSimilarUsers; }
+    const SimilarUserArray& similarUsers() const
+    { return m_arrSimilarUsers; }
+
+public:
+    User() : m_ID(0), m_nIndex(INVALID_INDEX), m_nCareerLevel(0), m_DiscplineID(0)
+           , m_IndustryID(0), m_nRegion(0), m_nExperienceEntries(0), m_nExperienceYears(0)
            , m_nExperienceYearsCurrent(0), m_nEduDegree(0)
     {}
 
+    /*
+     * 仅用于 UserDB::buildIndex 把User搬到连续数组中, 锁不搬移
+     */
+    User( User &&rhs );
+
     uint32_t& ID() { return m_ID; }
     const uint32_t& ID() const { return m_ID; }
 
+    // 在UserDB中的连续下标 0..N-1, 按ID升序, UserDB::buildIndex 之后有效
+    uint32_t& index() { return m_nIndex; }
+    const uint32_t& index() const { return m_nIndex; }
+
     UIntSet& jobRoles()
     { return m_nsetJobRoles; }
     const UIntSet& jobRoles() const
@@ -319,24 +374,11 @@ public:
     void addEduFields( uint32_t id )
     { m_nsetEduFields.insert(id); }
 
-    void addInteraction( InteractionRecord *p );
-    InteractionTable& interactionTable()
-    { return m_InteractionTable; }
-    const InteractionTable& interactionTable() const
-    { return m_InteractionTable; }
-    InteractionMap& interactionMap( uint32_t type_index )
-    { return m_InteractionTable[ type_index ]; }
-    const InteractionMap& interactionMap( uint32_t type_index ) const
-    { return m_InteractionTable[ type_index ]; }
-
     /*
-     * 从InteractionTable中查询该用户的正反馈物品列表(除删除操作之外的)。
-     * 查询结果存储于成员变量 m_setInterestedItemPtrs, m_setInterestedItemIds 中;
-     * 返回的是成员变量的引用。
-     * update 指示是否重新搜索。由于本系统数据导入后不会在线更新，所以update一般为false
+     * 该用户的正反馈物品集合(除删除操作之外的), 是item下标的升序数组,
+     * 由 g_pGraph 提供, interaction 数据导入并建立 InteractionGraph 之后有效。
      */
-    ItemSet& interestedItemSet( bool update = false );
-    std::set<uint32_t>& interestedItemIdSet( bool update = false );
+    Span<uint32_t> interestedItemSet() const;
 
     static void* operator new( std::size_t sz )
     { return s_allocator.allocate( 1 ); }
@@ -344,11 +386,9 @@ public:
     static void operator delete( void *p )
     { s_allocator.deallocate( static_cast<User*>(p), 1 ); }
 
-private:
-    void updateInterest();
-
 private:
     uint32_t                m_ID;
+    uint32_t                m_nIndex;
     UIntSet                 m_nsetJobRoles;
     uint32_t                m_nCareerLevel;
     uint32_t                m_DiscplineID;
@@ -360,9 +400,7 @@ private:
     uint32_t                m_nExperienceYearsCurrent;
     uint32_t                m_nEduDegree;
     UIntSet                 m_nsetEduFields;
-    InteractionTable        m_InteractionTable;
-    ItemSet                 m_setInterestedItemPtrs;
-    std::set<uint32_t>      m_setInterestedItemIds;
+    SimilarUserArray        m_arrSimilarUsers;
 
     // not used memory op
     static void* operator new[]( std::size_t sz );
@@ -373,7 +411,7 @@ private:
 
 
 // Item 定义，依据 items.csv
-class Item : public boost::basic_lockable_adapter< boost::mutex > {
+class Item {
 public:
     enum EMPLOYMENT_TYPE {
         UNKNOWN,
@@ -399,36 +437,24 @@ public:
         { return similarity > rhs.similarity; }
     };
 
-    struct SimilarItemArray : std::vector<SimilarItem>
-                            , boost::basic_lockable_adapter<boost::mutex>
-    {};
+    /*
+     * 前k个最相似的物品, 按相似度从大到小, 相同时按ID升序.
+     * 每行只由一个线程用 setSimilarItems 整体写入(或从快照导入), 读者不加锁.
+     */
+    typedef std::vector<SimilarItem>    SimilarItemArray;
 
     /**
-     * @brief             添加相似物品
-     *
-     * @param pItem       相似物品
-     * @param similarity  相似度
-     * @param nItems      相似物品个数上限, 每个Item至多保存nItems个最相似物品
+     * @brief             整体设置相似物品列表, 每行由一个线程选出前k个后一次写入.
+     *                    items 应已按 similarity_greater 排好序, 与原列表交换
      */
-    void addSimilarItem( Item *pItem, float similarity, std::size_t nItems )
+    void setSimilarItems( std::vector<SimilarItem> &items )
+    { m_arrSimilarItems.swap( items ); }
+
+    // 相似度从大到小, 相同时ID小的在前
+    static bool similarity_greater( const SimilarItem &lhs, const SimilarItem &rhs )
     {
-        SimilarItem sItem(pItem, similarity);
-
-        boost::unique_lock<SimilarItemArray> lock(m_arrSimilarItems);
-        if (m_arrSimilarItems.size() < nItems) {
-            if (m_arrSimilarItems.empty()) {
-                m_arrSimilarItems.push_back( sItem );
-            } else {
-                auto it = lower_bound(m_arrSimilarItems.begin(), m_arrSimilarItems.end(), sItem);
-                m_arrSimilarItems.insert(it, sItem);
-            } // if empty
-        } else {
-            if (sItem.similarity > m_arrSimilarItems.back().similarity) {
-                m_arrSimilarItems.pop_back();
-                auto it = lower_bound(m_arrSimilarItems.begin(), m_arrSimilarItems.end(), sItem);
-                m_arrSimilarItems.insert(it, sItem);
-            } // if
-        } // if size
+        return lhs.similarity > rhs.similarity
+            || (lhs.similarity == rhs.similarity && lhs.pOther->ID() < rhs.pOther->ID());
     }
 
     SimilarItemArray& similarItems()
@@ -437,14 +463,21 @@ public:
     { return m_arrSimilarItems; }
 
 public:
-    Item() : m_ID(0), m_nCareerLevel(0), m_DiscplineID(0), m_IndustryID(0)
-           , m_nRegion(0), m_fLatitude(0.0), m_fLongitude(0.0)
+    Item() : m_ID(0), m_nIndex(INVALID_INDEX), m_nCareerLevel(0), m_DiscplineID(0)
+           , m_IndustryID(0), m_nRegion(0), m_fLatitude(0.0), m_fLongitude(0.0)
            , m_nEmploymentType(0), m_tCreateTime(0), m_bActive(false)
     {}
 
+    // 参见 User::User( User&& )
+    Item( Item &&rhs );
+
     uint32_t& ID() { return m_ID; }
     const uint32_t& ID() const { return m_ID; }
 
+    // 在ItemDB中的连续下标 0..N-1, 按ID升序, ItemDB::buildIndex 之后有效
+    uint32_t& index() { return m_nIndex; }
+    const uint32_t& index() const { return m_nIndex; }
+
     UIntSet& title()
     { return m_nsetTitle; }
     const UIntSet& title() const
@@ -513,22 +546,11 @@ public:
     void setActive( bool status = true )
     { m_bActive = status; }
 
-    void addInteraction( InteractionRecord *p );
-    InteractionTable& interactionTable()
-    { return m_InteractionTable; }
-    const InteractionTable& interactionTable() const
-    { return m_InteractionTable; }
-    InteractionMap& interactionMap( uint32_t type_index )
-    { return m_InteractionTable[ type_index ]; }
-    const InteractionMap& interactionMap( uint32_t type_index ) const
-    { return m_InteractionTable[ type_index ]; }
-
     /*
-     * 对该物品有正反馈用户集合
+     * 对该物品有正反馈用户集合, user下标的升序数组
      * 参见User::interestedItemSet()
      */
-    UserSet& interestedUserSet( bool update = false );
-    std::set<uint32_t>& interestedUserIdSet( bool update = false );
+    Span<uint32_t> interestedUserSet() const;
 
     static void* operator new( std::size_t sz )
     { return s_allocator.allocate( 1 ); }
@@ -536,11 +558,9 @@ public:
     static void operator delete( void *p )
     { s_allocator.deallocate( static_cast<Item*>(p), 1 ); }
 
-private:
-    void updateInterest();
-
 private:
     uint32_t                m_ID;
+    uint32_t                m_nIndex;
     UIntSet                 m_nsetTitle;
     uint32_t                m_nCareerLevel;
     uint32_t                m_DiscplineID;
@@ -553,9 +573,6 @@ private:
     UIntSet                 m_nsetTags;
     time_t                  m_tCreateTime;
     bool                    m_bActive;
-    InteractionTable        m_InteractionTable;
-    UserSet                 m_setInterestedUserPtrs;
-    std::set<uint32_t>      m_setInterestedUserIds;
     SimilarItemArray        m_arrSimilarItems;
 
     // not used memory op
@@ -567,8 +584,18 @@ private:
 
 
 
+inline
+bool RcmdItem::operator < (const RcmdItem &rhs) const
+{
+    return weight > rhs.weight
+           || (weight == rhs.weight && pItem->ID() < rhs.pItem->ID());
+}
+
+
 // 存储User的数据库，用userid做一次散列，再存到map中
 // 提供基于id的查询服务
+// 导入完成后调用 buildIndex 建立连续下标和 ID->下标 的平坦查询表,
+// 之后的查询都是O(1)的数组访问
 class UserDB {
 public:
     // total 150w users
@@ -584,6 +611,9 @@ public:
     typedef UserDBRecord            UserDBStorage[HASH_SIZE];
 
 public:
+    UserDB() : m_nSize(0) {}
+
+    // dense 模式下 buildIndex 之后为空, 应使用 users()
     UserDBStorage& content()
     { return m_UserDB; }
     const UserDBStorage& content() const
@@ -591,8 +621,23 @@ public:
 
     void addUser( const User_sptr &pUser );
 
+    /**
+     * @brief 为所有user分配连续下标 0..N-1(按ID升序), 建立 ID->下标 查询表.
+     *        users.csv 导入完成后, interaction 导入之前调用一次.
+     *
+     * @param dense   为true时把所有User搬到一个连续数组中, 释放原来的map和堆对象
+     */
+    void buildIndex( bool dense = false );
+
     bool queryUser( uint32_t id, User *&pRet )
     {
+        if (!m_arrIdIndex.empty()) {
+            if (id >= m_arrIdIndex.size() || m_arrIdIndex[id] == INVALID_INDEX)
+                return false;
+            pRet = m_arrUsers[ m_arrIdIndex[id] ];
+            return true;
+        } // if
+
         UserDBRecord &rec = m_UserDB[ id % HASH_SIZE ];
         auto it = rec.find( id );
         if( it != rec.end() ) {
@@ -602,9 +647,25 @@ public:
         return false;
     }
 
+    // 下标为idx的user, buildIndex 之后有效
+    User* userAt( uint32_t idx )
+    { return m_arrUsers[idx]; }
+    const User* userAt( uint32_t idx ) const
+    { return m_arrUsers[idx]; }
+
+    // 所有user, 按下标排列
+    const std::vector<User*>& users() const
+    { return m_arrUsers; }
+
+    uint32_t maxID() const
+    { return m_arrIdIndex.empty() ? 0 : (uint32_t)(m_arrIdIndex.size() - 1); }
+
     std::size_t size( bool update = false )
     {
+        if (!m_arrUsers.empty())
+            return m_arrUsers.size();
         if (!m_nSize || update) {
+            m_nSize = 0;
             for( uint32_t i = 0; i < HASH_SIZE; ++i )
                 m_nSize += m_UserDB[i].size();
         } // if
@@ -617,18 +678,21 @@ private:
     // void sortInteractionsThreadFunc( uint32_t &index, boost::mutex &mtx,
                                     // const InteractionRecordCmpFunc &cmp );
 
-    std::size_t         m_nSize;
-    UserDBStorage       m_UserDB;
+    std::size_t             m_nSize;
+    UserDBStorage           m_UserDB;
+    std::vector<User*>      m_arrUsers;       // 下标 -> User
+    std::vector<uint32_t>   m_arrIdIndex;     // ID -> 下标, 大小为 maxID + 1
+    std::vector<User>       m_arrDenseUsers;  // dense 模式下的User存储
 };
 
 
 // 存储Item的数据库，用itemid做一次散列，再存到map中
-// 提供基于id的查询服务
+// 提供基于id的查询服务, 参见 UserDB
 class ItemDB {
 public:
     // total 1358098 items
     static const uint32_t       HASH_SIZE = 1000;
-    typedef std::pair< uint32_t, Item_sptr >  _RecordType;
+    typedef std::pair< const uint32_t, Item_sptr >  _RecordType;
 
     struct ItemDBRecord
             : std::map< uint32_t, Item_sptr, std::less<uint32_t>, FAST_ALLOCATOR(_RecordType) >
@@ -640,6 +704,7 @@ public:
 public:
     ItemDB() : m_nSize(0) {}
 
+    // dense 模式下 buildIndex 之后为空, 应使用 items()
     ItemDBStorage& content()
     { return m_ItemDB; }
     const ItemDBStorage& content() const
@@ -647,8 +712,18 @@ public:
 
     void addItem( const Item_sptr &pItem );
 
+    // 参见 UserDB::buildIndex, items.csv 导入完成后调用一次
+    void buildIndex( bool dense = false );
+
     bool queryItem( uint32_t id, Item *&pRet )
     {
+        if (!m_arrIdIndex.empty()) {
+            if (id >= m_arrIdIndex.size() || m_arrIdIndex[id] == INVALID_INDEX)
+                return false;
+            pRet = m_arrItems[ m_arrIdIndex[id] ];
+            return true;
+        } // if
+
         ItemDBRecord &rec = m_ItemDB[ id % HASH_SIZE ];
         auto it = rec.find( id );
         if( it != rec.end() ) {
@@ -658,9 +733,25 @@ public:
         return false;
     }
 
+    // 下标为idx的item, buildIndex 之后有效
+    Item* itemAt( uint32_t idx )
+    { return m_arrItems[idx]; }
+    const Item* itemAt( uint32_t idx ) const
+    { return m_arrItems[idx]; }
+
+    // 所有item, 按下标排列
+    const std::vector<Item*>& items() const
+    { return m_arrItems; }
+
+    uint32_t maxID() const
+    { return m_arrIdIndex.empty() ? 0 : (uint32_t)(m_arrIdIndex.size() - 1); }
+
     std::size_t size( bool update = false )
     {
+        if (!m_arrItems.empty())
+            return m_arrItems.size();
         if (!m_nSize || update) {
+            m_nSize = 0;
             for( uint32_t i = 0; i < HASH_SIZE; ++i )
                 m_nSize += m_ItemDB[i].size();
         } // if
@@ -673,21 +764,171 @@ private:
     // void sortInteractionsThreadFunc( uint32_t &index, boost::mutex &mtx,
                                     // const InteractionRecordCmpFunc &cmp );
 
-    std::size_t         m_nSize;
-    ItemDBStorage       m_ItemDB;
+    std::size_t             m_nSize;
+    ItemDBStorage           m_ItemDB;
+    std::vector<Item*>      m_arrItems;       // 下标 -> Item
+    std::vector<uint32_t>   m_arrIdIndex;     // ID -> 下标, 大小为 maxID + 1
+    std::vector<Item>       m_arrDenseItems;  // dense 模式下的Item存储
 };
 
 
-extern std::unique_ptr< UserDB >        g_pUserDB;
-extern std::unique_ptr< ItemDB >        g_pItemDB;
-extern std::unique_ptr< InteractionStore > g_InteractStore;
+/**
+ * @brief 一个版本的模型: 数据库, 交互关系图, 相似列表. 发布之后只有交互关系图随流式导入更新
+ */
+struct ModelGeneration {
+    ModelGeneration();
+    ~ModelGeneration();
+
+    std::unique_ptr< UserDB >           pUserDB;
+    std::unique_ptr< ItemDB >           pItemDB;
+    std::unique_ptr< InteractionStore > pInteractStore;
+    std::unique_ptr< GraphHandle >      pGraph;
+    std::unique_ptr< SimilarityCache >  pSimilarityCache;  // 按需计算的相似物品列表, 仅 ItemCF_lazy 使用
+    std::size_t                         nSimilarItemsK;    // Item::similarItems() 的k, 0表示尚未计算
+    std::size_t                         nSimilarUsersK;    // User::similarUsers() 的k, 0表示尚未计算
+    std::size_t                         nBaseRecords;      // pInteractStore 中来自建模输入的记录数, 之后是 -n 和流式导入追加的
+    uint64_t                            id;                // 发布时的序号, 从1开始
+
+private:
+    ModelGeneration( const ModelGeneration& );
+    ModelGeneration& operator = ( const ModelGeneration& );
+};
+
+/**
+ * @brief 当前服务的模型版本, 即全局的 g_Model. 重新建模时整体替换(RCU方式)
+ *
+ * 请求开始时用 ModelPin 固定当前版本, 请求期间本线程(包括它发起的 parallel_for)
+ * 经 g_pUserDB, g_pItemDB, g_pGraph 等访问的都是这个版本. 新版本在后台建好后用
+ * publish 替换, 已开始的请求在旧版本上完成, 新请求用新版本.
+ * 被替换的版本在所有固定它的请求结束后(宽限期)由 reclaim 释放, 释放在发布者的线程进行.
+ * 没有固定版本的线程访问的是最新发布的版本, 只能在没有并发的发布者时这样使用:
+ * 与读者并发的发布者(流式导入, 后台重新建模)在 beginPublishing 和 endPublishing 之间登记,
+ * 期间不固定就经 g_Model 或 g_pGraph 访问, 拿到的对象随时可能被释放, 直接终止程序.
+ */
+class ModelHandle {
+public:
+    typedef std::shared_ptr<ModelGeneration>    Ptr;
+
+public:
+    ModelHandle() : m_pRaw(NULL), m_nGeneration(0), m_nPublishers(0) {}
+
+    // 本线程固定的版本, 没有固定时为最新发布的
+    ModelGeneration* get() const;
+    ModelGeneration* operator -> () const { return get(); }
+    ModelGeneration& operator * () const { return *get(); }
+
+    // 最新发布的版本
+    Ptr current() const
+    { return std::atomic_load( &m_pCurrent ); }
+
+    // 发布新版本, 替换下来的版本等宽限期过后释放
+    void publish( Ptr pGen );
+
+    // 释放已没有请求使用的旧版本, 返回尚未释放的个数
+    std::size_t reclaim();
+
+    // 最新发布的版本的序号
+    uint64_t generation() const
+    { return m_nGeneration.load( std::memory_order_acquire ); }
+
+    // 登记与读者并发的发布者, 在它开始发布之前调用
+    void beginPublishing() { m_nPublishers.fetch_add( 1 ); }
+    void endPublishing() { m_nPublishers.fetch_sub( 1 ); }
+    bool publishing() const
+    { return m_nPublishers.load( std::memory_order_relaxed ) != 0; }
+
+    // 有并发的发布者时不固定就访问 what, 终止程序
+    static void unpinnedAccess( const char *what );
+
+    /**
+     * @brief 向当前版本并入新记录与换代互斥: 流式导入持有它检查版本并发布新图,
+     *        重新建模持有它补上旧版本最后并入的记录并换代, 这样每批记录恰好进入新版本一次
+     */
+    boost::mutex& updateMutex() { return m_UpdateMtx; }
+
+private:
+    ModelHandle( const ModelHandle& );
+    ModelHandle& operator = ( const ModelHandle& );
+
+    Ptr                             m_pCurrent;
+    std::atomic<ModelGeneration*>   m_pRaw;
+    std::atomic<uint64_t>           m_nGeneration;
+    std::atomic<uint32_t>           m_nPublishers;
+    boost::mutex                    m_UpdateMtx;
+    boost::mutex                    m_RetiredMtx;
+    std::vector<Ptr>                m_arrRetired;
+};
+
+extern ModelHandle                      g_Model;
+
+/**
+ * @brief 在作用域内固定一个模型版本, 默认为当前发布的版本, 同时固定它当前的交互关系图.
+ *        建立新版本时用它固定尚未发布的版本, 导入函数就会写入新版本.
+ *
+ * 固定是本线程的上下文(thread_context() 只会指向 ModelPin), 可以嵌套, 最内层的生效.
+ * parallel_for 在执行区间的线程上用 run 建立同样的固定, 整个请求用的是同一个版本和同一个图.
+ */
+class ModelPin : public ThreadContext {
+public:
+    explicit ModelPin( ModelHandle::Ptr pGen = g_Model.current() );
+    ~ModelPin();
+
+    ModelGeneration* generation() const { return m_pGen.get(); }
+    InteractionGraph* graph() const { return m_pGraph.get(); }
+
+    // 在本线程固定同一个版本和图, 执行 fn. 由 parallel_for 调用
+    virtual void run( const std::function<void()> &fn ) const;
+
+    // 本线程最内层的固定, 没有时为NULL
+    static const ModelPin* current()
+    { return static_cast<const ModelPin*>( thread_context() ); }
+
+    // 本线程向固定的版本发布新图之后改为固定新图, 写者看到自己写入的图. 由 GraphRef 调用
+    static void follow( std::shared_ptr<InteractionGraph> pGraph );
+
+private:
+    ModelPin( ModelHandle::Ptr pGen, std::shared_ptr<InteractionGraph> pGraph );
+    ModelPin( const ModelPin& );
+    ModelPin& operator = ( const ModelPin& );
+
+    ModelHandle::Ptr                    m_pGen;
+    std::shared_ptr<InteractionGraph>   m_pGraph;
+    const ThreadContext                 *m_pSaved;      // 外层的固定
+};
+
+inline ModelGeneration* ModelHandle::get() const
+{
+    if (const ModelPin *pPin = ModelPin::current())
+        return pPin->generation();
+    if (publishing())
+        unpinnedAccess( "g_Model" );
+    return m_pRaw.load( std::memory_order_acquire );
+}
+
+/**
+ * @brief 本线程所用模型版本中的一项数据, 用法同原来的 std::unique_ptr 全局变量
+ */
+template < typename T, std::unique_ptr<T> ModelGeneration::*Member >
+class ModelRef {
+public:
+    T* get() const { return (g_Model.get()->*Member).get(); }
+    T* operator -> () const { return get(); }
+    T& operator * () const { return *get(); }
+    explicit operator bool () const { return get() != NULL; }
+
+    void reset( T *p = NULL ) { (g_Model.get()->*Member).reset( p ); }
+};
+
+extern ModelRef< UserDB, &ModelGeneration::pUserDB >                    g_pUserDB;
+extern ModelRef< ItemDB, &ModelGeneration::pItemDB >                    g_pItemDB;
+extern ModelRef< InteractionStore, &ModelGeneration::pInteractStore >   g_InteractStore;
+extern GraphRef                         g_pGraph;        // 见 interaction_graph.h
+extern ModelRef< SimilarityCache, &ModelGeneration::pSimilarityCache >  g_pSimilarityCache;
+extern std::unique_ptr< JobPool >       g_pThreadPool;   // 全局线程池, g_nMaxThread 个工作线程
 extern uint32_t                         g_nMaxUserID;
 extern uint32_t                         g_nMaxItemID;
 extern uint32_t                         g_nMaxThread;
 
-// 备忘录法计算 1 / log(1 + n)
-extern float get_factor(std::size_t n);
-
 template < typename T >
 bool read_from_string( const char *s, T &value )
 {
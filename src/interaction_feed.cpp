@@ -0,0 +1,182 @@
+#include "interaction_feed.h"
+#include "interaction_graph.h"
+#include <glog/logging.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+
+
+InteractionFeed::InteractionFeed( const std::string &filename, Parser parser,
+                                  std::size_t batchSize, uint32_t interval )
+        : m_strFilename(filename)
+        , m_Parser(std::move(parser))
+        , m_nBatchSize(batchSize ? batchSize : 1)
+        , m_nInterval(interval)
+        , m_nFd(-1)
+        , m_bStop(false)
+        , m_nRecords(0)
+        , m_nEpochs(0)
+        , m_nLineNo(0)
+        , m_nPendingLines(0)
+{}
+
+InteractionFeed::~InteractionFeed()
+{
+    stop();
+}
+
+void InteractionFeed::start()
+{
+    // 非阻塞打开, 命名管道还没有写者时不会卡住
+    m_nFd = ::open( m_strFilename.c_str(), O_RDONLY | O_NONBLOCK );
+    if (m_nFd < 0) {
+        std::ostringstream ss;
+        ss << "InteractionFeed cannot open " << m_strFilename << ": " << strerror(errno);
+        throw std::runtime_error( ss.str() );
+    } // if
+
+    m_bStop = false;
+    g_Model.beginPublishing();
+    m_Thread = boost::thread( &InteractionFeed::run, this );
+}
+
+void InteractionFeed::stop()
+{
+    if (m_nFd < 0)
+        return;
+
+    m_bStop = true;
+    if (m_Thread.joinable())
+        m_Thread.join();
+    ::close( m_nFd );
+    m_nFd = -1;
+    g_Model.endPublishing();
+}
+
+void InteractionFeed::run()
+{
+    const std::size_t   BUF_SIZE = 64 * 1024;
+    const auto          POLL_INTERVAL = std::chrono::milliseconds(10);
+
+    std::vector<char> buf( BUF_SIZE );
+
+    while (true) {
+        // 先取标志再读, 置位之后至少还会读到一次文件末尾
+        bool stopping = m_bStop;
+
+        ssize_t n = ::read( m_nFd, &buf[0], buf.size() );
+        if (n > 0) {
+            consume( &buf[0], &buf[0] + n );
+            if (m_nPendingLines >= m_nBatchSize)
+                publish();
+            continue;
+        } // if
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN) {
+            LOG(ERROR) << "InteractionFeed read " << m_strFilename << " fail: " << strerror(errno);
+            stopping = true;
+        } // if
+
+        // 暂时没有新内容, 普通文件读到末尾或管道中没有数据
+        if (stopping && !m_strPartial.empty()) {
+            // 最后一行没有换行符
+            addLine( m_strPartial.data(), m_strPartial.data() + m_strPartial.size() );
+            m_strPartial.clear();
+        } // if
+        if (m_nPendingLines && (stopping || std::chrono::steady_clock::now() - m_tFirstPending
+                                                    >= std::chrono::milliseconds(m_nInterval)))
+            publish();
+        if (stopping)
+            break;
+
+        std::this_thread::sleep_for( POLL_INTERVAL );
+    } // while
+}
+
+void InteractionFeed::consume( const char *p, const char *end )
+{
+    while (p != end) {
+        const char *nl = (const char*)memchr( p, '\n', end - p );
+        if (!nl) {
+            m_strPartial.append( p, end );
+            return;
+        } // if
+
+        if (m_strPartial.empty()) {
+            addLine( p, nl );
+        } else {
+            m_strPartial.append( p, nl );
+            addLine( m_strPartial.data(), m_strPartial.data() + m_strPartial.size() );
+            m_strPartial.clear();
+        } // if
+        p = nl + 1;
+    } // while
+}
+
+void InteractionFeed::addLine( const char *pLine, const char *pEnd )
+{
+    if (!m_nPendingLines)
+        m_tFirstPending = std::chrono::steady_clock::now();
+    m_strPending.append( pLine, pEnd );
+    m_strPending += '\n';
+    ++m_nPendingLines;
+}
+
+void InteractionFeed::parse()
+{
+    // 标题行和格式错误的行由 parser 跳过
+    m_arrBatch.clear();
+    const char *p = m_strPending.data(), *end = p + m_strPending.size();
+    while (p != end) {
+        const char *nl = (const char*)memchr( p, '\n', end - p );
+        InteractionRecord rec;
+        if (m_Parser( p, nl, ++m_nLineNo, rec ))
+            m_arrBatch.push_back( rec );
+        p = nl + 1;
+    } // while
+}
+
+void InteractionFeed::publish()
+{
+    const uint32_t nLineNo = m_nLineNo;
+
+    while (true) {
+        // 行中的 ID 要在并入的模型版本上转换成下标, 解析和建图都在同一个版本上
+        ModelPin pin;
+        m_nLineNo = nLineNo;
+        parse();
+        if (m_arrBatch.empty())
+            break;
+
+        GraphHandle::Ptr pBase = g_pGraph.current();
+        GraphHandle::Ptr pGraph = std::make_shared<InteractionGraph>();
+        pGraph->buildFrom( *pBase, m_arrBatch );
+
+        boost::lock_guard<boost::mutex> lk( g_Model.updateMutex() );
+        if (g_Model.current().get() != pin.generation()) {
+            // 建图期间模型换代了, 这批记录在新版本上重来
+            LOG(INFO) << "InteractionFeed: model generation changed, merging "
+                      << m_arrBatch.size() << " records into generation " << g_Model.generation();
+            continue;
+        } // if
+
+        // 只有本线程向 g_InteractStore 追加, 可以直接 flush
+        for (const InteractionRecord &rec : m_arrBatch)
+            g_InteractStore->add( rec );
+        g_InteractStore->flush();
+
+        g_pGraph.publish( std::move(pGraph) );
+
+        m_nRecords += m_arrBatch.size();
+        ++m_nEpochs;
+        DLOG(INFO) << "InteractionFeed epoch " << g_pGraph.epoch() << ": " << m_arrBatch.size() << " records";
+        break;
+    } // while
+
+    m_strPending.clear();
+    m_nPendingLines = 0;
+}
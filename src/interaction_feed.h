@@ -0,0 +1,87 @@
+#ifndef _INTERACTION_FEED_H_
+#define _INTERACTION_FEED_H_
+
+#include "common.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <boost/thread.hpp>
+
+/**
+ * @brief 流式导入交互记录: 跟踪一个只追加的文件或命名管道, 新记录按 epoch 并入 g_pGraph
+ *
+ * 后台线程不断读出新写入的行, 攒够 batchSize 行或距这批第一行超过 interval
+ * 毫秒时, 在当前的模型版本上解析这批行, 用 InteractionGraph::buildFrom 由当前的图和
+ * 这批记录建立新图, 再发布到 g_pGraph, 同时追加到 g_InteractStore.
+ * 新图发布之前读者看不到这批记录的任何一条. 读者需用 ModelPin 固定请求期间使用的图.
+ * 发布前在 ModelHandle::updateMutex 下检查模型是否已经换代, 换代了就在新版本上重新解析并入;
+ * 换代前并入旧版本的记录由重新建模带到新版本.
+ * 每次发布只重建这批记录涉及的行, 其余各行与原图共用, 补丁积累多了才整体归并(见 buildFrom).
+ * batchSize 和 interval 越大发布越少, 新记录可见得越晚.
+ */
+class InteractionFeed {
+public:
+    /**
+     * @brief 解析一行, 成功时填入 rec. 会在导入线程中调用
+     * @param lineno    行号, 从1开始
+     */
+    typedef std::function<bool(const char *pLine, const char *pEnd,
+                               uint32_t lineno, InteractionRecord &rec)>   Parser;
+
+public:
+    InteractionFeed( const std::string &filename, Parser parser,
+                     std::size_t batchSize = 4096, uint32_t interval = 200 );
+    ~InteractionFeed();
+
+    /**
+     * @brief 打开文件, 启动导入线程. 文件无法打开时抛出 runtime_error
+     */
+    void start();
+
+    /**
+     * @brief 读完文件中当前已有的内容, 发布最后一个 epoch 后结束导入线程
+     */
+    void stop();
+
+    // 已并入 g_pGraph 的记录数, 不包括解析失败的行
+    std::size_t records() const { return m_nRecords; }
+    // 发布新图的次数
+    std::size_t epochs() const { return m_nEpochs; }
+
+private:
+    InteractionFeed( const InteractionFeed& );
+    InteractionFeed& operator = ( const InteractionFeed& );
+
+    void run();
+    // 收下 [p, end) 中的完整行, 最后不完整的一行留到下次
+    void consume( const char *p, const char *end );
+    void addLine( const char *pLine, const char *pEnd );
+    // 解析攒下的行, 并入当前模型版本的图
+    void publish();
+    // 在本线程固定的版本上解析攒下的行, 结果放在 m_arrBatch
+    void parse();
+
+private:
+    std::string                     m_strFilename;
+    Parser                          m_Parser;
+    std::size_t                     m_nBatchSize;
+    uint32_t                        m_nInterval;      // ms
+    int                             m_nFd;
+    boost::thread                   m_Thread;
+    std::atomic<bool>               m_bStop;
+    std::atomic<std::size_t>        m_nRecords;
+    std::atomic<std::size_t>        m_nEpochs;
+
+    // 以下只有导入线程访问
+    std::string                     m_strPartial;     // 上次读到的不完整的行
+    uint32_t                        m_nLineNo;
+    std::string                     m_strPending;     // 尚未发布的行, 每行以'\n'结尾
+    std::size_t                     m_nPendingLines;
+    std::vector<InteractionRecord>  m_arrBatch;
+    std::chrono::steady_clock::time_point   m_tFirstPending;
+};
+
+#endif
+
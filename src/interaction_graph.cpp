@@ -0,0 +1,539 @@
+#include "interaction_graph.h"
+#include "snapshot.h"
+#include <glog/logging.h>
+
+
+// 正反馈集合大小为 sz 时的 factor: 1/log(1+sz), 集合为空时为0
+static inline
+float degree_factor( std::size_t sz )
+{ return sz ? (float)(1.0 / std::log(1.0 + sz)) : 0.0f; }
+
+void InteractionGraph::Adjacency::build( std::size_t n, const std::vector<uint32_t> &counts )
+{
+    pStorage = std::make_shared<Storage>();
+    std::vector<uint32_t> &offsets = pStorage->offsets;
+    offsets.resize( n * N_INTERACTION_TYPE + 1 );
+    offsets[0] = 0;
+    for (std::size_t i = 0; i != counts.size(); ++i)
+        offsets[i + 1] = offsets[i] + counts[i];
+    pStorage->edges.resize( offsets.back() );
+    patches.clear();
+    nPatches = 0;
+    nPatchedEdges = 0;
+    bind();
+}
+
+void InteractionGraph::Adjacency::buildInterests( std::size_t n )
+{
+    const std::size_t GRAIN = 256;
+    const std::vector<uint32_t> &offsets = pStorage->offsets;
+    const std::vector<Edge> &edges = pStorage->edges;
+
+    // 每行 CLICK, BOOKMARK, REPLY 三段在 edges 中相邻, 先复制到 raw 的相同位置, 行内排序去重
+    std::vector<uint32_t> raw( edges.size() );
+    std::vector<uint32_t> counts( n );
+    g_pThreadPool->parallel_for( 0, n, GRAIN, [&]( std::size_t first, std::size_t last ) {
+        for (std::size_t idx = first; idx != last; ++idx) {
+            uint32_t b = offsets[idx * N_INTERACTION_TYPE + CLICK];
+            uint32_t e = offsets[idx * N_INTERACTION_TYPE + DELETE];
+            for (uint32_t k = b; k != e; ++k)
+                raw[k] = edges[k].index;
+            std::sort( raw.begin() + b, raw.begin() + e );
+            counts[idx] = (uint32_t)(std::unique(raw.begin() + b, raw.begin() + e) - (raw.begin() + b));
+        } // for idx
+    } );
+
+    std::vector<uint32_t> &interestOffsets = pStorage->interestOffsets;
+    interestOffsets.resize( n + 1 );
+    interestOffsets[0] = 0;
+    for (std::size_t idx = 0; idx != n; ++idx)
+        interestOffsets[idx + 1] = interestOffsets[idx] + counts[idx];
+
+    std::vector<uint32_t> &interests = pStorage->interests;
+    std::vector<uint32_t>( interestOffsets[n] ).swap( interests );
+    g_pThreadPool->parallel_for( 0, n, GRAIN, [&]( std::size_t first, std::size_t last ) {
+        for (std::size_t idx = first; idx != last; ++idx) {
+            auto it = raw.begin() + offsets[idx * N_INTERACTION_TYPE + CLICK];
+            std::copy( it, it + counts[idx], interests.begin() + interestOffsets[idx] );
+        } // for idx
+    } );
+
+    bind();
+    interestsBuilt = true;
+}
+
+void InteractionGraph::Adjacency::buildFactors( std::size_t n )
+{
+    std::shared_ptr<Degrees> pNew = std::make_shared<Degrees>();
+    pNew->degrees.resize( n );
+    pNew->factors.resize( n );
+    g_pThreadPool->parallel_for( 0, n, 1024, [&]( std::size_t first, std::size_t last ) {
+        for (std::size_t idx = first; idx != last; ++idx) {
+            std::size_t sz = interest( (uint32_t)idx ).size();
+            pNew->degrees[idx] = (float)sz;
+            pNew->factors[idx] = degree_factor( sz );
+        } // for idx
+    } );
+    pDegrees = pNew;
+}
+
+bool InteractionGraph::Adjacency::merge( const Adjacency &base, std::size_t n,
+                                         std::vector< std::pair<uint32_t, Edge> > &added,
+                                         std::vector<uint32_t> &rows )
+{
+    const std::size_t nSegs = n * N_INTERACTION_TYPE;
+
+    std::sort( added.begin(), added.end(), []( const std::pair<uint32_t, Edge> &lhs,
+                                               const std::pair<uint32_t, Edge> &rhs )->bool
+            { return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second); } );
+
+    // 涉及的行, 第r个是 rows[r], 新增记录在 added 中的 [rowStarts[r], rowStarts[r+1])
+    std::vector<uint32_t> rowStarts;
+    rows.clear();
+    for (std::size_t a = 0; a != added.size(); ++a) {
+        uint32_t idx = added[a].first / N_INTERACTION_TYPE;
+        if (rows.empty() || rows.back() != idx) {
+            rows.push_back( idx );
+            rowStarts.push_back( (uint32_t)a );
+        } // if
+    } // for a
+    rowStarts.push_back( (uint32_t)added.size() );
+
+    // 一段的原有记录与新记录归并到 out, 两边都已有序, 相同时原有的在前
+    auto mergeSegment = []( EdgeSpan seg, std::vector< std::pair<uint32_t, Edge> >::const_iterator q,
+                            std::vector< std::pair<uint32_t, Edge> >::const_iterator qEnd, Edge *out ) {
+        const Edge *p = seg.begin(), *pEnd = seg.end();
+        while (p != pEnd && q != qEnd) {
+            if (q->second < *p)
+                *out++ = (q++)->second;
+            else
+                *out++ = *p++;
+        } // while
+        out = std::copy( p, pEnd, out );
+        for (; q != qEnd; ++q)
+            *out++ = q->second;
+    };
+
+    // 补丁之后补丁中的交互数
+    std::size_t nPatched = base.nPatchedEdges + added.size();
+    for (uint32_t idx : rows) {
+        if (base.patch(idx))
+            continue;
+        for (uint32_t t = 0; t != N_INTERACTION_TYPE; ++t)
+            nPatched += base.row( idx, t ).size();
+    } // for
+
+    if (nPatched * COMPACT_RATIO <= base.nEdges + added.size()) {
+        pStorage = base.pStorage;
+        offsetView = base.offsetView;
+        edgeView = base.edgeView;
+        interestOffsetView = base.interestOffsetView;
+        interestView = base.interestView;
+        interestsBuilt = true;
+        pDegrees = base.pDegrees;
+        patches.share( base.patches, n );
+
+        std::vector< std::shared_ptr<Patch> > built( rows.size() );
+        g_pThreadPool->parallel_for( 0, rows.size(), 16, [&]( std::size_t first, std::size_t last ) {
+            for (std::size_t r = first; r != last; ++r) {
+                std::shared_ptr<Patch> pPatch = std::make_shared<Patch>();
+                Patch &p = *pPatch;
+                p.idx = rows[r];
+                auto q = added.cbegin() + rowStarts[r], qEnd = added.cbegin() + rowStarts[r + 1];
+                p.offsets[0] = 0;
+                for (uint32_t t = 0; t != N_INTERACTION_TYPE; ++t) {
+                    auto qt = q;
+                    while (qt != qEnd && qt->first == p.idx * N_INTERACTION_TYPE + t)
+                        ++qt;
+                    p.offsets[t + 1] = p.offsets[t] + (uint32_t)(base.row(p.idx, t).size() + (qt - q));
+                    q = qt;
+                } // for t
+                p.edges.resize( p.offsets[N_INTERACTION_TYPE] );
+                q = added.cbegin() + rowStarts[r];
+                for (uint32_t t = 0; t != N_INTERACTION_TYPE; ++t) {
+                    auto qt = q;
+                    while (qt != qEnd && qt->first == p.idx * N_INTERACTION_TYPE + t)
+                        ++qt;
+                    mergeSegment( base.row(p.idx, t), q, qt, p.edges.data() + p.offsets[t] );
+                    q = qt;
+                } // for t
+
+                for (uint32_t k = p.offsets[CLICK]; k != p.offsets[DELETE]; ++k)
+                    p.interests.push_back( p.edges[k].index );
+                std::sort( p.interests.begin(), p.interests.end() );
+                p.interests.erase( std::unique(p.interests.begin(), p.interests.end()), p.interests.end() );
+                p.degree = (float)p.interests.size();
+                p.factor = degree_factor( p.interests.size() );
+                built[r] = pPatch;
+            } // for r
+        } );
+
+        // 原有的补丁中没有重建的行继续共用
+        nEdges = base.nEdges + added.size();
+        nInterests = base.nInterests;
+        nPatches = base.nPatches;
+        nPatchedEdges = base.nPatchedEdges;
+        for (std::size_t r = 0; r != rows.size(); ++r) {
+            const Patch &p = *built[r];
+            if (const Patch *pOld = base.patch( p.idx ))
+                nPatchedEdges -= pOld->edges.size();
+            else
+                ++nPatches;
+            nInterests += p.interests.size() - base.interest( p.idx ).size();
+            nPatchedEdges += p.edges.size();
+            patches.set( p.idx, std::move(built[r]) );
+        } // for r
+        return true;
+    } // if
+
+    // 新增记录在 added 中的位置, 第s段是 [addOffsets[s], addOffsets[s+1])
+    std::vector<uint32_t> addOffsets( nSegs + 1, 0 );
+    for (const auto &a : added)
+        ++addOffsets[a.first + 1];
+    for (std::size_t s = 0; s != nSegs; ++s)
+        addOffsets[s + 1] += addOffsets[s];
+
+    std::vector<uint32_t> counts( nSegs );
+    for (std::size_t s = 0; s != nSegs; ++s)
+        counts[s] = (uint32_t)base.row( (uint32_t)(s / N_INTERACTION_TYPE), (uint32_t)(s % N_INTERACTION_TYPE) ).size()
+                        + addOffsets[s + 1] - addOffsets[s];
+    build( n, counts );
+
+    Storage &st = *pStorage;
+    g_pThreadPool->parallel_for( 0, nSegs, 1024, [&]( std::size_t first, std::size_t last ) {
+        for (std::size_t s = first; s != last; ++s) {
+            EdgeSpan seg = base.row( (uint32_t)(s / N_INTERACTION_TYPE), (uint32_t)(s % N_INTERACTION_TYPE) );
+            mergeSegment( seg, added.cbegin() + addOffsets[s], added.cbegin() + addOffsets[s + 1],
+                          st.edges.data() + st.offsets[s] );
+        } // for s
+    } );
+
+    buildInterests( n );
+    buildFactors( n );
+    return false;
+}
+
+void InteractionGraph::Adjacency::bind()
+{
+    offsetView = IndexSpan( pStorage->offsets.data(), pStorage->offsets.size() );
+    edgeView = EdgeSpan( pStorage->edges.data(), pStorage->edges.size() );
+    interestOffsetView = IndexSpan( pStorage->interestOffsets.data(), pStorage->interestOffsets.size() );
+    interestView = IndexSpan( pStorage->interests.data(), pStorage->interests.size() );
+    nEdges = edgeView.size();
+    nInterests = interestView.size();
+}
+
+void InteractionGraph::Adjacency::save( SnapshotWriter &writer ) const
+{
+    if (patches.empty()) {
+        writer.writeArray( offsetView.data(), offsetView.size() );
+        writer.writeArray( edgeView.data(), edgeView.size() );
+        writer.writeArray( interestOffsetView.data(), interestOffsetView.size() );
+        writer.writeArray( interestView.data(), interestView.size() );
+        return;
+    } // if
+
+    // 有补丁时先按行展开成数组
+    const std::size_t n = interestOffsetView.size() - 1;
+    Storage st;
+    st.offsets.reserve( n * N_INTERACTION_TYPE + 1 );
+    st.offsets.push_back( 0 );
+    st.edges.reserve( nEdges );
+    st.interestOffsets.reserve( n + 1 );
+    st.interestOffsets.push_back( 0 );
+    st.interests.reserve( nInterests );
+    for (uint32_t idx = 0; idx != (uint32_t)n; ++idx) {
+        for (uint32_t t = 0; t != N_INTERACTION_TYPE; ++t) {
+            EdgeSpan seg = row( idx, t );
+            st.edges.insert( st.edges.end(), seg.begin(), seg.end() );
+            st.offsets.push_back( (uint32_t)st.edges.size() );
+        } // for t
+        IndexSpan set = interest( idx );
+        st.interests.insert( st.interests.end(), set.begin(), set.end() );
+        st.interestOffsets.push_back( (uint32_t)st.interests.size() );
+    } // for idx
+
+    writer.writeArray( st.offsets.data(), st.offsets.size() );
+    writer.writeArray( st.edges.data(), st.edges.size() );
+    writer.writeArray( st.interestOffsets.data(), st.interestOffsets.size() );
+    writer.writeArray( st.interests.data(), st.interests.size() );
+}
+
+void InteractionGraph::Adjacency::load( SnapshotReader &reader, std::size_t n )
+{
+    offsetView = reader.readArray<uint32_t>();
+    edgeView = reader.readArray<Edge>();
+    interestOffsetView = reader.readArray<uint32_t>();
+    interestView = reader.readArray<uint32_t>();
+
+    // 只检查数组大小和结尾, 不逐行检查
+    if (offsetView.size() != n * N_INTERACTION_TYPE + 1
+            || offsetView[offsetView.size() - 1] != edgeView.size()
+            || interestOffsetView.size() != n + 1
+            || interestOffsetView[n] != interestView.size())
+        throw std::runtime_error( "Corrupted snapshot file: interaction graph size mismatch!" );
+    pStorage.reset();
+    patches.clear();
+    nPatches = 0;
+    nPatchedEdges = 0;
+    nEdges = edgeView.size();
+    nInterests = interestView.size();
+    interestsBuilt = true;
+}
+
+void InteractionGraph::build( const InteractionStore &store,
+                              std::size_t nUsers, std::size_t nItems )
+{
+    m_nUsers = nUsers;
+    m_nItems = nItems;
+
+    // 统计每行每种类型的交互数目
+    std::vector<uint32_t> userCounts( nUsers * N_INTERACTION_TYPE, 0 );
+    std::vector<uint32_t> itemCounts( nItems * N_INTERACTION_TYPE, 0 );
+    for (std::size_t c = 0; c != store.nChunks(); ++c) {
+        const InteractionStore::Chunk &chunk = store.chunk( c );
+        for (std::size_t i = 0, n = store.chunkLength(c); i != n; ++i) {
+            ++userCounts[ (std::size_t)chunk.users[i] * N_INTERACTION_TYPE + chunk.types[i] ];
+            ++itemCounts[ (std::size_t)chunk.items[i] * N_INTERACTION_TYPE + chunk.types[i] ];
+        } // for i
+    } // for c
+
+    m_UserSide.build( nUsers, userCounts );
+    m_ItemSide.build( nItems, itemCounts );
+    Adjacency::Storage &userStorage = *m_UserSide.pStorage;
+    Adjacency::Storage &itemStorage = *m_ItemSide.pStorage;
+
+    // 填入交互记录, counts 复用为各段的写入位置
+    for (std::size_t i = 0; i != userCounts.size(); ++i)
+        userCounts[i] = userStorage.offsets[i];
+    for (std::size_t i = 0; i != itemCounts.size(); ++i)
+        itemCounts[i] = itemStorage.offsets[i];
+
+    for (std::size_t c = 0; c != store.nChunks(); ++c) {
+        const InteractionStore::Chunk &chunk = store.chunk( c );
+        for (std::size_t i = 0, n = store.chunkLength(c); i != n; ++i) {
+            uint32_t u = chunk.users[i];
+            uint32_t v = chunk.items[i];
+            uint32_t ts = chunk.times[i];
+            uint32_t type = chunk.types[i];
+            userStorage.edges[ userCounts[(std::size_t)u * N_INTERACTION_TYPE + type]++ ] = Edge(v, ts);
+            itemStorage.edges[ itemCounts[(std::size_t)v * N_INTERACTION_TYPE + type]++ ] = Edge(u, ts);
+        } // for i
+    } // for c
+
+    // 各段排序
+    auto sortSegments = []( Adjacency::Storage &st ) {
+        for (std::size_t i = 0; i + 1 < st.offsets.size(); ++i)
+            std::sort( st.edges.begin() + st.offsets[i],
+                       st.edges.begin() + st.offsets[i + 1] );
+    };
+    sortSegments( userStorage );
+    sortSegments( itemStorage );
+
+    m_UserSide.buildInterests( nUsers );
+    m_ItemSide.buildInterests( nItems );
+    m_UserSide.buildFactors( nUsers );
+    m_ItemSide.buildFactors( nItems );
+
+    LOG(INFO) << "InteractionGraph built: " << nUsers << " users, " << nItems
+              << " items, " << nEdges() << " interactions, "
+              << m_UserSide.nInterests << " positive user-item pairs.";
+}
+
+void InteractionGraph::buildFrom( const InteractionGraph &base,
+                                  const std::vector<InteractionRecord> &batch )
+{
+    m_nUsers = base.m_nUsers;
+    m_nItems = base.m_nItems;
+
+    std::vector< std::pair<uint32_t, Edge> > userAdded, itemAdded;
+    userAdded.reserve( batch.size() );
+    itemAdded.reserve( batch.size() );
+    for (const InteractionRecord &rec : batch) {
+        uint32_t u = rec.userIndex(), i = rec.itemIndex(), type = rec.type();
+        if (u >= m_nUsers || i >= m_nItems || type >= N_INTERACTION_TYPE)
+            throw std::runtime_error( "InteractionGraph::buildFrom: interaction record out of range!" );
+        userAdded.push_back( std::make_pair(u * N_INTERACTION_TYPE + type, Edge(i, (uint32_t)rec.time())) );
+        itemAdded.push_back( std::make_pair(i * N_INTERACTION_TYPE + type, Edge(u, (uint32_t)rec.time())) );
+    } // for
+
+    std::vector<uint32_t> userRows, itemRows;
+    bool userPatched = m_UserSide.merge( base.m_UserSide, m_nUsers, userAdded, userRows );
+    bool itemPatched = m_ItemSide.merge( base.m_ItemSide, m_nItems, itemAdded, itemRows );
+    // 补丁中的视图可能指向原图映射的快照文件
+    if (userPatched || itemPatched)
+        m_pSnapshot = base.m_pSnapshot;
+
+    if (base.m_nPostingCap) {
+        if (itemPatched)
+            capPatchedPostings( base, itemRows, userRows );
+        else
+            capItemPostings( base.m_nPostingCap, base.m_CapPolicy );
+    } // if
+
+    LOG(INFO) << "InteractionGraph merged: " << batch.size() << " new interactions, "
+              << nEdges() << " interactions, "
+              << m_UserSide.nInterests << " positive user-item pairs, "
+              << m_UserSide.nPatches << " user rows and "
+              << m_ItemSide.nPatches << " item rows patched.";
+}
+
+void InteractionGraph::save( SnapshotWriter &writer ) const
+{
+    m_UserSide.save( writer );
+    m_ItemSide.save( writer );
+}
+
+void InteractionGraph::load( SnapshotReader &reader, std::size_t nUsers, std::size_t nItems )
+{
+    m_nUsers = nUsers;
+    m_nItems = nItems;
+    m_UserSide.load( reader, nUsers );
+    m_ItemSide.load( reader, nItems );
+    m_pSnapshot = reader.file();
+    m_UserSide.buildFactors( nUsers );
+    m_ItemSide.buildFactors( nItems );
+
+    LOG(INFO) << "InteractionGraph loaded from snapshot: " << nUsers << " users, " << nItems
+              << " items, " << nEdges() << " interactions, "
+              << m_UserSide.nInterests << " positive user-item pairs.";
+}
+
+
+void InteractionGraph::capRow( uint32_t i, std::size_t cap, PostingCapPolicy policy,
+                               std::vector< std::pair<uint32_t, uint32_t> > &keyed, uint32_t *out ) const
+{
+    // {排序键, user下标}, 键大的优先保留, 相同时保留下标小的
+    IndexSpan setNi = m_ItemSide.interest( i );
+    keyed.clear();
+    if (policy == CAP_ACTIVE) {
+        for (uint32_t v : setNi)
+            keyed.push_back( std::make_pair((uint32_t)userDegree(v), v) );
+    } else {
+        // 正反馈的三段中每段按user下标升序, 取每个用户的最晚时间
+        for (uint32_t v : setNi)
+            keyed.push_back( std::make_pair(0u, v) );
+        for (const Edge &e : m_ItemSide.positiveRow( i )) {
+            auto it = std::lower_bound( keyed.begin(), keyed.end(), e.index,
+                    []( const std::pair<uint32_t, uint32_t> &p, uint32_t v )->bool
+                    { return p.second < v; } );
+            it->first = std::max( it->first, e.time );
+        } // for e
+    } // if
+
+    std::nth_element( keyed.begin(), keyed.begin() + (cap - 1), keyed.end(),
+            []( const std::pair<uint32_t, uint32_t> &lhs, const std::pair<uint32_t, uint32_t> &rhs )->bool
+            { return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second); } );
+    for (std::size_t j = 0; j != cap; ++j)
+        out[j] = keyed[j].second;
+    std::sort( out, out + cap );
+}
+
+void InteractionGraph::capItemPostings( std::size_t cap, PostingCapPolicy policy )
+{
+    const std::size_t GRAIN = 256;
+
+    m_nPostingCap = 0;
+    m_pCapped.reset();
+    m_CappedPatches.clear();
+    if (!cap)
+        return;
+
+    // 只有超过 cap 的物品需要截断, 其余的 itemPostings 直接返回 itemInterests
+    std::shared_ptr<CappedStorage> pCapped = std::make_shared<CappedStorage>();
+    std::vector<uint32_t> &offsets = pCapped->offsets;
+    offsets.resize( m_nItems + 1 );
+    offsets[0] = 0;
+    std::size_t nCapped = 0;
+    for (std::size_t i = 0; i != m_nItems; ++i) {
+        std::size_t sz = m_ItemSide.interest( (uint32_t)i ).size();
+        if (sz > cap)
+            ++nCapped;
+        offsets[i + 1] = offsets[i] + (uint32_t)(sz > cap ? cap : 0);
+    } // for i
+    std::vector<uint32_t>( offsets[m_nItems] ).swap( pCapped->postings );
+
+    g_pThreadPool->parallel_for( 0, m_nItems, GRAIN, [&]( std::size_t first, std::size_t last ) {
+        std::vector< std::pair<uint32_t, uint32_t> > keyed;
+        for (std::size_t i = first; i != last; ++i) {
+            if (offsets[i + 1] != offsets[i])
+                capRow( (uint32_t)i, cap, policy, keyed, pCapped->postings.data() + offsets[i] );
+        } // for i
+    } );
+
+    m_pCapped = pCapped;
+    m_nPostingCap = cap;
+    m_CapPolicy = policy;
+
+    std::size_t nKept = 0;
+    for (std::size_t i = 0; i != m_nItems; ++i)
+        nKept += itemPostings( (uint32_t)i ).size();
+    LOG(INFO) << "Item postings capped at " << cap << " users ("
+              << (policy == CAP_ACTIVE ? "most active" : "most recent") << "): "
+              << nCapped << " items capped, " << nKept << " of "
+              << m_ItemSide.nInterests << " postings kept.";
+}
+
+void InteractionGraph::capPatchedPostings( const InteractionGraph &base,
+                                           const std::vector<uint32_t> &itemRows,
+                                           const std::vector<uint32_t> &userRows )
+{
+    const std::size_t cap = base.m_nPostingCap;
+
+    m_nPostingCap = cap;
+    m_CapPolicy = base.m_CapPolicy;
+    m_pCapped = base.m_pCapped;
+    m_CappedPatches.share( base.m_CappedPatches, m_nItems );
+
+    // N(i) 变了的物品要重新截断; 按 |N(v)| 截断时, N(v) 变了的用户v所在的物品也要
+    std::vector<uint32_t> rows;
+    for (uint32_t i : itemRows) {
+        if (m_ItemSide.interest(i).size() > cap)
+            rows.push_back( i );
+    } // for
+    if (m_CapPolicy == CAP_ACTIVE) {
+        for (uint32_t v : userRows) {
+            if (userDegree(v) == base.userDegree(v))
+                continue;
+            for (uint32_t i : userInterests(v)) {
+                if (m_ItemSide.interest(i).size() > cap)
+                    rows.push_back( i );
+            } // for i
+        } // for v
+        std::sort( rows.begin(), rows.end() );
+        rows.erase( std::unique(rows.begin(), rows.end()), rows.end() );
+    } // if
+
+    std::vector< std::shared_ptr< std::vector<uint32_t> > > built( rows.size() );
+    g_pThreadPool->parallel_for( 0, rows.size(), 16, [&]( std::size_t first, std::size_t last ) {
+        std::vector< std::pair<uint32_t, uint32_t> > keyed;
+        for (std::size_t r = first; r != last; ++r) {
+            built[r] = std::make_shared< std::vector<uint32_t> >( cap );
+            capRow( rows[r], cap, m_CapPolicy, keyed, built[r]->data() );
+        } // for r
+    } );
+
+    // 原有的截断补丁中没有重建的物品继续共用
+    for (std::size_t r = 0; r != rows.size(); ++r)
+        m_CappedPatches.set( rows[r], std::move(built[r]) );
+}
+
+
+void GraphHandle::publish( Ptr pGraph )
+{
+    Ptr pOld = std::atomic_exchange( &m_pCurrent, pGraph );
+    m_pRaw.store( pGraph.get(), std::memory_order_release );
+    m_nEpoch.fetch_add( 1, std::memory_order_acq_rel );
+    if (pOld)
+        m_arrRetired.push_back( std::move(pOld) );
+    reclaim();
+}
+
+std::size_t GraphHandle::reclaim()
+{
+    // 已不是当前发布的图, 计数为1说明只剩这里持有, 之后也不会有读者再取得它
+    auto last = std::remove_if( m_arrRetired.begin(), m_arrRetired.end(),
+                                []( const Ptr &p ) { return p.use_count() == 1; } );
+    m_arrRetired.erase( last, m_arrRetired.end() );
+    return m_arrRetired.size();
+}
@@ -0,0 +1,435 @@
+#ifndef _INTERACTION_GRAPH_H_
+#define _INTERACTION_GRAPH_H_
+
+#include "common.h"
+
+class MappedFile;
+class SnapshotWriter;
+class SnapshotReader;
+
+/**
+ * @brief user-item 交互关系图, CSR(compressed sparse row) 格式
+ *
+ * interaction 数据导入完成后由 InteractionStore 一次性建立, 之后只读.
+ * 新增的交互记录用 buildFrom 与原图归并成一个新图, 原图不变. 新图与原图共用没有变化的行,
+ * 只有涉及的行重建为补丁(patch); 补丁累积到一定规模时再整体归并成新的数组.
+ * user 和 item 都用 UserDB/ItemDB 中的连续下标表示.
+ *
+ * 每个 user(item) 一行, 行内按交互类型分段, 每段是该类型的所有交互记录,
+ * 按对方下标升序排列(同一对方按时间升序). 第u行类型为t的段是
+ *      edges[ offsets[u * N_INTERACTION_TYPE + t], offsets[u * N_INTERACTION_TYPE + t + 1] )
+ *
+ * 另外为每个 user(item) 建立正反馈(除删除之外的交互)集合, 是升序无重复的下标数组,
+ * 即 User::interestedItemSet() 和 Item::interestedUserSet() 返回的内容.
+ *
+ * 从快照导入时(见 snapshot.h)各数组直接引用映射的快照文件, 不复制.
+ */
+class InteractionGraph {
+public:
+    // 一条交互记录
+    struct Edge {
+        uint32_t    index;   // 对方的下标, user行中是item下标, item行中是user下标
+        uint32_t    time;    // 交互时间
+
+        Edge() : index(0), time(0) {}
+        Edge( uint32_t _index, uint32_t _time ) : index(_index), time(_time) {}
+
+        bool operator < (const Edge &rhs) const
+        { return index < rhs.index || (index == rhs.index && time < rhs.time); }
+    };
+
+    typedef Span<Edge>      EdgeSpan;
+    typedef Span<uint32_t>  IndexSpan;
+
+    // 热门物品的 posting 截断时保留哪些用户
+    enum PostingCapPolicy {
+        CAP_RECENT,     // 最近一次正反馈最晚的
+        CAP_ACTIVE      // |N(v)| 最大的
+    };
+
+public:
+    InteractionGraph() : m_nUsers(0), m_nItems(0), m_nPostingCap(0), m_CapPolicy(CAP_RECENT) {}
+
+    /**
+     * @brief 从 InteractionStore 建立交互关系图
+     *
+     * @param store     所有interaction记录
+     * @param nUsers    user总数, 即 g_pUserDB->size()
+     * @param nItems    item总数, 即 g_pItemDB->size()
+     */
+    void build( const InteractionStore &store, std::size_t nUsers, std::size_t nItems );
+
+    /**
+     * @brief 由已有的图加上一批新的交互记录建立新图, 结果与用全部记录 build 相同.
+     *        涉及的行与新记录归并后作为补丁, 未涉及的行与 base 共用, 不复制;
+     *        补丁按下标分块登记, 只复制有行变化的块(见 PatchTable), 每批的开销与批的大小相当;
+     *        补丁中的交互超过全部交互的 1/COMPACT_RATIO 时整体归并成新的数组.
+     *        base 截断了 posting 时新图按同样的方式截断, 同样只重新截断变化的物品.
+     *
+     * @param base      原图, 可以是从快照导入的
+     * @param batch     新的交互记录, user 和 item 下标必须在原图范围内
+     */
+    void buildFrom( const InteractionGraph &base, const std::vector<InteractionRecord> &batch );
+
+    // 写入快照
+    void save( SnapshotWriter &writer ) const;
+
+    /**
+     * @brief 从快照导入, 数组引用 reader 映射的文件
+     *
+     * @param reader    快照
+     * @param nUsers    user总数, 必须与快照中的一致
+     * @param nItems    item总数, 必须与快照中的一致
+     */
+    void load( SnapshotReader &reader, std::size_t nUsers, std::size_t nItems );
+
+    std::size_t nUsers() const { return m_nUsers; }
+    std::size_t nItems() const { return m_nItems; }
+    std::size_t nEdges() const { return m_UserSide.nEdges; }
+
+    // 补丁中的交互超过全部交互的 1/COMPACT_RATIO 时, buildFrom 整体归并
+    static const std::size_t COMPACT_RATIO = 8;
+
+    // 下标为u的用户类型为type的所有交互, 按item下标升序
+    EdgeSpan userInteractions( uint32_t u, uint32_t type ) const
+    { return m_UserSide.row( u, type ); }
+
+    // 下标为i的物品类型为type的所有交互, 按user下标升序
+    EdgeSpan itemInteractions( uint32_t i, uint32_t type ) const
+    { return m_ItemSide.row( i, type ); }
+
+    // 正反馈集合已建立(或已从快照导入), 之后 userInterests/itemInterests 可以无锁并发读
+    bool interestsBuilt() const
+    { return m_UserSide.interestsBuilt && m_ItemSide.interestsBuilt; }
+
+    // 下标为u的用户的正反馈物品集合 N(u)
+    IndexSpan userInterests( uint32_t u ) const
+    { return m_UserSide.interest( u ); }
+
+    // 下标为i的物品的正反馈用户集合 N(i)
+    IndexSpan itemInterests( uint32_t i ) const
+    { return m_ItemSide.interest( i ); }
+
+    /**
+     * @brief 为 |N(i)| 超过 cap 的物品建立截断的 posting, 只保留按 policy 选出的 cap 个用户.
+     *        build 或 load 之后调用, 不写入快照; cap 为0时取消截断.
+     *
+     * 截断只影响 itemPostings, itemInterests 和 itemDegree/itemFactor 仍是完整的.
+     */
+    void capItemPostings( std::size_t cap, PostingCapPolicy policy );
+
+    std::size_t postingCap() const { return m_nPostingCap; }
+
+    // UserCF 展开的 item->users posting, 未截断时即 itemInterests(i), 升序
+    IndexSpan itemPostings( uint32_t i ) const
+    {
+        IndexSpan setNi = itemInterests( i );
+        if (!m_nPostingCap || setNi.size() <= m_nPostingCap)
+            return setNi;
+        if (const std::vector<uint32_t> *pPosting = m_CappedPatches[i])
+            return IndexSpan( pPosting->data(), pPosting->size() );
+        const CappedStorage &capped = *m_pCapped;
+        return IndexSpan( capped.postings.data() + capped.offsets[i],
+                          capped.offsets[i + 1] - capped.offsets[i] );
+    }
+
+    /*
+     * 以下在 build/load 之后预先算好, 存放在按下标排列的数组中, buildFrom 重建的行存放在补丁中:
+     * degree 为正反馈集合大小 |N(u)|, |N(i)|; factor 为 1/log(1+|N|), 集合为空时为0
+     */
+    float userDegree( uint32_t u ) const
+    { return m_UserSide.degree( u ); }
+    float itemDegree( uint32_t i ) const
+    { return m_ItemSide.degree( i ); }
+    float userFactor( uint32_t u ) const
+    { return m_UserSide.factor( u ); }
+    float itemFactor( uint32_t i ) const
+    { return m_ItemSide.factor( i ); }
+
+private:
+    /*
+     * 按下标登记的补丁, 每 BLOCK_SIZE 个下标一块, 没有补丁的块为空.
+     * share 之后与原表共用所有的块, set 第一次写入某块时才复制它(写时复制),
+     * 所以由原图建立新图只复制块指针和写入的块. 块由 serial 区分是否属于本表
+     */
+    template <typename T>
+    class PatchTable {
+    public:
+        static const uint32_t BLOCK_BITS = 10;
+        static const uint32_t BLOCK_SIZE = 1U << BLOCK_BITS;
+
+    public:
+        PatchTable() : m_nSerial(nextSerial()) {}
+
+        bool empty() const { return m_arrBlocks.empty(); }
+
+        void clear()
+        { std::vector<BlockPtr>().swap( m_arrBlocks ); }
+
+        // 与 base 共用所有的块, n 为下标总数
+        void share( const PatchTable &base, std::size_t n )
+        {
+            if (base.empty())
+                m_arrBlocks.assign( (n + BLOCK_SIZE - 1) >> BLOCK_BITS, BlockPtr() );
+            else
+                m_arrBlocks = base.m_arrBlocks;
+        }
+
+        // 第idx项, 没有时为NULL
+        const T* operator [] ( uint32_t idx ) const
+        {
+            if (m_arrBlocks.empty())
+                return NULL;
+            const Block *pBlock = m_arrBlocks[idx >> BLOCK_BITS].get();
+            return pBlock ? pBlock->entries[idx & (BLOCK_SIZE - 1)].get() : NULL;
+        }
+
+        // 设置第idx项, 共用的块先复制. share 之后调用
+        void set( uint32_t idx, std::shared_ptr<const T> p )
+        {
+            BlockPtr &pBlock = m_arrBlocks[idx >> BLOCK_BITS];
+            if (!pBlock || pBlock->serial != m_nSerial) {
+                BlockPtr pNew = pBlock ? std::make_shared<Block>( *pBlock ) : std::make_shared<Block>();
+                pNew->serial = m_nSerial;
+                pBlock = std::move( pNew );
+            } // if
+            pBlock->entries[idx & (BLOCK_SIZE - 1)] = std::move( p );
+        }
+
+    private:
+        struct Block {
+            uint64_t                    serial;
+            std::shared_ptr<const T>    entries[BLOCK_SIZE];
+        };
+        typedef std::shared_ptr<Block>  BlockPtr;
+
+        PatchTable( const PatchTable& );
+        PatchTable& operator = ( const PatchTable& );
+
+        static uint64_t nextSerial()
+        {
+            static std::atomic<uint64_t> s_nSerial(0);
+            return ++s_nSerial;
+        }
+
+        std::vector<BlockPtr>   m_arrBlocks;
+        uint64_t                m_nSerial;
+    };
+
+    // 一侧(user->items 或 item->users)的邻接表
+    struct Adjacency {
+        // build 时使用的存储, 从快照导入时为空. buildFrom 得到的新图与原图共用
+        struct Storage {
+            std::vector<uint32_t>   offsets;           // n * N_INTERACTION_TYPE + 1
+            std::vector<Edge>       edges;
+            std::vector<uint32_t>   interestOffsets;   // n + 1
+            std::vector<uint32_t>   interests;
+        };
+
+        // buildFrom 重建的一行, 格式与数组中的一行相同, 建立之后不再修改
+        struct Patch {
+            uint32_t                idx;
+            uint32_t                offsets[N_INTERACTION_TYPE + 1];   // edges 中各段的位置
+            std::vector<Edge>       edges;
+            std::vector<uint32_t>   interests;
+            float                   degree;
+            float                   factor;
+        };
+
+        // 由正反馈集合得到, 不写入快照. buildFrom 得到的新图与原图共用, 补丁行的以补丁中的为准
+        struct Degrees {
+            std::vector<float>      degrees;           // n
+            std::vector<float>      factors;           // n
+        };
+
+        std::shared_ptr<Storage>    pStorage;
+
+        // 查询使用的视图, 指向 pStorage 或映射的快照文件
+        IndexSpan               offsetView;
+        EdgeSpan                edgeView;
+        IndexSpan               interestOffsetView;
+        IndexSpan               interestView;
+        bool                    interestsBuilt;
+
+        // 补丁, patches[idx] 非NULL时取代数组中的第idx行
+        PatchTable<Patch>       patches;
+        std::size_t             nPatches;
+        std::size_t             nPatchedEdges;
+
+        // 包括补丁在内的交互数和正反馈数
+        std::size_t             nEdges;
+        std::size_t             nInterests;
+
+        std::shared_ptr<const Degrees>  pDegrees;
+
+        Adjacency() : interestsBuilt(false), nPatches(0), nPatchedEdges(0), nEdges(0), nInterests(0) {}
+
+        const Patch* patch( uint32_t idx ) const
+        { return patches[idx]; }
+
+        float degree( uint32_t idx ) const
+        {
+            if (const Patch *p = patch( idx ))
+                return p->degree;
+            return pDegrees->degrees[idx];
+        }
+
+        float factor( uint32_t idx ) const
+        {
+            if (const Patch *p = patch( idx ))
+                return p->factor;
+            return pDegrees->factors[idx];
+        }
+
+        EdgeSpan row( uint32_t idx, uint32_t type ) const
+        {
+            if (const Patch *p = patch( idx ))
+                return EdgeSpan( p->edges.data() + p->offsets[type], p->offsets[type + 1] - p->offsets[type] );
+            std::size_t pos = (std::size_t)idx * N_INTERACTION_TYPE + type;
+            return EdgeSpan( edgeView.data() + offsetView[pos], offsetView[pos + 1] - offsetView[pos] );
+        }
+
+        // CLICK, BOOKMARK, REPLY 三段, 在行中相邻
+        EdgeSpan positiveRow( uint32_t idx ) const
+        {
+            EdgeSpan first = row( idx, CLICK ), last = row( idx, DELETE );
+            return EdgeSpan( first.data(), last.data() - first.data() );
+        }
+
+        IndexSpan interest( uint32_t idx ) const
+        {
+            if (const Patch *p = patch( idx ))
+                return IndexSpan( p->interests.data(), p->interests.size() );
+            return IndexSpan( interestView.data() + interestOffsetView[idx],
+                              interestOffsetView[idx + 1] - interestOffsetView[idx] );
+        }
+
+        // 由各行各类型的交互数目建立 offsets, 之后填入edges并排序
+        void build( std::size_t n, const std::vector<uint32_t> &counts );
+        /*
+         * base 的各行与 added({段号, 交互}) 归并, 之后正反馈集合和 degree/factor 都已建立.
+         * 补丁不多时只为涉及的行建立补丁并返回 true, 否则归并成新的数组并返回 false.
+         * rows 返回涉及的行, 升序
+         */
+        bool merge( const Adjacency &base, std::size_t n,
+                    std::vector< std::pair<uint32_t, Edge> > &added, std::vector<uint32_t> &rows );
+        // edges 排序后调用, 用 g_pThreadPool 并行建立各行的正反馈集合
+        void buildInterests( std::size_t n );
+        // 视图指向自己的存储, build 和 buildInterests 之后调用
+        void bind();
+        // 由正反馈集合计算 pDegrees, buildInterests 或 load 之后调用
+        void buildFactors( std::size_t n );
+
+        void save( SnapshotWriter &writer ) const;
+        void load( SnapshotReader &reader, std::size_t n );
+    };
+
+    // capItemPostings 建立的截断 posting, 只含 |N(i)| 超过 cap 的物品, 格式同正反馈集合
+    struct CappedStorage {
+        std::vector<uint32_t>   offsets;       // nItems + 1
+        std::vector<uint32_t>   postings;
+    };
+
+    // 按 policy 从物品i的用户中选出 cap 个, 升序写入 out
+    void capRow( uint32_t i, std::size_t cap, PostingCapPolicy policy,
+                 std::vector< std::pair<uint32_t, uint32_t> > &keyed, uint32_t *out ) const;
+    // buildFrom 只补丁了 item 一侧时, 重新截断 rows 中的物品
+    void capPatchedPostings( const InteractionGraph &base, const std::vector<uint32_t> &itemRows,
+                             const std::vector<uint32_t> &userRows );
+
+    std::size_t     m_nUsers;
+    std::size_t     m_nItems;
+    Adjacency       m_UserSide;
+    Adjacency       m_ItemSide;
+    std::shared_ptr<MappedFile>   m_pSnapshot;   // 从快照导入时持有映射
+
+    std::size_t                                 m_nPostingCap;
+    PostingCapPolicy                            m_CapPolicy;
+    std::shared_ptr<const CappedStorage>        m_pCapped;
+    // buildFrom 重新截断的物品, m_CappedPatches[i] 非NULL时取代 m_pCapped 中的第i行
+    PatchTable< std::vector<uint32_t> >         m_CappedPatches;
+};
+
+
+/**
+ * @brief 一个模型版本(见 common.h 中的 ModelGeneration)当前发布的 InteractionGraph, 按 epoch 发布新图
+ *
+ * 导入数据时单线程用 reset 设置. 流式导入(见 interaction_feed.h)时写线程用 publish
+ * 发布新图, 每发布一次 epoch 加1, 已发布的图不再修改.
+ * 与 publish 并发的读者必须先用 ModelPin 固定当前的图: 固定期间本线程(包括它发起的
+ * parallel_for)经 g_pGraph 访问的都是同一个图, 整个请求看到的是一致的快照. 被替换的图在
+ * 没有读者固定它之后, 由写线程在下次 publish 或 reclaim 时释放, 读者不会承担释放大图的开销.
+ */
+class GraphHandle {
+public:
+    typedef std::shared_ptr<InteractionGraph>   Ptr;
+
+public:
+    GraphHandle() : m_pRaw(NULL), m_nEpoch(0) {}
+
+    // 最新发布的图, 不固定, 只能在没有并发的发布者时使用(见 ModelHandle). 固定的图由 ModelPin 持有
+    InteractionGraph* get() const
+    {
+        if (g_Model.publishing())
+            ModelHandle::unpinnedAccess( "g_pGraph" );
+        return m_pRaw.load( std::memory_order_acquire );
+    }
+
+    // 单线程设置, 同 std::unique_ptr::reset
+    void reset( InteractionGraph *pGraph = NULL )
+    { publish( Ptr(pGraph) ); }
+
+    // 最新发布的图, 持有期间不会释放
+    Ptr current() const
+    { return std::atomic_load( &m_pCurrent ); }
+
+    // 发布新图, 只能由一个线程调用
+    void publish( Ptr pGraph );
+
+    // 释放已没有读者的旧图, 返回尚未释放的个数
+    std::size_t reclaim();
+
+    // 已发布的次数
+    uint64_t epoch() const
+    { return m_nEpoch.load( std::memory_order_acquire ); }
+
+private:
+    GraphHandle( const GraphHandle& );
+    GraphHandle& operator = ( const GraphHandle& );
+
+    Ptr                             m_pCurrent;
+    std::atomic<InteractionGraph*>  m_pRaw;
+    std::atomic<uint64_t>           m_nEpoch;
+    std::vector<Ptr>                m_arrRetired;    // 被替换但可能仍有读者的图, 只有写线程访问
+};
+
+/**
+ * @brief 全局的 g_pGraph: 本线程所用模型版本的 GraphHandle, 固定时为 ModelPin 固定的图
+ */
+class GraphRef {
+public:
+    GraphHandle& handle() const { return *g_Model->pGraph; }
+
+    InteractionGraph* get() const
+    {
+        const ModelPin *pPin = ModelPin::current();
+        return pPin ? pPin->graph() : handle().get();
+    }
+    InteractionGraph* operator -> () const { return get(); }
+    InteractionGraph& operator * () const { return *get(); }
+    explicit operator bool () const { return get() != NULL; }
+
+    // 发布之后本线程的固定改为新图
+    void reset( InteractionGraph *pGraph = NULL ) { publish( GraphHandle::Ptr(pGraph) ); }
+    GraphHandle::Ptr current() const { return handle().current(); }
+    void publish( GraphHandle::Ptr pGraph )
+    {
+        handle().publish( pGraph );
+        ModelPin::follow( std::move(pGraph) );
+    }
+    std::size_t reclaim() { return handle().reclaim(); }
+    uint64_t epoch() const { return handle().epoch(); }
+};
+
+#endif
+
@@ -3,21 +3,34 @@
  * 暂不用考虑OpenMP版本的算法实现
  */
 #include "common.h"
+#include "interaction_graph.h"
 #include "recommend_algorithm.h"
+#include "mapped_file.h"
+#include "text_parser.h"
+#include "snapshot.h"
+#include "result_sink.h"
+#include "similarity_cache.h"
+#include "interaction_feed.h"
 #include <glog/logging.h>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
-#include <cassert>
 #include <cctype>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
 
 #define    RECALL_SIZE 30
 
 using std::cout; using std::endl;
 
-std::unique_ptr< UserDB >        g_pUserDB;
-std::unique_ptr< ItemDB >        g_pItemDB;
-std::unique_ptr< InteractionStore > g_InteractStore;
+ModelHandle                      g_Model;
+ModelRef< UserDB, &ModelGeneration::pUserDB >                   g_pUserDB;
+ModelRef< ItemDB, &ModelGeneration::pItemDB >                   g_pItemDB;
+ModelRef< InteractionStore, &ModelGeneration::pInteractStore >  g_InteractStore;
+GraphRef                         g_pGraph;
+ModelRef< SimilarityCache, &ModelGeneration::pSimilarityCache > g_pSimilarityCache;
+std::unique_ptr< JobPool >       g_pThreadPool;
 uint32_t         g_nMaxUserID = 0;
 uint32_t         g_nMaxItemID = 0;
 uint32_t         g_nMaxThread = 1;
@@ -27,6 +40,21 @@ typedef std::set<uint32_t>            _IdSet;
 typedef std::map<uint32_t, _IdSet>    TestDataSet;  // {uid: set(itemid 正反馈id列表)}
 static TestDataSet                    g_TestData;
 
+// 命令行选项
+static bool        g_bDenseStorage = false;   // -d 导入后把user和item搬到连续数组中
+static std::string g_strAlgorithm = "usercf"; // -a 推荐算法
+static bool        g_bMmapLoader = false;     // -m 用 mmap 并行读入数据文件
+static std::string g_strLoadSnapshot;         // -r 从快照导入, 不读csv
+static std::string g_strSaveSnapshot;         // -w 导入csv后写入快照
+static std::size_t g_nSnapshotSimilarK = 0;   // -s 写入快照前计算相似物品列表的k
+static std::size_t g_nSnapshotSimilarUsersK = 0;  // -u 写入快照前计算相似用户列表的k
+static std::size_t g_nCacheBudgetMB = 256;    // -b itemcf_lazy 相似列表缓存的内存上限(MB)
+static std::string g_strDeltaFile;            // -n 推荐之前并入的新交互记录, 格式同 interactions_train.csv
+static std::string g_strFeedFile;             // -f 推荐期间流式导入的交互记录文件或命名管道
+static bool        g_bRebuild = false;        // -g 推荐期间在后台重新建模并替换
+static std::size_t g_nPostingCap = 0;         // -c UserCF 中每个物品至多展开的用户数, 0表示不截断
+static InteractionGraph::PostingCapPolicy g_CapPolicy = InteractionGraph::CAP_RECENT;  // -p 截断时保留的用户
+
 // for test
 static void handle_command();
 static void print_data_info();
@@ -57,64 +85,40 @@ namespace std {
         uint32_t nTotalActioned = 0;
         // Clicked
         {
-            uint32_t count = 0;
-            const InteractionMap &m = user.interactionMap( CLICK );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->itemID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->userInteractions( user.index(), CLICK );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pItemDB->itemAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " clicked items." << endl;
             nTotalActioned += count;
         }
 
         // Bookmarked
         {
-            uint32_t count = 0;
-            const InteractionMap &m = user.interactionMap( BOOKMARK );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->itemID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->userInteractions( user.index(), BOOKMARK );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pItemDB->itemAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " bookmarked items." << endl;
             nTotalActioned += count;
         }
 
         // Replied
         {
-            uint32_t count = 0;
-            const InteractionMap &m = user.interactionMap( REPLY );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->itemID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->userInteractions( user.index(), REPLY );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pItemDB->itemAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " replied items." << endl;
             nTotalActioned += count;
         }
 
         // Deleted
         {
-            uint32_t count = 0;
-            const InteractionMap &m = user.interactionMap( DELETE );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->itemID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->userInteractions( user.index(), DELETE );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pItemDB->itemAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " deleted items." << endl;
             nTotalActioned += count;
         }
@@ -146,64 +150,40 @@ namespace std {
         uint32_t nTotalActioned = 0;
         // clicked
         {
-            uint32_t count = 0;
-            const InteractionMap &m = item.interactionMap( CLICK );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->userID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->itemInteractions( item.index(), CLICK );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pUserDB->userAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " clicked items." << endl;
             nTotalActioned += count;
         }
 
         // bookmarked
         {
-            uint32_t count = 0;
-            const InteractionMap &m = item.interactionMap( BOOKMARK );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->userID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->itemInteractions( item.index(), BOOKMARK );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pUserDB->userAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " bookmarked items." << endl;
             nTotalActioned += count;
         }
 
         // replied
         {
-            uint32_t count = 0;
-            const InteractionMap &m = item.interactionMap( REPLY );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->userID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->itemInteractions( item.index(), REPLY );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pUserDB->userAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " replied items." << endl;
             nTotalActioned += count;
         }
 
         // deleted
         {
-            uint32_t count = 0;
-            const InteractionMap &m = item.interactionMap( DELETE );
-            for ( const auto &mValue : m ) {
-                const InteractionVector &v = mValue.second;
-                count += v.size();
-                for ( const auto sp : v ) {
-                    // vValue is InteractionRecord_wptr
-                    os << sp->userID() << "@" << sp->time() << " ";
-                } // for
-            } // for
+            InteractionGraph::EdgeSpan edges = g_pGraph->itemInteractions( item.index(), DELETE );
+            uint32_t count = edges.size();
+            for ( const auto &e : edges )
+                os << g_pUserDB->userAt(e.index)->ID() << "@" << e.time << " ";
             os << count << " deleted items." << endl;
             nTotalActioned += count;
         }
@@ -215,21 +195,8 @@ namespace std {
 } // namespace std
 
 
-// 将字符串中的一系列 uint 数据，逗号分隔，读入到set集合中
-static
-bool read_uint_set( char *str, UIntSet &uintSet )
-{
-    uint32_t id;
-    char *saveEnd2 = NULL;
-    bool ret = true;
-    for( char *p = strtok_r(str, ",", &saveEnd2); p; p = strtok_r(NULL, ",", &saveEnd2) ) {
-        if ( read_from_string(p, id) )
-            uintSet.insert( id );
-        else
-            ret = false;
-    } // for
-    return ret;
-}
+// 处理一行数据的回调函数, 参数为行的起止位置(不含换行符)和行号
+typedef std::function< void(const char*, const char*, uint32_t) >  LineFunc;
 
 /*
  * processLine 或者用值传入，或者用 const ref 传入，
@@ -248,7 +215,7 @@ bool read_uint_set( char *str, UIntSet &uintSet )
 static
 void load_file_thread_routine( std::ifstream &inFile, boost::mutex &fileMtx,
                 const uint32_t BATCH_SIZE, uint32_t &lineno,
-                const std::function< void(std::string&, uint32_t) > &processLine )
+                const LineFunc &processLine )
 {
     using namespace std;
 
@@ -266,7 +233,11 @@ void load_file_thread_routine( std::ifstream &inFile, boost::mutex &fileMtx,
         lock.unlock();
 
         for( j = 0; j < i; ++j ) {
-            processLine( lines[j], lineIDs[j] );
+            const char *pLine = lines[j].c_str();
+            const char *pEnd = pLine + lines[j].size();
+            if (pEnd > pLine && *(pEnd - 1) == '\r')
+                --pEnd;
+            processLine( pLine, pEnd, lineIDs[j] );
         } // for
 
         if( i < BATCH_SIZE )   // getline fail, eof or filestream fail
@@ -276,120 +247,203 @@ void load_file_thread_routine( std::ifstream &inFile, boost::mutex &fileMtx,
     return;
 }
 
-// 加载 users.csv
+/**
+ * @brief 用 mmap 多线程读入数据文件
+ * 把文件按行边界切分成若干段, 每个线程处理一段, 不加锁, 也不复制行文本.
+ * 先并行统计每段的行数以得到每行的行号(与 load_file_thread_routine 一致), 再并行解析.
+ *
+ * @param file          已映射的数据文件
+ * @param begin         数据开始位置(标题行之后)
+ * @param processLine   同 load_file_thread_routine
+ */
 static
-void load_user_data( const char *filename )
+void load_file_mmap( const MappedFile &file, const char *begin,
+                     const LineFunc &processLine )
 {
     using namespace std;
 
+    vector< MappedFile::Range >  ranges;
+    file.split( begin, g_nMaxThread * 8, ranges );
+
+    vector< uint32_t > firstLineNo( ranges.size() + 1, 0 );
+
+    // 每次领取一段
+    auto run_threads = [&]( const std::function<void(size_t)> &processRange ) {
+        g_pThreadPool->parallel_for( 0, ranges.size(), 1, [&]( size_t first, size_t last ) {
+            for (size_t i = first; i != last; ++i)
+                processRange( i );
+        } );
+    };
+
+    // 统计每段的行数
+    run_threads( [&]( size_t i ) {
+        uint32_t n = 0;
+        for (const char *p = ranges[i].first; p < ranges[i].second; ++n) {
+            const char *nl = static_cast<const char*>( memchr(p, '\n', ranges[i].second - p) );
+            p = nl ? nl + 1 : ranges[i].second;
+        } // for
+        firstLineNo[i + 1] = n;
+    } );
+    for (size_t i = 0; i != ranges.size(); ++i)
+        firstLineNo[i + 1] += firstLineNo[i];
+
+    run_threads( [&]( size_t i ) {
+        uint32_t lineno = firstLineNo[i];
+        const char *p = ranges[i].first, *last = ranges[i].second;
+        while (p < last) {
+            const char *nl = static_cast<const char*>( memchr(p, '\n', last - p) );
+            const char *pEnd = nl ? nl : last;
+            const char *pNext = nl ? nl + 1 : last;
+            if (pEnd > p && *(pEnd - 1) == '\r')
+                --pEnd;
+            processLine( p, pEnd, ++lineno );
+            p = pNext;
+        } // while
+    } );
+}
+
+/**
+ * @brief 多线程读入数据文件, 跳过标题行, 依据 -m 选项用 ifstream 或 mmap 读取
+ *
+ * @param filename      数据文件名
+ * @param what          数据名称, 用于错误信息
+ * @param BATCH_SIZE    ifstream 方式下每个线程一次处理行数
+ * @param processLine   处理每一行的回调函数
+ */
+static
+void load_data_file( const char *filename, const char *what,
+                     const uint32_t BATCH_SIZE, const LineFunc &processLine )
+{
+    using namespace std;
+
+    if (g_bMmapLoader) {
+        MappedFile file;
+        if( !file.open(filename) )
+            throw runtime_error( string("Cannot open ") + what + " data file!" );
+
+        // skip the title
+        const char *title = file.data();
+        const char *nl = title ? static_cast<const char*>( memchr(title, '\n', file.size()) ) : NULL;
+        if( !nl )
+            throw runtime_error( string("Invalid ") + what + " data format!" );
+
+        load_file_mmap( file, nl + 1, processLine );
+        return;
+    } // if
+
     ifstream inFile( filename, ios::in );
     boost::mutex  fileMtx;
-    const uint32_t  BATCH_SIZE = 100;   // 每个线程一次处理行数
     uint32_t lineno = 0;
 
     if( !inFile )
-        throw runtime_error( "Cannot open user data file!" );
+        throw runtime_error( string("Cannot open ") + what + " data file!" );
 
     // skip the title
     string title;
     getline( inFile, title );
     if( !inFile )
-        throw runtime_error( "Invalid user data format!" );
+        throw runtime_error( string("Invalid ") + what + " data format!" );
+
+    // 多线程读入文件, 读入线程与本线程写入同一个模型版本
+    boost::thread_group thrgroup;
+    const ThreadContext *pContext = thread_context();
+    for( uint32_t i = 0; i < g_nMaxThread; ++i )
+        thrgroup.create_thread( [&, pContext] {
+            thread_context() = pContext;
+            load_file_thread_routine( inFile, fileMtx, BATCH_SIZE, lineno, processLine );
+        } );
+    thrgroup.join_all();
+}
+
+// 加载 users.csv
+static
+void load_user_data( const char *filename )
+{
+    using namespace std;
+
+    const uint32_t  BATCH_SIZE = 100;   // 每个线程一次处理行数
 
     // 从行文本中读入User信息并创建User
-    auto processLine = []( string &line, uint32_t lineCount ) {
-        char *pField = NULL, *saveEnd1 = NULL; // for strtok_r
+    auto processLine = []( const char *pLine, const char *pEnd, uint32_t lineCount ) {
+        const char *pField = NULL, *pFieldEnd = NULL;
         char errstr[128];
-        User_sptr pUser = std::make_shared< User >();
-        char *pLine = const_cast<char*>(line.c_str());
+        User_sptr pUser = std::allocate_shared< User >( FAST_ALLOCATOR(User)() );
 
         // read ID, maybe empty line, so when read fail just skip
-        if( !(pField = strtok_r(pLine, "\t", &saveEnd1)) || !read_from_string(pField, pUser->ID()) )
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->ID()) )
             return;
         // job roles
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_uint_set(pField, pUser->jobRoles()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_uint_set(pField, pFieldEnd, pUser->jobRoles()) ) {
             sprintf(errstr, "error reading %u record's jobrole!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // career level
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->careerLevel()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->careerLevel()) ) {
             sprintf(errstr, "error reading %u record careerLevel!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pUser->careerLevel() > 6) << pUser->careerLevel()
                 << " is not a valid careerLevel value, record no: " << lineCount;
         // discplineID
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->discplineID()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->discplineID()) ) {
             sprintf(errstr, "error reading %u record discplineID!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // industryID
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->industryID()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->industryID()) ) {
             sprintf(errstr, "error reading %u record industryID!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // country
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->country()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->country()) ) {
             sprintf(errstr, "error reading %u record country!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // region
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->region()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->region()) ) {
             sprintf(errstr, "error reading %u record region!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pUser->region() > 16) << pUser->region()
                 << " is not a valid region value, record no: " << lineCount;
         // CV entry
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->numOfCvEntry()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->numOfCvEntry()) ) {
             sprintf(errstr, "error reading %u record numOfCvEntry!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pUser->numOfCvEntry() > 3) << pUser->numOfCvEntry()
                 << " is not a valid numOfCvEntry value, record no: " << lineCount;
         // yearsOfExperience
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->yearsOfExperience()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->yearsOfExperience()) ) {
             sprintf(errstr, "error reading %u record yearsOfExperience!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pUser->yearsOfExperience() > 7) << pUser->yearsOfExperience()
                 << " is not a valid yearsOfExperience value, record no: " << lineCount;
         // yearsOfCurrentJob
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->yearsOfCurrentJob()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->yearsOfCurrentJob()) ) {
             sprintf(errstr, "error reading %u record yearsOfCurrentJob!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pUser->yearsOfCurrentJob() > 7) << pUser->yearsOfCurrentJob()
                 << " is not a valid yearsOfCurrentJob value, record no: " << lineCount;
         // eduDegree
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pUser->eduDegree()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pUser->eduDegree()) ) {
             sprintf(errstr, "error reading %u record eduDegree!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pUser->eduDegree() > 3) << pUser->eduDegree()
                 << " is not a valid eduDegree value, record no: " << lineCount;
         // eduFields, if eduDegree is 0, eduFields can be empty
-        if( (pField = strtok_r(NULL, "\t", &saveEnd1)) ) {
-            read_uint_set(pField, pUser->eduFields());
+        if( next_token(pLine, pEnd, '\t', pField, pFieldEnd) ) {
+            parse_uint_set(pField, pFieldEnd, pUser->eduFields());
         } // if
 
         // cout << *pUser << endl;
         g_pUserDB->addUser( pUser );
-        g_nMaxUserID = pUser->ID() > g_nMaxUserID ? pUser->ID() : g_nMaxUserID;
     }; // end lambda
 
-    // 多线程读入文件
-    boost::thread_group thrgroup;
-    for( uint32_t i = 0; i < g_nMaxThread; ++i )
-        thrgroup.create_thread( std::bind(load_file_thread_routine,
-                                    std::ref(inFile), std::ref(fileMtx),
-                                    BATCH_SIZE, std::ref(lineno), std::ref(processLine)) );
-        // thrgroup.create_thread( std::bind(load_file_thread_routine,
-                                    // std::ref(inFile), std::ref(fileMtx),
-                                    // BATCH_SIZE, std::ref(lineno), processLine) );
-    thrgroup.join_all();
-
-    return;
+    load_data_file( filename, "user", BATCH_SIZE, processLine );
 }
 
 // 加载 items.csv
@@ -398,95 +452,82 @@ void load_item_data( const char *filename )
 {
     using namespace std;
 
-    ifstream inFile( filename, ios::in );
-    boost::mutex  fileMtx;
     const uint32_t  BATCH_SIZE = 100;   // 每个线程一次处理行数
-    uint32_t lineno = 0;
-
-    if( !inFile )
-        throw runtime_error( "Cannot open item data file!" );
 
-    // skip the title line
-    string title;
-    getline( inFile, title );
-    if( !inFile )
-        throw runtime_error( "Invalid item data format!" );
-
-    auto processLine = []( string &line, uint32_t lineCount ) {
-        char *pField = NULL, *saveEnd1 = NULL; // for strtok_r
+    auto processLine = []( const char *pLine, const char *pEnd, uint32_t lineCount ) {
+        const char *pField = NULL, *pFieldEnd = NULL;
         char errstr[128];
-        Item_sptr pItem = std::make_shared< Item >();
-        char *pLine = const_cast<char*>(line.c_str());
+        Item_sptr pItem = std::allocate_shared< Item >( FAST_ALLOCATOR(Item)() );
 
         // read ID, maybe empty line, so when read fail just skip
-        if( !(pField = strtok_r(pLine, "\t", &saveEnd1)) || !read_from_string(pField, pItem->ID()) )
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->ID()) )
             return;
         // read title
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_uint_set(pField, pItem->title()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_uint_set(pField, pFieldEnd, pItem->title()) ) {
             sprintf(errstr, "error reading %u record's title!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // career level
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->careerLevel()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->careerLevel()) ) {
             sprintf(errstr, "error reading %u record careerLevel!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pItem->careerLevel() > 6) << pItem->careerLevel()
                 << " is not a valid careerLevel value, record no: " << lineCount;
         // discplineID
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->discplineID()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->discplineID()) ) {
             sprintf(errstr, "error reading %u record discplineID!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // industryID
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->industryID()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->industryID()) ) {
             sprintf(errstr, "error reading %u record industryID!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // country
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->country()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->country()) ) {
             sprintf(errstr, "error reading %u record country!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // region
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->region()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->region()) ) {
             sprintf(errstr, "error reading %u record region!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pItem->region() > 16) << pItem->region()
                 << " is not a valid region value, record no: " << lineCount;
         // latitude
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->latitude()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->latitude()) ) {
             sprintf(errstr, "error reading %u record latitude!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // longitude
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->longitude()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->longitude()) ) {
             sprintf(errstr, "error reading %u record longitude!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // employmentType
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, pItem->employmentType()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, pItem->employmentType()) ) {
             sprintf(errstr, "error reading %u record employmentType!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         LOG_IF(WARNING, pItem->employmentType() > 5) << pItem->employmentType()
                 << " is not a valid employmentType value, record no: " << lineCount;
         // tags
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_uint_set(pField, pItem->tags()) ) {
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_uint_set(pField, pFieldEnd, pItem->tags()) ) {
             sprintf(errstr, "error reading %u record's tags!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         // timestamp
-        unsigned long ts;
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, ts) ) {
+        unsigned long ts = 0;
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, ts) ) {
             sprintf(errstr, "error reading %u record timestamp!", lineCount);
             LOG(WARNING) << errstr;
         } // if
         pItem->createTime() = (time_t)ts;
         // active status
-        int status;
-        if( !(pField = strtok_r(NULL, "\t", &saveEnd1)) || !read_from_string(pField, status) ) {
+        int status = 0;
+        if( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, status) ) {
             sprintf(errstr, "error reading %u record active status!", lineCount);
             LOG(WARNING) << errstr;
         } // if
@@ -494,76 +535,70 @@ void load_item_data( const char *filename )
 
         // cout << *pItem << endl;
         g_pItemDB->addItem( pItem );
-        g_nMaxItemID = pItem->ID() > g_nMaxItemID ? pItem->ID() : g_nMaxItemID;
     }; // end processLine
 
-    boost::thread_group thrgroup;
-    for( uint32_t i = 0; i < g_nMaxThread; ++i )
-        thrgroup.create_thread( std::bind(load_file_thread_routine,
-                                    std::ref(inFile), std::ref(fileMtx),
-                                    BATCH_SIZE, std::ref(lineno), processLine) );
-    thrgroup.join_all();
+    load_data_file( filename, "item", BATCH_SIZE, processLine );
+}
 
-    return;
+/**
+ * @brief 解析 interactions_train.csv 格式的一行, 只读 g_pUserDB 和 g_pItemDB, 可多线程调用
+ * @return 空行, 标题行, 格式错误, 类型非法或 user/item 不在数据库中的行返回false
+ */
+static
+bool parse_interaction_line( const char *pLine, const char *pEnd, uint32_t lineCount,
+                             InteractionRecord &rec )
+{
+    const char *pField = NULL, *pFieldEnd = NULL;
+    uint32_t userID, itemID, interactType;
+    unsigned long timestamp;
+    User *pUser;
+    Item *pItem;
+
+    if ( !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, userID)
+            || !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, itemID)
+            || !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, interactType)
+            || !next_token(pLine, pEnd, '\t', pField, pFieldEnd) || !parse_number(pField, pFieldEnd, timestamp) )
+        return false;
+    // 数据来自外部 (包括流式导入的管道), 非法的类型只跳过这一行
+    if ( interactType == INVALID || interactType >= N_INTERACTION_TYPE ) {
+        LOG(ERROR) << "Wrong interaction record " << lineCount << ": invalid interaction type " << interactType;
+        return false;
+    } // if
+    if ( !g_pUserDB->queryUser(userID, pUser) ) {
+        // LOG(INFO) << "load_interaction_data cannot find user: " << userID;
+        return false;
+    } // if
+    if ( !g_pItemDB->queryItem(itemID, pItem) ) {
+        // LOG(INFO) << "load_interaction_data cannot find item: " << itemID;
+        return false;
+    } // if
+    if ( (time_t)timestamp < pItem->createTime() ) {
+        LOG(ERROR) << "Wrong interaction record " << lineCount << 
+                ": " << timestamp << " is earlier than item " << pItem->ID() 
+               << " created time " << pItem->createTime(); 
+        return false;
+    } // if
+    rec = InteractionRecord( pUser->index(), pItem->index(), interactType, (uint32_t)timestamp );
+    return true;
 }
 
-// 加载 interactions_train.csv 只导入用于训练的interaction数据
+// 加载 interactions_train.csv 只导入用于训练的interaction数据, 记录存入 store
 static
-void load_interaction_data( const char *filename )
+void load_interaction_data( const char *filename, InteractionStore &store )
 {
     using namespace std;
 
-    ifstream inFile( filename, ios::in );
-    boost::mutex  fileMtx;
     const uint32_t  BATCH_SIZE = 500;   // 每个线程一次处理行数
-    uint32_t lineno = 0;
-
-    if( !inFile )
-        throw runtime_error( "Cannot open iteraction data file!" );
 
-    // skip the title line
-    string title;
-    getline( inFile, title );
-    if( !inFile )
-        throw runtime_error( "Invalid interaction data format!" );
-
-    auto processLine = []( string &line, uint32_t lineCount ) {
-        uint32_t userID, itemID, interactType;
-        unsigned long timestamp;
-        InteractionRecord_sptr pInterRec;
-        User *pUser;
-        Item *pItem;
-
-        stringstream str(line);
-        str >> userID >> itemID >> interactType >> timestamp;
-        assert( interactType < N_INTERACTION_TYPE );
-        if ( !g_pUserDB->queryUser(userID, pUser) ) {
-            // LOG(INFO) << "load_interaction_data cannot find user: " << userID;
-            return;
-        } // if
-        if ( !g_pItemDB->queryItem(itemID, pItem) ) {
-            // LOG(INFO) << "load_interaction_data cannot find item: " << itemID;
-            return;
-        } // if
-        if ( (time_t)timestamp < pItem->createTime() ) {
-            LOG(ERROR) << "Wrong interaction record " << lineCount << 
-                    ": " << timestamp << " is earlier than item " << pItem->ID() 
-                   << " created time " << pItem->createTime(); 
-            return;
-        } // if
-        pInterRec = std::make_shared< InteractionRecord >
-                           (pUser, pItem, interactType, timestamp);
-        g_InteractStore->add( pInterRec );
-        pUser->addInteraction( pInterRec.get() );
-        pItem->addInteraction( pInterRec.get() );
+    auto processLine = [&store]( const char *pLine, const char *pEnd, uint32_t lineCount ) {
+        InteractionRecord rec;
+        // 空行或格式错误的行直接跳过
+        if ( parse_interaction_line(pLine, pEnd, lineCount, rec) )
+            store.add( rec );
     }; // end processLine
 
-    boost::thread_group thrgroup;
-    for( uint32_t i = 0; i < g_nMaxThread; ++i )
-        thrgroup.create_thread( std::bind(load_file_thread_routine,
-                                    std::ref(inFile), std::ref(fileMtx),
-                                    BATCH_SIZE, std::ref(lineno), processLine) );
-    thrgroup.join_all();
+    load_data_file( filename, "interaction", BATCH_SIZE, processLine );
+    store.flush();
 
     // sort users' interactions and items' interaction, by time later to earlier
 /*
@@ -605,6 +640,19 @@ void load_test_data( const char *filename )
     } // while
 }
 
+// 只统计写入个数的输出迭代器, 用于求交集的大小而不保存结果
+struct CountIterator {
+    std::size_t     *pCount;
+
+    explicit CountIterator( std::size_t &count ) : pCount(&count) {}
+
+    CountIterator& operator * () { return *this; }
+    CountIterator& operator ++ () { ++*pCount; return *this; }
+    CountIterator& operator ++ (int) { ++*pCount; return *this; }
+    template < typename T >
+    CountIterator& operator = ( const T& ) { return *this; }
+};
+
 /**
  * @brief 对单个用户推荐结果评分，评分方法见官方说明文档
  *
@@ -629,12 +677,12 @@ float score_one( const std::vector<uint32_t> &rcmdItems,
                         ? rcmdItems.begin() + k
                         : rcmdItems.end());
 
-        vector<uint32_t> interSet;
+        std::size_t nInter = 0;
         std::set_intersection( rcmdItems.begin(), endIt, 
                                relevantItems.begin(), relevantItems.end(),
-                               std::back_inserter(interSet) );
+                               CountIterator(nInter) );
 
-        return interSet.size() / (float)k;
+        return nInter / (float)k;
     };
 
     auto recall = [&] ()->float {
@@ -642,16 +690,16 @@ float score_one( const std::vector<uint32_t> &rcmdItems,
                         ? rcmdItems.begin() + RECALL_SIZE
                         : rcmdItems.end());
 
-        vector<uint32_t> interSet;
+        std::size_t nInter = 0;
         std::set_intersection( rcmdItems.begin(), endIt, 
                                relevantItems.begin(), relevantItems.end(),
-                               std::back_inserter(interSet) );
+                               CountIterator(nInter) );
 
-        nCorrect = interSet.size();
-        userSuccess = (interSet.empty() ? false : true);
-        precision30 = (float)(interSet.size()) / RECALL_SIZE;
+        nCorrect = nInter;
+        userSuccess = (nInter ? true : false);
+        precision30 = (float)(nInter) / RECALL_SIZE;
 
-        return (float)(interSet.size()) / relevantItems.size();
+        return (float)(nInter) / relevantItems.size();
     };
 
     precision2 = prescisionAtk(2);
@@ -730,39 +778,45 @@ void recommend_with_UserCF_OpenMP( uint32_t k, const char *filename )
 }
 
 /**
- * @brief UserCF 多线程版
+ * @brief 多线程为所有测试用户推荐并评分, UserCF 和 ItemCF 共用
  *
- * @param k         查找相似物品个数上限
+ * @param k         UserCF 中相似用户个数, ItemCF 中每个物品的相似物品个数
  * @param filename  结果写入文件
+ * @param algo      推荐算法, UserCF, UserCF_dense, UserCF_pruned, ItemCF 或 ItemCF_dense
  */
 static
-void recommend_with_UserCF_mt( uint32_t k, const char *filename )
+void recommend_mt( uint32_t k, const char *filename, RecommendFunc algo )
 {
     using namespace std;
 
-    float         score = 0.0;
-    auto          it = g_TestData.begin();
-    boost::mutex  itMtx, scoreMtx, fileMtx;
+    const size_t  GRAIN = 16;   // 每次领取的用户数
 
-    ofstream ofs(filename, ios::out);
-    if (!ofs) {
+    // 每个 slot 格式化到自己的缓冲区, 由 sink 的写线程写入文件
+    size_t      nSlots = g_pThreadPool->slots();
+    ResultSink  sink( nSlots );
+
+    // 结果文件标题
+    if (!sink.open(filename, "UserID\tN_Correct\tPrecisionAt2\tPrecisionAt4\tPrecisionAt6\tPrecisionAt20\tPrecisionAt30\tRecall\tRecommendedItems\n")) {
         cerr << "Cannot open " << filename << " for writting!" << endl;
         return;
     } // if
 
-    // 结果文件标题
-    ofs << "UserID\tN_Correct\tPrecisionAt2\tPrecisionAt4\tPrecisionAt6\tPrecisionAt20\tPrecisionAt30\tRecall\tRecommendedItems" << endl;
+    // 测试数据按下标访问
+    vector< const TestDataSet::value_type* > testUsers;
+    testUsers.reserve( g_TestData.size() );
+    for (const auto &v : g_TestData)
+        testUsers.push_back( &v );
+
+    // 对一段测试用户调用推荐算法，进行结果评分，结果写入本slot的缓冲区, 得分累加到本slot的部分和
+    auto processRange = [&]( size_t first, size_t last, size_t slot, float &score ) {
+        std::vector<RcmdItem> rcmdItems;
+        std::vector<uint32_t> rItemIds;
+        float                 localScore = 0.0;
 
-    // 每一个线程从测试数据集中取数据，调用UserCF算法，进行结果评分，写入文件
-    auto threadRoutine = [&] {
-        while (true) {
-            boost::unique_lock< boost::mutex >  itlck(itMtx);
-            if (it == g_TestData.end())
-                return;
-            uint32_t                 uID = it->first;
-            const std::set<uint32_t> &testItemSet = it->second;
-            ++it;
-            itlck.unlock();
+        for (size_t n = first; n != last; ++n) {
+            uint32_t                 uID = testUsers[n]->first;
+            const std::set<uint32_t> &testItemSet = testUsers[n]->second;
+            ModelPin                 pin;    // 每个用户的推荐在同一个模型版本和 epoch 上进行
 
             User                *pUser = NULL;
             if ( !g_pUserDB->queryUser(uID, pUser) ) {
@@ -770,47 +824,97 @@ void recommend_with_UserCF_mt( uint32_t k, const char *filename )
                 continue;
             } // if
 
-            std::vector<RcmdItem> rcmdItems;
-            UserCF( pUser, k, RECALL_SIZE, rcmdItems );
+            algo( pUser, k, RECALL_SIZE, rcmdItems );
             if (rcmdItems.empty()) {
                 LOG(INFO) << "No item recommended to user " << uID;
                 continue;
             } // if
 
-            std::vector<uint32_t> rItemIds( rcmdItems.size() );
+            rItemIds.resize( rcmdItems.size() );
             for (std::size_t i = 0; i != rcmdItems.size(); ++i)
                 rItemIds[i] = rcmdItems[i].pItem->ID();
 
             uint32_t nCorrect;
             float precision2, precision4, precision6, precision20, precision30, fRecall;
-            float localScore = score_one( rItemIds, testItemSet, nCorrect,
+            localScore += score_one( rItemIds, testItemSet, nCorrect,
                         precision2, precision4, precision6, precision20, precision30, fRecall );
 
-            boost::unique_lock< boost::mutex >  scLck(scoreMtx);
-            score += localScore;
-            scLck.unlock();
+            // 格式与原来 ostream << setprecision(3) 的输出相同
+            ResultSink::Buffer &buf = sink.buffer( slot );
+            append_uint( buf, uID ); buf += '\t';
+            append_uint( buf, nCorrect ); buf += '\t';
+            append_float( buf, precision2 ); buf += '\t';
+            append_float( buf, precision4 ); buf += '\t';
+            append_float( buf, precision6 ); buf += '\t';
+            append_float( buf, precision20 ); buf += '\t';
+            append_float( buf, precision30 ); buf += '\t';
+            append_float( buf, fRecall ); buf += '\t';
+            for (auto rit = rcmdItems.begin(); rit != rcmdItems.end(); ++rit) {
+                if (rit != rcmdItems.begin())
+                    buf += ',';
+                append_uint( buf, rit->pItem->ID() ); buf += ':';
+                append_float( buf, rit->weight );
+            } // for
+            buf += '\n';
+            sink.commit( slot );
+        } // for n
 
-            // 写入结果到文件
-            boost::unique_lock< boost::mutex >  fLck(fileMtx);
-            ofs << std::setprecision(3) << uID << "\t" << nCorrect << "\t" 
-                               << precision2 << "\t" << precision4 << "\t" 
-                               << precision6 << "\t" << precision20 << "\t"
-                               << precision30 << "\t" << fRecall << "\t";
-            for (auto rit = rcmdItems.begin(); rit != rcmdItems.end()-1; ++rit)
-                ofs << rit->pItem->ID() << ":" << rit->weight << ",";
-            ofs << rcmdItems.back().pItem->ID() << ":" << rcmdItems.back().weight << endl;
-            fLck.unlock();
-        } // while
+        score += localScore;
     };
 
-    boost::thread_group thrgroup;
-    for( uint32_t i = 0; i < g_nMaxThread; ++i )
-        thrgroup.create_thread( threadRoutine );
-    thrgroup.join_all();
+    float score = g_pThreadPool->parallel_reduce( 0, testUsers.size(), GRAIN, 0.0f, processRange,
+                                                  []( float lhs, float rhs ) { return lhs + rhs; } );
+
+    if (!sink.close())
+        cerr << "Error writing " << filename << endl;
 
     cout << "Total score: " << score << endl;
 }
 
+/**
+ * @brief 计算每个物品的相似物品列表, 已有同样k的列表(比如从快照导入的)时直接使用
+ *
+ * @param k     每个物品至多保存k个最相似物品
+ */
+static
+void prepare_items_similarity( std::size_t k )
+{
+    using namespace std;
+
+    if (g_Model->nSimilarItemsK == k)
+        return;
+
+    if (g_Model->nSimilarItemsK) {
+        for (Item *pItem : g_pItemDB->items())
+            pItem->similarItems().clear();
+    } // if
+
+    cout << "Getting all items similarities..." << endl;
+    get_all_items_similarity( k );
+    g_Model->nSimilarItemsK = k;
+    cout << "Getting all items similarities done!" << endl;
+}
+
+/**
+ * @brief 离线计算每个用户的相似用户列表, 已有不小于k的列表(比如从快照导入的)时直接使用
+ *
+ * @param k     每个用户至多保存k个最相似用户
+ */
+static
+void prepare_users_similarity( std::size_t k )
+{
+    using namespace std;
+
+    // 列表按相似度排好序, 前k个即k较小时的结果
+    if (g_Model->nSimilarUsersK >= k)
+        return;
+
+    cout << "Getting all users similarities..." << endl;
+    get_all_users_similarity( k );
+    g_Model->nSimilarUsersK = k;
+    cout << "Getting all users similarities done!" << endl;
+}
+
 static
 void recommend_with_ItemCF_OpenMP( uint32_t k, const char *filename )
 {
@@ -863,9 +967,7 @@ void recommend_with_ItemCF_OpenMP( uint32_t k, const char *filename )
         } // omp critical
     };
 
-    cout << "Getting all items similarities..." << endl;
-    get_all_items_similarity( k );
-    cout << "Getting all items similarities done!" << endl;
+    prepare_items_similarity( k );
 
 #pragma omp parallel
 #pragma omp single
@@ -879,79 +981,456 @@ void recommend_with_ItemCF_OpenMP( uint32_t k, const char *filename )
     cout << "Total score: " << score << endl;
 }
 
-// 过程同 recommend_with_UserCF_mt
+// UserCF 多线程版
+static
+void recommend_with_UserCF_mt( uint32_t k, const char *filename,
+                               RecommendFunc algo = UserCF_dense )
+{ recommend_mt( k, filename, algo ); }
+
+/*
+ * ItemCF 多线程版, 先算好(或沿用快照中的)相似物品列表, 过程同 recommend_with_UserCF_mt.
+ * 原来逐个用户 addJob 之后不等任务完成就输出总分, 现在由 recommend_mt 等全部完成.
+ */
+static
+void recommend_with_ItemCF_mt( uint32_t k, const char *filename,
+                               RecommendFunc algo = ItemCF_dense )
+{
+    {
+        // 流式导入或重新建模可能已经开始
+        ModelPin pin;
+        prepare_items_similarity( k );
+    }
+    recommend_mt( k, filename, algo );
+}
+
+/**
+ * @brief 截断热门物品 posting 对 UserCF 结果的影响: 抽取部分测试用户, 分别用截断和
+ *        完整的 posting 推荐, 比较推荐列表, 得分和单个用户的耗时
+ *
+ * @param k         相似用户个数
+ * @param nSample   至多抽取的用户数
+ */
 static
-void recommend_with_ItemCF_mt( uint32_t k, const char *filename )
+void report_posting_cap( uint32_t k, std::size_t nSample = 2000 )
 {
     using namespace std;
+    typedef std::chrono::steady_clock Clock;
+
+    std::size_t step = g_TestData.size() / nSample + 1;
+    std::size_t nUsers = 0, nSame = 0;
+    double      overlap = 0.0;
+    float       scoreCapped = 0.0, scoreExact = 0.0;
+    double      timeCapped = 0.0, timeExact = 0.0, maxCapped = 0.0, maxExact = 0.0;
+
+    std::vector<RcmdItem> capped, exact;
+    std::vector<uint32_t> cappedIds, exactIds;
+    std::size_t n = 0;
+    for (auto it = g_TestData.begin(); it != g_TestData.end(); ++it, ++n) {
+        if (n % step)
+            continue;
+        User *pUser = NULL;
+        if (!g_pUserDB->queryUser(it->first, pUser))
+            continue;
 
-    float score = 0.0;
+        auto t0 = Clock::now();
+        UserCF_dense( pUser, k, RECALL_SIZE, capped );
+        auto t1 = Clock::now();
+        UserCF_dense_exact( pUser, k, RECALL_SIZE, exact );
+        auto t2 = Clock::now();
+        if (exact.empty())
+            continue;
 
-    ofstream ofs(filename, ios::out);
-    if (!ofs) {
-        cerr << "Cannot open " << filename << " for writting!" << endl;
+        double dc = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        double de = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        timeCapped += dc; maxCapped = std::max( maxCapped, dc );
+        timeExact += de; maxExact = std::max( maxExact, de );
+
+        cappedIds.clear();
+        for (const auto &r : capped)
+            cappedIds.push_back( r.pItem->ID() );
+        exactIds.clear();
+        for (const auto &r : exact)
+            exactIds.push_back( r.pItem->ID() );
+
+        uint32_t nCorrect;
+        float precision2, precision4, precision6, precision20, precision30, fRecall;
+        scoreCapped += score_one( cappedIds, it->second, nCorrect,
+                    precision2, precision4, precision6, precision20, precision30, fRecall );
+        scoreExact += score_one( exactIds, it->second, nCorrect,
+                    precision2, precision4, precision6, precision20, precision30, fRecall );
+
+        if (cappedIds == exactIds)
+            ++nSame;
+        std::sort( cappedIds.begin(), cappedIds.end() );
+        std::sort( exactIds.begin(), exactIds.end() );
+        std::size_t nInter = 0;
+        std::set_intersection( cappedIds.begin(), cappedIds.end(), exactIds.begin(), exactIds.end(),
+                               CountIterator(nInter) );
+        overlap += (double)nInter / exactIds.size();
+        ++nUsers;
+    } // for
+
+    if (!nUsers)
         return;
+
+    cout << "Posting cap " << g_pGraph->postingCap() << " on " << nUsers << " sampled users:" << endl;
+    cout << "  identical lists: " << setprecision(4) << 100.0 * nSame / nUsers << "%, "
+         << "mean overlap with exact: " << 100.0 * overlap / nUsers << "%" << endl;
+    cout << "  score capped / exact: " << scoreCapped << " / " << scoreExact << endl;
+    cout << "  time per user capped / exact: mean " << timeCapped / nUsers << " / " << timeExact / nUsers
+         << " ms, max " << maxCapped << " / " << maxExact << " ms" << endl;
+}
+
+/*
+ * 先离线算好所有用户的相似用户列表, 在线只汇总推荐度
+ */
+static
+void recommend_with_UserCF_offline( uint32_t k, const char *filename )
+{
+    {
+        ModelPin pin;
+        prepare_users_similarity( k );
+    }
+    recommend_mt( k, filename, UserCF_precomputed );
+}
+
+/**
+ * @brief 把一批交互记录并入本线程所用模型版本的 g_pGraph 和 g_InteractStore, 相似列表不变.
+ *        与流式导入的一个 epoch 相同. 返回并入前的图
+ */
+static
+GraphHandle::Ptr publish_interactions( const std::vector<InteractionRecord> &batch )
+{
+    GraphHandle::Ptr pOldGraph = g_pGraph.current();
+    GraphHandle::Ptr pGraph = std::make_shared<InteractionGraph>();
+    pGraph->buildFrom( *pOldGraph, batch );
+    g_pGraph.publish( pGraph );
+
+    // 与流式导入一样追加到 g_InteractStore, 重新建模时由此带到新版本
+    for (const InteractionRecord &rec : batch)
+        g_InteractStore->add( rec );
+    g_InteractStore->flush();
+    return pOldGraph;
+}
+
+/**
+ * @brief 把一批交互记录并入本线程所用模型版本的 g_pGraph 和 g_InteractStore,
+ *        已有的相似物品列表增量更新. 不能与推荐并发执行.
+ */
+static
+void merge_interactions( const std::vector<InteractionRecord> &batch )
+{
+    using namespace std;
+
+    GraphHandle::Ptr pOldGraph = publish_interactions( batch );
+
+    if (g_Model->nSimilarItemsK) {
+        size_t nRows = update_items_similarity( *pOldGraph, g_Model->nSimilarItemsK );
+        cout << nRows << " of " << g_pItemDB->size() << " items similarities updated." << endl;
     } // if
 
-    ofs << "UserID\tN_Correct\tPrecisionAt2\tPrecisionAt4\tPrecisionAt6\tPrecisionAt20\tPrecisionAt30\tRecall\tRecommendedItems" << endl;
+    // 相似用户列表没有增量更新, 用到时重新计算
+    if (g_Model->nSimilarUsersK) {
+        for (User *pUser : g_pUserDB->users())
+            pUser->similarUsers().clear();
+        g_Model->nSimilarUsersK = 0;
+    } // if
+}
 
-    boost::mutex mtx;
+/**
+ * @brief 把新的交互记录并入 g_pGraph, 已有的相似物品列表增量更新.
+ *        新记录中的 user 和 item 必须已在数据库中, 否则跳过.
+ *
+ * @param filename  新交互记录文件, 格式同 interactions_train.csv
+ */
+static
+void apply_interaction_delta( const char *filename )
+{
+    using namespace std;
 
-    auto process = [&]( const TestDataSet::value_type &v ) {
-        uint32_t                 uID = v.first;
-        const std::set<uint32_t> &testItemSet = v.second;
-        User                     *pUser = NULL;
+    InteractionStore delta;
+    load_interaction_data( filename, delta );
+    vector<InteractionRecord> batch;
+    batch.reserve( delta.size() );
+    for (size_t i = 0; i != delta.size(); ++i)
+        batch.push_back( delta.record((uint32_t)i) );
 
-        if ( !g_pUserDB->queryUser(uID, pUser) ) {
-            LOG(INFO) << "No user " << uID << " found in user database.";
-            return;
-        } // if
+    merge_interactions( batch );
+}
 
-        std::vector<RcmdItem> rcmdItems;
-        ItemCF( pUser, k, RECALL_SIZE, rcmdItems );
-        if (rcmdItems.empty()) {
-            LOG(INFO) << "No item recommended to user " << uID;
-            return;
-        } // if
+/*
+ * ItemCF 按需计算相似物品列表, 只算测试用户用到的物品, 列表放在有内存上限的缓存中
+ */
+static
+void recommend_with_ItemCF_lazy( uint32_t k, const char *filename )
+{
+    using namespace std;
 
-        std::vector<uint32_t> rItemIds( rcmdItems.size() );
-        for (std::size_t i = 0; i != rcmdItems.size(); ++i)
-            rItemIds[i] = rcmdItems[i].pItem->ID();
-        uint32_t nCorrect;
-        float precision2, precision4, precision6, precision20, precision30, fRecall;
-        float localScore = score_one( rItemIds, testItemSet, nCorrect,
-                precision2, precision4, precision6, precision20, precision30, fRecall );
-        // critical section
+    recommend_mt( k, filename, ItemCF_lazy );
+
+    // 推荐期间可能换了模型版本, 报告最新版本的缓存
+    ModelPin pin;
+    cout << "Similarity cache: " << g_pSimilarityCache->misses() << " lists computed ("
+         << g_pItemDB->size() << " items in total), " << g_pSimilarityCache->hits() << " hits, "
+         << g_pSimilarityCache->evictions() << " evictions, "
+         << (g_pSimilarityCache->bytes() >> 10) << " KB in use" << endl;
+}
+
+/**
+ * @brief 导入 users, items 和 interactions, 从快照(-r)或csv文件, 写入本线程所用的模型版本
+ */
+static
+void load_model()
+{
+    using namespace std;
+
+    if (!g_strLoadSnapshot.empty()) {
+        cout << "Loading snapshot " << g_strLoadSnapshot << "..." << endl;
+        g_Model->nSimilarItemsK = load_snapshot( g_strLoadSnapshot.c_str(), g_bDenseStorage, &g_Model->nSimilarUsersK );
+        return;
+    } // if
+
+    cout << "Loading users data..." << endl;
+    load_user_data( "data/users.csv" );
+    g_pUserDB->buildIndex( g_bDenseStorage );
+    g_nMaxUserID = g_pUserDB->maxID();
+    cout << "Loading items data..." << endl;
+    load_item_data( "data/items.csv" );
+    g_pItemDB->buildIndex( g_bDenseStorage );
+    g_nMaxItemID = g_pItemDB->maxID();
+
+    cout << "Loading interaction data..." << endl;
+    load_interaction_data( "data/interactions_train.csv", *g_InteractStore );
+    g_Model->nBaseRecords = g_InteractStore->size();
+    cout << "Building interaction graph..." << endl;
+    g_pGraph.reset( new InteractionGraph );
+    g_pGraph->build( *g_InteractStore, g_pUserDB->size(), g_pItemDB->size() );
+}
+
+/**
+ * @brief 推荐之前按算法准备好本线程所用的模型版本: 相似物品或相似用户列表, 按需计算的缓存.
+ *        流式导入期间相似列表不随新记录更新, 停留在准备时的 epoch;
+ *        itemcf_lazy 的列表由各请求固定的 epoch 计算, 不同列表可能来自不同的 epoch
+ */
+static
+void prepare_model( uint32_t k )
+{
+    if (g_strAlgorithm == "itemcf" || g_strAlgorithm == "itemcf_ref")
+        prepare_items_similarity( k );
+    else if (g_strAlgorithm == "usercf_offline")
+        prepare_users_similarity( k );
+    else if (g_strAlgorithm == "itemcf_lazy" && !g_pSimilarityCache)
+        g_pSimilarityCache.reset( new SimilarityCache( g_nCacheBudgetMB << 20,
+                [k]( uint32_t i, SimilarityCache::List &out ) { get_item_similarity_row( i, k, out ); } ) );
+}
+
+/**
+ * @brief 把旧版本 g_InteractStore 中 [first, last) 的记录按 ID 转换成本线程所用版本的下标,
+ *        放入 batch. 流式导入先领取编号再写入记录, last 要在 updateMutex 下取得
+ */
+static
+void replay_interactions( const ModelGeneration &old, std::size_t first, std::size_t last,
+                          std::vector<InteractionRecord> &batch )
+{
+    const InteractionStore &store = *old.pInteractStore;
+    const std::vector<User*> &oldUsers = old.pUserDB->users();
+    const std::vector<Item*> &oldItems = old.pItemDB->items();
+    UserDB &userDB = *g_pUserDB;
+    ItemDB &itemDB = *g_pItemDB;
+
+    batch.clear();
+    batch.reserve( last - first );
+    for (std::size_t i = first; i < last; ++i) {
+        InteractionRecord rec = store.record( (uint32_t)i );
+        User *pUser;
+        Item *pItem;
+        if (!userDB.queryUser(oldUsers[rec.userIndex()]->ID(), pUser)
+                || !itemDB.queryItem(oldItems[rec.itemIndex()]->ID(), pItem))
+            continue;
+        batch.push_back( InteractionRecord(pUser->index(), pItem->index(), rec.type(), (uint32_t)rec.time()) );
+    } // for i
+}
+
+/**
+ * @brief 在后台建立新的模型版本, 建好后替换当前版本, 等旧版本的请求都结束后释放它.
+ *        建立期间推荐照常在当前版本上进行. 新版本与启动时一样导入和准备, 再补上旧版本中
+ *        建模输入之外的记录(-n 和流式导入并入的): 先补上已有的, 再在 updateMutex 下
+ *        只把期间新并入的补进图中并换代, 之后流式导入并入新版本.
+ */
+static
+void rebuild_model( uint32_t k )
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point start = Clock::now();
+    ModelHandle::Ptr pOld = g_Model.current();
+    ModelHandle::Ptr pGen = std::make_shared<ModelGeneration>();
+    Clock::time_point built;
+    std::size_t nReplayed = 0;
+    try {
+        // 本线程和它发起的 parallel_for 都写入新版本
+        ModelPin pin( pGen );
+        load_model();
+        if (g_nPostingCap)
+            g_pGraph->capItemPostings( g_nPostingCap, g_CapPolicy );
+        std::size_t n;
         {
-            boost::unique_lock<boost::mutex> lock(mtx);
-            score += localScore;
-            ofs << std::setprecision(3) << uID << "\t" << nCorrect << "\t" 
-                               << precision2 << "\t" << precision4 << "\t" 
-                               << precision6 << "\t" << precision20 << "\t"
-                               << precision30 << "\t" << fRecall << "\t";
-            for (auto rit = rcmdItems.begin(); rit != rcmdItems.end()-1; ++rit)
-                ofs << rit->pItem->ID() << ":" << rit->weight << ",";
-            ofs << rcmdItems.back().pItem->ID() << ":" << rcmdItems.back().weight << endl;
-        } // critical section
-    };
+            boost::lock_guard<boost::mutex> lk( g_Model.updateMutex() );
+            n = pOld->pInteractStore->size();
+        }
+        std::vector<InteractionRecord> batch;
+        replay_interactions( *pOld, pOld->nBaseRecords, n, batch );
+        if (!batch.empty())
+            merge_interactions( batch );
+        prepare_model( k );
+        built = Clock::now();
+
+        // 旧版本仍在并入流式导入的记录, 最后一段持锁补上并换代, 之后的批次会发现换代.
+        // 与流式导入一样只并入图, 相似列表停留在准备时的 epoch, 锁内不做耗时的准备
+        boost::lock_guard<boost::mutex> lk( g_Model.updateMutex() );
+        std::size_t last = pOld->pInteractStore->size();
+        replay_interactions( *pOld, n, last, batch );
+        if (!batch.empty())
+            publish_interactions( batch );
+        nReplayed = last - pOld->nBaseRecords;
+        g_Model.publish( pGen );
+    } catch ( const std::exception &ex ) {
+        LOG(ERROR) << "Rebuilding model fail: " << ex.what();
+        return;
+    } // try
 
-    cout << "Getting all items similarities..." << endl;
-    get_all_items_similarity( k );
-    cout << "Getting all items similarities done!" << endl;
+    Clock::time_point published = Clock::now();
+    pGen.reset();
+    pOld.reset();
 
-    ThreadPool<std::function<void(void)>> thrpool(g_nMaxThread);
-    for (auto it = g_TestData.begin(); it != g_TestData.end(); ++it)
-        thrpool.addJob( std::bind(process, *it) );
+    // 宽限期: 等固定旧版本的请求都结束
+    while (g_Model.reclaim())
+        std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+    Clock::time_point reclaimed = Clock::now();
 
-    cout << "Total score: " << score << endl;
+    LOG(INFO) << "Model generation " << g_Model.generation() << " built in "
+              << std::chrono::duration<double>(built - start).count() << " s, "
+              << nReplayed << " live records replayed, published "
+              << std::chrono::duration<double, std::milli>(published - built).count() << " ms later, old generation reclaimed "
+              << std::chrono::duration<double, std::milli>(reclaimed - published).count() << " ms after publishing.";
+}
+
+static
+void usage( const char *prog )
+{
+    using namespace std;
+
+    cerr << "Usage: " << prog << " [-d] [-m] [-a algorithm] [-c cap [-p policy]] [-b MB] [-n file] [-f file] [-g] [-r snapshot | -w snapshot [-s k] [-u k]]" << endl;
+    cerr << "  -d    dense storage, users and items live in contiguous arrays after loading" << endl;
+    cerr << "  -m    load data files through mmap, parse newline aligned ranges in parallel" << endl;
+    cerr << "  -a    usercf (default), usercf_pruned (max-score pruned neighbour search), usercf_ref (std::map based reference UserCF), usercf_offline (precomputed neighbours), itemcf, itemcf_ref (std::map based reference ItemCF), itemcf_lazy (similar items computed on demand)" << endl;
+    cerr << "  -c    usercf expands at most cap users of every item, and reports how much this changed the result" << endl;
+    cerr << "  -p    with -c, keep the most recent (default) or most active users of a capped item: recent | active" << endl;
+    cerr << "  -b    memory budget in MB of the itemcf_lazy similarity cache, default 256" << endl;
+    cerr << "  -n    merge the interactions in file before recommending, itemcf updates its similar items incrementally" << endl;
+    cerr << "  -f    follow an append-only interactions file or named pipe while recommending, new interactions become visible in batches (epochs)" << endl;
+    cerr << "  -g    rebuild the model in the background while recommending and swap it in, requests already started finish on the old one" << endl;
+    cerr << "  -r    load users, items and interactions from a snapshot instead of the csv files" << endl;
+    cerr << "  -w    write a snapshot after loading the csv files" << endl;
+    cerr << "  -s    with -w, also compute and save the k most similar items of every item" << endl;
+    cerr << "  -u    with -w, also compute and save the k most similar users of every user" << endl;
+}
+
+static
+void parse_args( int argc, char **argv )
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "dma:c:p:b:n:f:gr:w:s:u:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            g_bDenseStorage = true;
+            break;
+        case 'm':
+            g_bMmapLoader = true;
+            break;
+        case 'a':
+            g_strAlgorithm = optarg;
+            if (g_strAlgorithm != "usercf" && g_strAlgorithm != "usercf_pruned"
+                    && g_strAlgorithm != "usercf_ref" && g_strAlgorithm != "usercf_offline"
+                    && g_strAlgorithm != "itemcf" && g_strAlgorithm != "itemcf_ref"
+                    && g_strAlgorithm != "itemcf_lazy") {
+                usage( argv[0] );
+                exit(-1);
+            } // if
+            break;
+        case 'c':
+            g_nPostingCap = strtoul( optarg, NULL, 10 );
+            if (!g_nPostingCap) {
+                usage( argv[0] );
+                exit(-1);
+            } // if
+            break;
+        case 'p':
+            if (!strcmp(optarg, "recent"))
+                g_CapPolicy = InteractionGraph::CAP_RECENT;
+            else if (!strcmp(optarg, "active"))
+                g_CapPolicy = InteractionGraph::CAP_ACTIVE;
+            else {
+                usage( argv[0] );
+                exit(-1);
+            } // if
+            break;
+        case 'b':
+            g_nCacheBudgetMB = strtoul( optarg, NULL, 10 );
+            if (!g_nCacheBudgetMB) {
+                usage( argv[0] );
+                exit(-1);
+            } // if
+            break;
+        case 'n':
+            g_strDeltaFile = optarg;
+            break;
+        case 'f':
+            g_strFeedFile = optarg;
+            break;
+        case 'g':
+            g_bRebuild = true;
+            break;
+        case 'r':
+            g_strLoadSnapshot = optarg;
+            break;
+        case 'w':
+            g_strSaveSnapshot = optarg;
+            break;
+        case 's':
+            g_nSnapshotSimilarK = strtoul( optarg, NULL, 10 );
+            if (!g_nSnapshotSimilarK) {
+                usage( argv[0] );
+                exit(-1);
+            } // if
+            break;
+        case 'u':
+            g_nSnapshotSimilarUsersK = strtoul( optarg, NULL, 10 );
+            if (!g_nSnapshotSimilarUsersK) {
+                usage( argv[0] );
+                exit(-1);
+            } // if
+            break;
+        case 'h':
+            usage( argv[0] );
+            exit(0);
+        default:
+            usage( argv[0] );
+            exit(-1);
+        } // switch
+    } // while
+
+    if (!g_strLoadSnapshot.empty() && !g_strSaveSnapshot.empty()) {
+        usage( argv[0] );
+        exit(-1);
+    } // if
 }
 
 static
 void init()
 {
-    g_pUserDB.reset( new UserDB );
-    g_pItemDB.reset( new ItemDB );
-    g_InteractStore.reset( new InteractionStore(1000) );
+    // 第一个模型版本, 数据随后导入
+    g_Model.publish( std::make_shared<ModelGeneration>() );
 
     g_nMaxUserID = 0;
     g_nMaxItemID = 0;
@@ -960,6 +1439,8 @@ void init()
     g_nMaxThread = boost::thread::hardware_concurrency();
     if( !g_nMaxThread )
         g_nMaxThread = 1;
+
+    g_pThreadPool.reset( new JobPool(g_nMaxThread) );
 }
 
 // 按需求生成指定属性的数据集，类似连接查询，与业务无关
@@ -968,18 +1449,17 @@ void gen_join_data( const char *filename )
 {
     using namespace std;
 
-    auto cmp = []( const InteractionRecord_sptr &lhs, const InteractionRecord_sptr &rhs )->bool {
-        return lhs->time() > rhs->time();
+    auto cmp = []( const InteractionRecord &lhs, const InteractionRecord &rhs )->bool {
+        return lhs.time() > rhs.time();
     };
     
     cout << "Sorting interactions..." << endl;
     size_t nAllInteractions = g_InteractStore->size();
-    vector<InteractionRecord_sptr>      interacts;
+    vector<InteractionRecord>      interacts;
     interacts.reserve( nAllInteractions );
 
-    auto &content = g_InteractStore->content();
-    for (uint32_t i = 0; i != InteractionStore::HASH_SIZE; ++i)
-        interacts.insert( interacts.end(), content[i].begin(), content[i].end() );
+    for (size_t i = 0; i != nAllInteractions; ++i)
+        interacts.push_back( g_InteractStore->record((uint32_t)i) );
     sort( interacts.begin(), interacts.end(), cmp );
 
     cout << "All " << interacts.size() << " interaction records." << endl;
@@ -991,15 +1471,15 @@ void gen_join_data( const char *filename )
         << "\tuser_industry_id\titem_industry_id\tuser_country"
         << "\titem_country\tuser_region\titem_region\tcreated_at" << endl;
     for ( const auto &p : interacts ) {
-        User* pUser = p->user();
-        Item* pItem = p->item();
-        ofs << pUser->ID() << "\t" << pItem->ID() << "\t" << p->type()
+        User* pUser = p.user();
+        Item* pItem = p.item();
+        ofs << pUser->ID() << "\t" << pItem->ID() << "\t" << p.type()
             << "\t" << pUser->careerLevel() << "\t" << pItem->careerLevel()
             << "\t" << pUser->discplineID() << "\t" << pItem->discplineID()
             << "\t" << pUser->industryID() << "\t" << pItem->industryID()
             << "\t" << pUser->country() << "\t" << pItem->country()
             << "\t" << pUser->region() << "\t" << pItem->region()
-            << "\t" << p->time() << endl;
+            << "\t" << p.time() << endl;
         // ofs << pUser->ID() << "\t" << pUser->careerLevel() << "\t";
         // ofs << pItem->ID() << "\t" << pItem->careerLevel() << "\t";
         // ofs << p->type() << "\t" << p->time() << endl;
@@ -1015,22 +1495,31 @@ int main( int argc, char **argv )
     using namespace std;
 
     google::InitGoogleLogging(argv[0]);
+    parse_args( argc, argv );
 
     try {
         // test();
         init();
 
-        cout << "Loading users data..." << endl;
-        load_user_data( "data/users.csv" );
-        cout << "Loading items data..." << endl;
-        load_item_data( "data/items.csv" );
-
-        cout << "Loading interaction data..." << endl;
-        load_interaction_data( "data/interactions_train.csv" );
+        // 测试数据和训练数据互不依赖, 在线程池中同时导入
+        cout << "Loading test data..." << endl;
+        JobPool::Future testDataLoaded = g_pThreadPool->addJob(
+                    std::bind(load_test_data, "data/interactions_test.csv") );
+
+        load_model();
+        if (!g_strSaveSnapshot.empty()) {
+            if (g_nSnapshotSimilarK)
+                prepare_items_similarity( g_nSnapshotSimilarK );
+            if (g_nSnapshotSimilarUsersK)
+                prepare_users_similarity( g_nSnapshotSimilarUsersK );
+            cout << "Writing snapshot " << g_strSaveSnapshot << "..." << endl;
+            save_snapshot( g_strSaveSnapshot.c_str(), g_Model->nSimilarItemsK, g_Model->nSimilarUsersK );
+        } // if
+        if (g_nPostingCap)
+            g_pGraph->capItemPostings( g_nPostingCap, g_CapPolicy );
         print_data_info();
         // gen_join_data( "data/join.csv" );
-        cout << "Loading test data..." << endl;
-        load_test_data( "data/interactions_test.csv" );
+        testDataLoaded.get();
         cout << g_TestData.size() << " users for test." << endl;
         // gen_small_dataset( 80000, 100000 );
         // handle_command();
@@ -1039,15 +1528,58 @@ int main( int argc, char **argv )
         cout << "Input k for usercf / itemcf:" << endl;
         int k;
         cin >> k;
+        if (!g_strDeltaFile.empty()) {
+            // itemcf 先有相似物品列表, 再增量更新
+            if (g_strAlgorithm == "itemcf" || g_strAlgorithm == "itemcf_ref")
+                prepare_items_similarity( k );
+            cout << "Merging new interactions " << g_strDeltaFile << "..." << endl;
+            apply_interaction_delta( g_strDeltaFile.c_str() );
+        } // if
+        // 流式导入和后台重新建模开始之前先准备好当前版本
+        prepare_model( k );
+        std::unique_ptr<InteractionFeed> pFeed;
+        if (!g_strFeedFile.empty()) {
+            cout << "Following new interactions " << g_strFeedFile << "..." << endl;
+            pFeed.reset( new InteractionFeed( g_strFeedFile, parse_interaction_line ) );
+            pFeed->start();
+        } // if
+        boost::thread rebuilder;
+        if (g_bRebuild) {
+            g_Model.beginPublishing();
+            rebuilder = boost::thread( rebuild_model, k );
+        } // if
         cout << "Processing recommendation..." << endl;
         time_t now = time(0);
         cout << ctime(&now) << endl;
         // recommend_with_UserCF_OpenMP( k, "rcmd_result.txt" );
-        recommend_with_UserCF_mt( k, "rcmd_result.txt" );
-        // recommend_with_ItemCF_mt( 30, "rcmd_result.txt" );
+        if (g_strAlgorithm == "usercf_ref")
+            recommend_with_UserCF_mt( k, "rcmd_result.txt", UserCF );
+        else if (g_strAlgorithm == "usercf_pruned")
+            recommend_with_UserCF_mt( k, "rcmd_result.txt", UserCF_pruned );
+        else if (g_strAlgorithm == "usercf_offline")
+            recommend_with_UserCF_offline( k, "rcmd_result.txt" );
+        else if (g_strAlgorithm == "itemcf")
+            recommend_with_ItemCF_mt( k, "rcmd_result.txt" );
+        else if (g_strAlgorithm == "itemcf_ref")
+            recommend_with_ItemCF_mt( k, "rcmd_result.txt", ItemCF );
+        else if (g_strAlgorithm == "itemcf_lazy")
+            recommend_with_ItemCF_lazy( k, "rcmd_result.txt" );
+        else
+            recommend_with_UserCF_mt( k, "rcmd_result.txt", UserCF_dense );
+        if (rebuilder.joinable()) {
+            rebuilder.join();
+            g_Model.endPublishing();
+            cout << "Model rebuilt in background, generation " << g_Model.generation() << " in service." << endl;
+        } // if
+        if (pFeed) {
+            pFeed->stop();
+            cout << pFeed->records() << " new interactions merged in " << pFeed->epochs() << " epochs." << endl;
+        } // if
         cout << "Recommendation Done!" << endl;
         now = time(0);
         cout << ctime(&now) << endl;
+        if (g_nPostingCap && g_strAlgorithm == "usercf")
+            report_posting_cap( k );
 
     } catch ( const exception &ex ) {
         cerr << "Exception: " << ex.what() << endl;
@@ -1167,6 +1699,7 @@ void print_data_info()
     cout << "n_users: " << g_pUserDB->size() << endl;
     cout << "n_items: " << g_pItemDB->size() << endl;
     cout << "n_interactions: " << g_InteractStore->size() << endl;
+    cout << "n_edges: " << g_pGraph->nEdges() << endl;
 
     // for test
     cout << "g_nMaxUserID = " << g_nMaxUserID << endl;
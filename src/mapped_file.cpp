@@ -0,0 +1,72 @@
+#include "mapped_file.h"
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+bool MappedFile::open( const char *filename )
+{
+    close();
+
+    int fd = ::open( filename, O_RDONLY );
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close( fd );
+        return false;
+    } // if
+
+    m_nSize = (std::size_t)st.st_size;
+    if (!m_nSize) {
+        ::close( fd );
+        return true;
+    } // if
+
+    void *p = ::mmap( NULL, m_nSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd );
+    if (p == MAP_FAILED) {
+        m_nSize = 0;
+        return false;
+    } // if
+
+    // 数据文件都是从头到尾顺序读一遍
+    ::madvise( p, m_nSize, MADV_SEQUENTIAL );
+    m_pData = static_cast<const char*>(p);
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_pData)
+        ::munmap( const_cast<char*>(m_pData), m_nSize );
+    m_pData = NULL;
+    m_nSize = 0;
+}
+
+void MappedFile::split( const char *begin, std::size_t n, std::vector<Range> &ranges ) const
+{
+    ranges.clear();
+
+    const char *last = end();
+    if (!n)
+        n = 1;
+    std::size_t step = (std::size_t)(last - begin) / n + 1;
+
+    const char *p = begin;
+    while (p < last) {
+        const char *q = (std::size_t)(last - p) > step ? p + step : last;
+        // 段尾移到下一个行尾之后
+        if (q < last) {
+            const char *nl = static_cast<const char*>( ::memchr(q, '\n', last - q) );
+            q = nl ? nl + 1 : last;
+        } // if
+        ranges.push_back( Range(p, q) );
+        p = q;
+    } // while
+}
+
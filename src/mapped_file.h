@@ -0,0 +1,45 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+/**
+ * @brief 以只读方式把整个文件映射到内存
+ */
+class MappedFile {
+public:
+    // 文件中的一段 [first, second)
+    typedef std::pair< const char*, const char* >   Range;
+
+public:
+    MappedFile() : m_pData(NULL), m_nSize(0) {}
+    ~MappedFile() { close(); }
+
+    bool open( const char *filename );
+    void close();
+
+    const char* data() const { return m_pData; }
+    const char* end() const { return m_pData + m_nSize; }
+    std::size_t size() const { return m_nSize; }
+
+    /**
+     * @brief 把 [begin, end()) 切分为至多n段, 每段都从行首开始, 到行尾('\n'之后)结束
+     *
+     * @param begin     起始位置, 必须是行首
+     * @param n         段数
+     * @param ranges    切分结果
+     */
+    void split( const char *begin, std::size_t n, std::vector<Range> &ranges ) const;
+
+private:
+    MappedFile( const MappedFile& );
+    MappedFile& operator = ( const MappedFile& );
+
+    const char      *m_pData;
+    std::size_t     m_nSize;
+};
+
+#endif
+
@@ -1,4 +1,7 @@
 #include "recommend_algorithm.h"
+#include "interaction_graph.h"
+#include "set_ops.h"
+#include "similarity_cache.h"
 #include <functional>
 #include <algorithm>
 #include <mutex>
@@ -22,9 +25,13 @@ std::size_t UserCF( User *user, std::size_t k, std::size_t nItems,
 
     typedef std::map<User*, float, UserPtrCmp>  UserSimMap;
 
+    const InteractionGraph &graph = *g_pGraph;
+    UserDB &userDB = *g_pUserDB;
+    ItemDB &itemDB = *g_pItemDB;
+
     // first, find all items that "user" has positive interactions.
-    // 找出目标用户u所有的兴趣物品集合N(u).
-    ItemSet &setNu = user->interestedItemSet();
+    // 找出目标用户u所有的兴趣物品集合N(u). 集合中都是下标, 下标顺序即ID顺序
+    Span<uint32_t> setNu = graph.userInterests( user->index() );
     if (!setNu.size()) {
         LOG(INFO) << "Target user " << user->ID() << " do not have histroy interests record, cannot recommend!";
         return 0;
@@ -44,21 +51,22 @@ std::size_t UserCF( User *user, std::size_t k, std::size_t nItems,
     UserSimMap wuv;
 
     // 对N(u)中的每一个物品 i∈N(u), 找出i的兴趣用户集合N(i)
-    for (Item *itemI : setNu) {
-        UserSet &setNi = itemI->interestedUserSet();
-        // LOG(INFO) << "item " << itemI->ID() << " liked by " << setNi.size() << " users";
-        for (User *userV : setNi) {
-            if (userV->ID() == user->ID())
+    for (uint32_t itemI : setNu) {
+        Span<uint32_t> setNi = graph.itemInterests( itemI );
+        float factor = graph.itemFactor( itemI );     // 1 / log(1 + |N(i)|)
+        // LOG(INFO) << "item " << itemI << " liked by " << setNi.size() << " users";
+        for (uint32_t userV : setNi) {
+            if (userV == user->index())
                 continue;
-            wuv[userV] += 1.0 / std::log(1.0 + setNi.size());
+            wuv[ userDB.userAt(userV) ] += factor;
         } // for v
     } // for i
 
     // 利用上一步结果计算用户u和v相似度 wuv.
+    float degreeU = graph.userDegree( user->index() );
     for (auto &v : wuv) {
-        ItemSet &setNv = v.first->interestedItemSet();
-        // setNv.size() 肯定不为0
-        v.second /= std::sqrt( (float)(setNu.size()) * setNv.size() );
+        // |N(v)| 肯定不为0
+        v.second /= std::sqrt( degreeU * graph.userDegree(v.first->index()) );
     } // for
 
     // 从和目标用户u有相似度的用户集合v∈N(i)中(wuv != 0)找出前K个最相似的用户S(u,K)
@@ -66,9 +74,11 @@ std::size_t UserCF( User *user, std::size_t k, std::size_t nItems,
     typedef std::pair< User*, float > UserSimPair;
     std::vector<UserSimPair> userSimValue( wuv.begin(), wuv.end() );
 
+    // 相似度相同时按ID排序, 保证结果唯一
     auto userSimValueCmp = [] ( const UserSimPair &lhs,
                                 const UserSimPair &rhs )->bool
-                        { return lhs.second > rhs.second; };
+                        { return lhs.second > rhs.second
+                              || (lhs.second == rhs.second && lhs.first->ID() < rhs.first->ID()); };
 
     if (k < userSimValue.size()) {
         std::partial_sort( userSimValue.begin(), userSimValue.begin() + k, 
@@ -89,16 +99,13 @@ std::size_t UserCF( User *user, std::size_t k, std::size_t nItems,
 
     for (auto it = userSimValue.begin(); it != userSimValue.end(); ++it) {
         User *userV = it->first;
-        ItemSet &setNv = userV->interestedItemSet();
+        Span<uint32_t> setNv = graph.userInterests( userV->index() );
         // 求setNu与setNv的差 setNv - setNu  Nv有但Nu没有
-        std::vector<Item*> uvDiff;
-        std::set_difference( setNv.begin(), setNv.end(),
-                             setNu.begin(), setNu.end(),
-                             std::back_inserter(uvDiff),
-                             setNu.key_comp() );
+        std::vector<uint32_t> uvDiff;
+        sorted_difference( setNv, setNu, uvDiff );
         // insert them to rcmdItemMap
         for (auto &i : uvDiff)
-            rcmdItemMap[i] += wuv[userV];
+            rcmdItemMap[ itemDB.itemAt(i) ] += wuv[userV];
     } // for
 
     rcmdItems.resize( rcmdItemMap.size() );
@@ -122,6 +129,407 @@ std::size_t UserCF( User *user, std::size_t k, std::size_t nItems,
 }
 
 
+namespace {
+
+/*
+ * UserCF_dense, UserCF_pruned 和 ItemCF_dense 的工作区, 每个线程一份.
+ * 相似度和推荐度都存放在以下标为下标的稠密数组中, 同时记录用到的位置,
+ * 每次请求结束时只清理这些位置.
+ */
+struct UserCFScratch {
+    std::vector<float>      userScore;      // 下标为user下标, wuv
+    std::vector<uint32_t>   touchedUsers;
+    std::vector<float>      itemScore;      // 下标为item下标, p(u,i)
+    std::vector<uint32_t>   touchedItems;
+    std::vector<uint64_t>   excluded;       // 以item下标为位号的位图, 目标用户的 N(u)
+
+    typedef std::pair<uint32_t, float>  UserSimPair;   // {user下标, 相似度}
+    std::vector<UserSimPair>  neighbours;
+
+    // 以下仅 UserCF_pruned 使用
+    std::vector<uint32_t>   itemOrder;      // N(u) 按权重从大到小
+    std::vector<double>     remainSum;      // itemOrder 的后缀权重和
+    std::vector<double>     remainSq;       // itemOrder 的后缀权重平方和
+    std::vector<uint32_t>   alive;          // 未被剪掉的候选者, 升序
+    std::vector<uint32_t>   common;
+    std::vector<float>      bounds;
+
+    void prepare( std::size_t nUsers, std::size_t nItems )
+    {
+        if (userScore.size() != nUsers)
+            userScore.assign( nUsers, 0.0 );
+        if (itemScore.size() != nItems)
+            itemScore.assign( nItems, 0.0 );
+        if (excluded.size() != (nItems + 63) / 64)
+            excluded.assign( (nItems + 63) / 64, 0 );
+    }
+
+    void setExcluded( Span<uint32_t> items, bool value )
+    {
+        for (uint32_t i : items) {
+            if (value)
+                excluded[i >> 6] |= (uint64_t)1 << (i & 63);
+            else
+                excluded[i >> 6] &= ~((uint64_t)1 << (i & 63));
+        } // for
+    }
+
+    bool isExcluded( uint32_t i ) const
+    { return (excluded[i >> 6] >> (i & 63)) & 1; }
+};
+
+UserCFScratch& user_cf_scratch()
+{
+    static thread_local UserCFScratch scratch;
+    return scratch;
+}
+
+// 从 arr 中选出按 cmp 排序的前n个并排好序
+template < typename T, typename Cmp >
+void select_top_n( std::vector<T> &arr, std::size_t n, Cmp cmp )
+{
+    if (n < arr.size()) {
+        if (n) 
+            std::nth_element( arr.begin(), arr.begin() + (n - 1), arr.end(), cmp );
+        arr.resize( n );
+    } // if
+    std::sort( arr.begin(), arr.end(), cmp );
+}
+
+} // namespace
+
+
+namespace {
+
+typedef UserCFScratch::UserSimPair  UserSimPair;
+
+// 相似度从大到小, 相同时下标(即ID)小的在前
+inline bool greater_similarity( const UserSimPair &lhs, const UserSimPair &rhs )
+{
+    return lhs.second > rhs.second
+        || (lhs.second == rhs.second && lhs.first < rhs.first);
+}
+
+/*
+ * 由前k个邻居计算推荐度 p(u,i), 结果写入 rcmdItems.
+ * N(v) - N(u): N(u) 放入位图, 逐个检查 N(v) 中的物品, 不必每个邻居都归并一次
+ */
+std::size_t aggregate_neighbours( UserCFScratch &sc, const InteractionGraph &graph,
+                                  Span<uint32_t> setNu, std::size_t nItems,
+                                  std::vector<RcmdItem> &rcmdItems )
+{
+    std::vector<float>    &pui = sc.itemScore;
+    std::vector<uint32_t> &touchedItems = sc.touchedItems;
+    ItemDB                &itemDB = *g_pItemDB;
+
+    sc.setExcluded( setNu, true );
+    for (const auto &nb : sc.neighbours) {
+        Span<uint32_t> setNv = graph.userInterests( nb.first );
+        for (uint32_t i : setNv) {
+            if (sc.isExcluded(i))
+                continue;
+            if (pui[i] == 0.0)
+                touchedItems.push_back( i );
+            pui[i] += nb.second;
+        } // for i
+    } // for
+    sc.setExcluded( setNu, false );
+
+    rcmdItems.reserve( touchedItems.size() );
+    for (uint32_t i : touchedItems) {
+        rcmdItems.push_back( RcmdItem(itemDB.itemAt(i), pui[i]) );
+        pui[i] = 0.0;
+    } // for i
+    touchedItems.clear();
+
+    select_top_n( rcmdItems, nItems, std::less<RcmdItem>() );
+
+    return rcmdItems.size();
+}
+
+// 检查参数并准备工作区, 目标用户没有兴趣记录时返回NULL
+UserCFScratch* begin_cf_request( User *user, std::size_t k, Span<uint32_t> &setNu )
+{
+    if (!k) {
+        std::cerr << "Invalid k value!" << std::endl;
+        return NULL;
+    } // if
+
+    const InteractionGraph &graph = *g_pGraph;
+    setNu = graph.userInterests( user->index() );
+    if (setNu.empty()) {
+        LOG(INFO) << "Target user " << user->ID() << " do not have histroy interests record, cannot recommend!";
+        return NULL;
+    } // if
+
+    UserCFScratch &sc = user_cf_scratch();
+    sc.prepare( graph.nUsers(), graph.nItems() );
+    return &sc;
+}
+
+} // namespace
+
+
+namespace {
+
+/*
+ * u 的前k个最相似用户写入 sc.neighbours, 按相似度从大到小.
+ * 相当于用户-物品矩阵(列按 1/log(1+|N(i)|) 加权)与其转置之积的第u行, 在稠密数组中累加.
+ * capped 为true时展开 graph.itemPostings (可能被截断), 否则展开完整的 itemInterests
+ */
+void dense_neighbours( UserCFScratch &sc, const InteractionGraph &graph, uint32_t u,
+                       Span<uint32_t> setNu, std::size_t k, bool capped )
+{
+    std::vector<float>    &wuv = sc.userScore;
+    std::vector<uint32_t> &touchedUsers = sc.touchedUsers;
+
+    // wuv 的累加顺序与 UserCF 相同, 不截断时结果一致.
+    // 截断时热门物品只贡献给保留的用户, 权重仍按完整的 |N(i)| 计算
+    for (uint32_t itemI : setNu) {
+        Span<uint32_t> setNi = capped ? graph.itemPostings( itemI ) : graph.itemInterests( itemI );
+        float factor = graph.itemFactor( itemI );
+        for (uint32_t v : setNi) {
+            if (v == u)
+                continue;
+            if (wuv[v] == 0.0)
+                touchedUsers.push_back( v );
+            wuv[v] += factor;
+        } // for v
+    } // for i
+
+    auto &neighbours = sc.neighbours;
+    neighbours.clear();
+    neighbours.reserve( touchedUsers.size() );
+    float degreeU = graph.userDegree( u );
+    for (uint32_t v : touchedUsers) {
+        float w = wuv[v] / std::sqrt( degreeU * graph.userDegree(v) );
+        neighbours.push_back( UserSimPair(v, w) );
+        wuv[v] = 0.0;
+    } // for v
+    touchedUsers.clear();
+
+    // 前k个最相似的用户, 下标顺序即ID顺序
+    select_top_n( neighbours, k, greater_similarity );
+}
+
+std::size_t user_cf_dense( User *user, std::size_t k, std::size_t nItems,
+                           std::vector<RcmdItem> &rcmdItems, bool capped )
+{
+    rcmdItems.clear();
+
+    Span<uint32_t> setNu;
+    UserCFScratch *pScratch = begin_cf_request( user, k, setNu );
+    if (!pScratch)
+        return 0;
+
+    const InteractionGraph &graph = *g_pGraph;
+    dense_neighbours( *pScratch, graph, user->index(), setNu, k, capped );
+    return aggregate_neighbours( *pScratch, graph, setNu, nItems, rcmdItems );
+}
+
+} // namespace
+
+
+std::size_t UserCF_dense( User *user, std::size_t k, std::size_t nItems,
+                          std::vector<RcmdItem> &rcmdItems )
+{ return user_cf_dense( user, k, nItems, rcmdItems, true ); }
+
+std::size_t UserCF_dense_exact( User *user, std::size_t k, std::size_t nItems,
+                                std::vector<RcmdItem> &rcmdItems )
+{ return user_cf_dense( user, k, nItems, rcmdItems, false ); }
+
+
+void get_all_users_similarity( std::size_t k )
+{
+    const InteractionGraph &graph = *g_pGraph;
+    UserDB &userDB = *g_pUserDB;
+    const std::vector<User*> &users = userDB.users();
+
+    // 每行的工作量相差很大, 粒度小一些便于窃取
+    g_pThreadPool->parallel_for( 0, users.size(), 16, [&]( std::size_t first, std::size_t last ) {
+        UserCFScratch &sc = user_cf_scratch();
+        sc.prepare( graph.nUsers(), graph.nItems() );
+        for (std::size_t u = first; u != last; ++u) {
+            User::SimilarUserArray &arr = users[u]->similarUsers();
+            arr.clear();
+            Span<uint32_t> setNu = graph.userInterests( (uint32_t)u );
+            if (setNu.empty())
+                continue;
+            dense_neighbours( sc, graph, (uint32_t)u, setNu, k, false );
+            arr.reserve( sc.neighbours.size() );
+            for (const auto &nb : sc.neighbours)
+                arr.push_back( User::SimilarUser(userDB.userAt(nb.first), nb.second) );
+        } // for u
+    } );
+}
+
+std::size_t UserCF_precomputed( User *user, std::size_t k, std::size_t nItems,
+                                std::vector<RcmdItem> &rcmdItems )
+{
+    rcmdItems.clear();
+
+    Span<uint32_t> setNu;
+    UserCFScratch *pScratch = begin_cf_request( user, k, setNu );
+    if (!pScratch)
+        return 0;
+    UserCFScratch &sc = *pScratch;
+
+    const User::SimilarUserArray &arr = user->similarUsers();
+    std::size_t n = std::min( k, arr.size() );
+    sc.neighbours.clear();
+    for (std::size_t j = 0; j != n; ++j)
+        sc.neighbours.push_back( UserSimPair(arr[j].pOther->index(), arr[j].similarity) );
+
+    return aggregate_neighbours( sc, *g_pGraph, setNu, nItems, rcmdItems );
+}
+
+
+namespace {
+
+/*
+ * 剪枝时的相对容差. 剪枝用的部分和与最终的精确值累加顺序不同, float 舍入
+ * 可能差几个ulp, 上界必须比第k大的下界小出这个比例才丢弃, 保证不丢掉真正的前k个.
+ */
+inline float prune_slack( std::size_t nTerms )
+{ return 1e-4f + (float)nTerms * 2.4e-7f; }
+
+/*
+ * 当前候选者中第k大的相似度下界 wuv[v] / sqrt(|N(u)||N(v)|), 候选者不足k个时返回0
+ */
+float kth_lower_bound( UserCFScratch &sc, const InteractionGraph &graph,
+                       const std::vector<uint32_t> &cands, std::size_t k, float degreeU )
+{
+    if (cands.size() < k)
+        return 0.0;
+
+    std::vector<float> &bounds = sc.bounds;
+    bounds.clear();
+    for (uint32_t v : cands)
+        bounds.push_back( sc.userScore[v] / std::sqrt(degreeU * graph.userDegree(v)) );
+    std::nth_element( bounds.begin(), bounds.begin() + (k - 1), bounds.end(), std::greater<float>() );
+    return bounds[k - 1];
+}
+
+} // namespace
+
+
+std::size_t UserCF_pruned( User *user, std::size_t k, std::size_t nItems,
+                           std::vector<RcmdItem> &rcmdItems )
+{
+    using namespace std;
+
+    rcmdItems.clear();
+
+    Span<uint32_t> setNu;
+    UserCFScratch *pScratch = begin_cf_request( user, k, setNu );
+    if (!pScratch)
+        return 0;
+    UserCFScratch &sc = *pScratch;
+
+    const InteractionGraph &graph = *g_pGraph;
+    const uint32_t u = user->index();
+    const float degreeU = graph.userDegree( u );
+    const float slack = 1.0f - prune_slack( setNu.size() );
+    vector<float>    &wuv = sc.userScore;
+    vector<uint32_t> &cands = sc.touchedUsers;
+
+    // 按 IDF 权重 1/log(1+|N(i)|) 从大到小处理, 即 posting 从短到长
+    vector<uint32_t> &order = sc.itemOrder;
+    order.assign( setNu.begin(), setNu.end() );
+    std::sort( order.begin(), order.end(), [&graph] ( uint32_t lhs, uint32_t rhs )->bool {
+        float fl = graph.itemFactor(lhs), fr = graph.itemFactor(rhs);
+        return fl > fr || (fl == fr && lhs < rhs);
+    } );
+
+    // remainSum[t], remainSq[t]: order[t..] 的权重和与平方和
+    const std::size_t nOrder = order.size();
+    vector<double> &remainSum = sc.remainSum, &remainSq = sc.remainSq;
+    remainSum.assign( nOrder + 1, 0.0 );
+    remainSq.assign( nOrder + 1, 0.0 );
+    for (std::size_t t = nOrder; t--; ) {
+        double f = graph.itemFactor( order[t] );
+        remainSum[t] = remainSum[t + 1] + f;
+        remainSq[t] = remainSq[t + 1] + f * f;
+    } // for t
+
+    /*
+     * 第一阶段: 逐个展开 posting, 新遇到的用户加入候选.
+     * 在 order[t..] 中才首次出现的用户 v 与 u 至多有 c <= |N(v)| 个共同物品,
+     * 由 Cauchy-Schwarz, 其相似度 <= sqrt(c * remainSq[t]) / sqrt(|N(u)| * c)
+     *                            = sqrt(remainSq[t] / |N(u)|).
+     * 这个上界低于当前第k大的下界时, 剩下的 posting 不会再带来新的前k个邻居.
+     */
+    std::size_t t = 0;
+    for (; t != nOrder; ++t) {
+        uint32_t itemI = order[t];
+        Span<uint32_t> setNi = graph.itemInterests( itemI );
+        // 求第k大下界要扫一遍候选者, 只在 posting 不比候选者少很多时检查
+        if (cands.size() >= k && setNi.size() * 2 >= cands.size()) {
+            float theta = kth_lower_bound( sc, graph, cands, k, degreeU );
+            if ((float)std::sqrt(remainSq[t] / degreeU) < theta * slack)
+                break;
+        } // if
+        float factor = graph.itemFactor( itemI );
+        for (uint32_t v : setNi) {
+            if (v == u)
+                continue;
+            if (wuv[v] == 0.0)
+                cands.push_back( v );
+            wuv[v] += factor;
+        } // for v
+    } // for t
+
+    /*
+     * 第二阶段: 只更新已有候选者. 候选者 v 的相似度 <= (wuv[v] + remainSum[t]) / sqrt(|N(u)||N(v)|),
+     * 低于第k大的下界就丢弃; 每个 posting 只与(升序的)候选者求交集.
+     */
+    vector<uint32_t> &alive = sc.alive;
+    vector<uint32_t> &common = sc.common;
+    if (t != nOrder) {
+        alive.assign( cands.begin(), cands.end() );
+        std::sort( alive.begin(), alive.end() );
+    } // if
+    for (; t != nOrder && alive.size() > k; ++t) {
+        float theta = kth_lower_bound( sc, graph, alive, k, degreeU ) * slack;
+        double remain = remainSum[t];
+        auto last = std::remove_if( alive.begin(), alive.end(), [&] ( uint32_t v )->bool
+                { return (float)((wuv[v] + remain) / std::sqrt(degreeU * graph.userDegree(v))) < theta; } );
+        alive.erase( last, alive.end() );
+
+        uint32_t itemI = order[t];
+        float factor = graph.itemFactor( itemI );
+        sorted_intersect( alive, graph.itemInterests(itemI), common );
+        for (uint32_t v : common)
+            wuv[v] += factor;
+    } // for t
+
+    /*
+     * 剩下的候选者: 上界不低于第k大下界的, 按升序的 N(u) ∩ N(v) 重新累加,
+     * 与 UserCF_dense 的累加顺序相同, 相似度逐位相同, 排序结果也就相同.
+     */
+    float theta = kth_lower_bound( sc, graph, cands, k, degreeU ) * slack;
+    auto &neighbours = sc.neighbours;
+    neighbours.clear();
+    for (uint32_t v : cands) {
+        float degreeV = graph.userDegree( v );
+        float bound = (float)((wuv[v] + remainSum[t]) / std::sqrt(degreeU * degreeV));
+        wuv[v] = 0.0;
+        if (bound < theta)
+            continue;
+        sorted_intersect( setNu, graph.userInterests(v), common );
+        float w = 0.0;
+        for (uint32_t i : common)
+            w += graph.itemFactor( i );
+        neighbours.push_back( UserSimPair(v, w / std::sqrt(degreeU * degreeV)) );
+    } // for v
+    cands.clear();
+
+    select_top_n( neighbours, k, greater_similarity );
+
+    return aggregate_neighbours( sc, graph, setNu, nItems, rcmdItems );
+}
+
+
 std::size_t ItemCF( User *user, std::size_t k, std::size_t nItems,
                     std::vector<RcmdItem> &rcmdItems )
 {
@@ -143,17 +551,19 @@ std::size_t ItemCF( User *user, std::size_t k, std::size_t nItems,
 
     // std::call_once(onceFlag, get_all_items_similarity, k);
 
-    ItemSet& interestedItems = user->interestedItemSet();
+    Span<uint32_t> interestedItems = user->interestedItemSet();
     if (interestedItems.empty()) {
         LOG(INFO) << "Target user " << user->ID() << " do not have histroy interests record, cannot recommend!";
         return 0;
     } // if
 
+    ItemDB &itemDB = *g_pItemDB;
     std::map<Item*, float, ItemPtrCmp> rankMap;
-    for (Item *pItemI : interestedItems) {
-        auto& similarItems = pItemI->similarItems();
+    for (uint32_t itemI : interestedItems) {
+        auto& similarItems = itemDB.itemAt(itemI)->similarItems();
         for (auto &sItemJ : similarItems) {
-            if (interestedItems.find(sItemJ.pOther) != interestedItems.end())
+            if (std::binary_search(interestedItems.begin(), interestedItems.end(),
+                                   sItemJ.pOther->index()))
                 continue;
             rankMap[sItemJ.pOther] += sItemJ.similarity; 
         } // for j
@@ -176,99 +586,443 @@ std::size_t ItemCF( User *user, std::size_t k, std::size_t nItems,
 }
 
 
-void get_all_items_similarity( std::size_t k )
+namespace {
+
+/*
+ * ItemCF_dense 和 ItemCF_lazy 共用的推荐度汇总, lists(i) 返回下标为i的物品的相似列表.
+ * 累加顺序与 ItemCF 相同: 按 N(u) 的下标顺序, 每个物品按其相似列表的顺序
+ */
+template < typename GetList >
+std::size_t item_cf_dense( User *user, std::size_t k, std::size_t nItems,
+                           std::vector<RcmdItem> &rcmdItems, GetList lists )
+{
+    rcmdItems.clear();
+
+    Span<uint32_t> setNu;
+    UserCFScratch *pScratch = begin_cf_request( user, k, setNu );
+    if (!pScratch)
+        return 0;
+    UserCFScratch &sc = *pScratch;
+
+    std::vector<float>    &pui = sc.itemScore;
+    std::vector<uint32_t> &touchedItems = sc.touchedItems;
+    ItemDB                &itemDB = *g_pItemDB;
+
+    sc.setExcluded( setNu, true );
+    for (uint32_t itemI : setNu) {
+        for (const auto &sItemJ : lists(itemI)) {
+            uint32_t j = sItemJ.pOther->index();
+            if (sc.isExcluded(j))
+                continue;
+            if (pui[j] == 0.0)
+                touchedItems.push_back( j );
+            pui[j] += sItemJ.similarity;
+        } // for j
+    } // for i
+    sc.setExcluded( setNu, false );
+
+    rcmdItems.reserve( touchedItems.size() );
+    for (uint32_t j : touchedItems) {
+        rcmdItems.push_back( RcmdItem(itemDB.itemAt(j), pui[j]) );
+        pui[j] = 0.0;
+    } // for j
+    touchedItems.clear();
+
+    // RcmdItem 的顺序是全序, 堆排序取前 nItems 个与 ItemCF 结果相同
+    if (nItems < rcmdItems.size()) {
+        std::partial_sort( rcmdItems.begin(), rcmdItems.begin() + nItems,
+                           rcmdItems.end() );
+        rcmdItems.resize( nItems );
+    } else {
+        std::sort( rcmdItems.begin(), rcmdItems.end() );
+    } // if
+
+    return rcmdItems.size();
+}
+
+} // namespace
+
+
+std::size_t ItemCF_dense( User *user, std::size_t k, std::size_t nItems,
+                          std::vector<RcmdItem> &rcmdItems )
+{
+    ItemDB &itemDB = *g_pItemDB;
+    return item_cf_dense( user, k, nItems, rcmdItems, [&itemDB] ( uint32_t i )->const Item::SimilarItemArray&
+                        { return itemDB.itemAt(i)->similarItems(); } );
+}
+
+std::size_t ItemCF_lazy( User *user, std::size_t k, std::size_t nItems,
+                         std::vector<RcmdItem> &rcmdItems )
+{
+    // 当前物品的列表, 被淘汰后仍由 shared_ptr 持有到处理完这个物品
+    SimilarityCache::ListPtr pList;
+    return item_cf_dense( user, k, nItems, rcmdItems, [&pList] ( uint32_t i )->const SimilarityCache::List& {
+        pList = g_pSimilarityCache->get( i );
+        return *pList;
+    } );
+}
+
+
+/**
+ * @brief 计算物品i,j的相似度(两两求交集的原始算法), 仅用于核对结果
+ *  w(i,j) = sum{ 1/log(1+|N(u)|) | u∈N(i)∩N(j) } / sqrt(|N(i)||N(j)|)
+ */
+float get_item_similarity( Item *pItemI, Item *pItemJ )
 {
     using namespace std;
 
-    auto err_ret = [](int retval, const char *msg) {
-        cerr << msg << endl;
-        return retval;
-    };
+    Span<uint32_t> Ni = pItemI->interestedUserSet();
+    Span<uint32_t> Nj = pItemJ->interestedUserSet();
+    vector<uint32_t> Nij;
+    sorted_intersect( Ni, Nj, Nij );
 
-    if (!k)
-        err_ret(0, "Invalid k value!");
-    
-    LOG(INFO) << "get_all_items_similarity start...";
+    if (Nij.empty())
+        return 0.0;
 
-    size_t nAllItems = g_pItemDB->size();
-    vector<Item*> allItems;
-    allItems.reserve(nAllItems);
+    const InteractionGraph &graph = *g_pGraph;
+    float similarity = 0.0;
+    for (uint32_t u : Nij)
+        similarity += graph.userFactor( u );
 
-    const auto &itemDbContent = g_pItemDB->content();
-    for (uint32_t i = 0; i != ItemDB::HASH_SIZE; ++i) {
-        const auto &elem = itemDbContent[i];
-        for (const auto &v : elem)
-            allItems.push_back( v.second.get() );
-    } // for i
+    similarity /= std::sqrt( graph.itemDegree(pItemI->index()) * graph.itemDegree(pItemJ->index()) );
 
-    // cout << allItems.size() << endl;
-    // cout << g_pItemDB->size() << endl;
-    // cout << "get_all_items_similarity done!" << endl;
-
-    auto get_item_similarity = []( Item *pItemI, Item *pItemJ )->float {
-        UserSet& Ni = pItemI->interestedUserSet();
-        UserSet& Nj = pItemJ->interestedUserSet();
-        vector<User*> Nij;
-        Nij.reserve(Ni.size());
-        set_intersection( Ni.begin(), Ni.end(), Nj.begin(), Nj.end(),
-                          back_inserter(Nij) );
-
-        if (Nij.empty())
-            return 0.0;
-
-        float similarity = 0.0;
-        for (User *u : Nij) {
-            size_t sz = u->interestedItemSet().size();
-            if (!sz) 
+    return similarity;
+}
+
+
+namespace {
+
+// 计算物品相似度的工作区
+struct ItemSimScratch {
+    std::vector<float>        acc;         // 以item下标为下标的累加器
+    std::vector<uint32_t>     touched;     // acc中非0的位置
+    std::size_t               nPairs;      // 共现物品对的数目(有序对)
+
+    ItemSimScratch() : nPairs(0) {}
+};
+
+/*
+ * 物品n的前k个相似物品写入 out, 按 Item::similarity_greater 排序.
+ * 遍历 u∈N(n) 的兴趣物品集合 N(u), 只对真正共现的物品j累加 1/log(1+|N(u)|)
+ */
+void item_similarity_row( ItemSimScratch &sc, uint32_t n, std::size_t k,
+                          std::vector<Item::SimilarItem> &out )
+{
+    const std::vector<Item*> &allItems = g_pItemDB->items();
+    const InteractionGraph &graph = *g_pGraph;
+    std::vector<float> &acc = sc.acc;
+    std::vector<uint32_t> &touched = sc.touched;
+    if (acc.size() != allItems.size())
+        acc.assign( allItems.size(), 0.0 );
+
+    out.clear();
+    Span<uint32_t> Ni = graph.itemInterests( n );
+    if (Ni.empty())
+        return;
+
+    for (uint32_t u : Ni) {
+        Span<uint32_t> Nu = graph.userInterests( u );
+        float factor = graph.userFactor( u );
+        for (uint32_t j : Nu) {
+            if (j == n)
                 continue;
-            similarity += get_factor(sz);
-        } // for
+            float &value = acc[j];
+            if (value == 0.0)
+                touched.push_back( j );
+            value += factor;
+        } // for j
+    } // for u
 
-        similarity /= std::sqrt( (float)(Ni.size() * Nj.size()) );
+    out.reserve( touched.size() );
+    for (uint32_t j : touched) {
+        float &value = acc[j];
+        float similarity = value / std::sqrt( graph.itemDegree(n) * graph.itemDegree(j) );
+        out.push_back( Item::SimilarItem(allItems[j], similarity) );
+        value = 0.0;
+    } // for
+    sc.nPairs += touched.size();
+    touched.clear();
 
-        return similarity;
-    };
+    select_top_n( out, k, Item::similarity_greater );
+}
 
-    // struct SimilarityJob {
-        // SimilarityJob( size_t _i, size_t _j )
-                // : i(_i), j(_j) {}
-        // size_t i, j;
-    // };
+} // namespace
+
+
+/*
+ * 基于共现(co-occurrence)计算所有物品的相似物品列表.
+ * 原来的做法是对任意两个物品(i, j)求 N(i)∩N(j), 共 n^2/2 个job, 绝大部分结果为0.
+ * 现在对每个物品i, 遍历 u∈N(i) 的兴趣物品集合 N(u), 只对真正共现的物品j累加
+ * 1/log(1+|N(u)|) (InteractionGraph::userFactor), 累加器是每个线程私有的稠密数组(以item下标为下标)加上
+ * 被访问过的物品列表(sparse accumulator), 每处理完一个物品只清理访问过的位置.
+ * 每行(物品i)只由一个线程计算, 在本地选出前k个后用 Item::setSimilarItems 整体写入.
+ * 计算量为 sum{|N(u)|^2}, 与物品总数的平方无关.
+ */
+void get_all_items_similarity( std::size_t k )
+{
+    using namespace std;
+
+    if (!k) {
+        cerr << "Invalid k value!" << endl;
+        return;
+    } // if
     
-    auto similarityJob = [&](size_t i, size_t j) {
-        float similarity = get_item_similarity( allItems[i], allItems[j] );
-        allItems[i]->addSimilarItem( allItems[j], similarity, k );
-        allItems[j]->addSimilarItem( allItems[i], similarity, k );
+    LOG(INFO) << "get_all_items_similarity start...";
+
+    const vector<Item*> &allItems = g_pItemDB->items();
+
+    const size_t CHUNK_SIZE = 64;   // 每次领取的物品数
+
+    // 每个 slot 私有的工作区
+    vector<ItemSimScratch> scratches( g_pThreadPool->slots() );
+
+    auto similarityRoutine = [&]( size_t first, size_t last, size_t slot ) {
+        ItemSimScratch &sc = scratches[slot];
+        vector<Item::SimilarItem> candidates;
+        for (size_t n = first; n != last; ++n) {
+            // 该物品的相似列表只有本线程在写, 在本地选出前k个排好序, 一次交给 Item
+            item_similarity_row( sc, (uint32_t)n, k, candidates );
+            allItems[n]->setSimilarItems( candidates );
+        } // for n
     };
 
-    typedef std::function<void(void)>   JobType;
-    ThreadPool<JobType> thrpool( g_nMaxThread );
+    g_pThreadPool->parallel_for( 0, allItems.size(), CHUNK_SIZE, similarityRoutine );
+
+    size_t nPairs = 0;
+    for (const ItemSimScratch &sc : scratches)
+        nPairs += sc.nPairs;
+
+    LOG(INFO) << "get_all_items_similarity done! " << nPairs << " co-occurred item pairs.";
+}
+
+
+namespace {
+
+// 增量更新物品相似度的工作区
+struct ItemDeltaScratch {
+    std::vector<float>        delta;       // 以item下标为下标, 第i行共现和 C(i,j) 的变化量
+    std::vector<char>         state;       // 0: 未访问; 1: delta中已记录; 2: 原列表中的成员
+    std::vector<uint32_t>     touched;     // state中非0的位置
+    ItemSimScratch            row;         // 整行重算时使用
+    std::size_t               nRecomputed;
+
+    ItemDeltaScratch() : nRecomputed(0) {}
+};
+
+/*
+ * C(i,j) = sum{ 1/log(1+|N(u)|) | u ∈ N(i)∩N(j) }, 按u升序累加.
+ * 与 item_similarity_row 中 acc[j] 的累加顺序相同, 所以结果完全相同
+ */
+float item_cooccurrence( const InteractionGraph &graph, uint32_t i, uint32_t j )
+{
+    Span<uint32_t> Ni = graph.itemInterests( i ), Nj = graph.itemInterests( j );
+    const uint32_t *a = Ni.begin(), *aEnd = Ni.end();
+    const uint32_t *b = Nj.begin(), *bEnd = Nj.end();
+    float value = 0.0;
+    while (a != aEnd && b != bEnd) {
+        if (*a < *b) {
+            ++a;
+        } else if (*b < *a) {
+            ++b;
+        } else {
+            value += graph.userFactor( *a );
+            ++a; ++b;
+        } // if
+    } // while
+    return value;
+}
+
+/*
+ * 由旧图上的相似列表得到物品i在新图上的前k个相似物品, 写入 out.
+ * 返回 false 表示列表之外的物品可能进入前k个, 需要整行重算.
+ */
+bool update_similarity_row( ItemDeltaScratch &sc, const InteractionGraph &oldGraph,
+                            const std::vector<bool> &userChanged, uint32_t i, std::size_t k,
+                            std::vector<Item::SimilarItem> &out )
+{
+    const std::vector<Item*> &allItems = g_pItemDB->items();
+    const InteractionGraph &graph = *g_pGraph;
+    std::vector<float> &delta = sc.delta;
+    std::vector<char> &state = sc.state;
+    std::vector<uint32_t> &touched = sc.touched;
+    if (delta.size() != allItems.size()) {
+        delta.assign( allItems.size(), 0.0 );
+        state.assign( allItems.size(), 0 );
+    } // if
 
-    for (size_t i = 0; i < nAllItems-1; ++i) {
-        for (size_t j = i+1; j < nAllItems; ++j) {
-            thrpool.addJob( std::bind(similarityJob, i, j) );
-            // auto similarityJob = ;
+    auto accumulate = [&]( Span<uint32_t> Nv, float factor ) {
+        for (uint32_t j : Nv) {
+            if (j == i)
+                continue;
+            if (!state[j]) {
+                state[j] = 1;
+                touched.push_back( j );
+            } // if
+            delta[j] += factor;
         } // for j
-    } // for i
+    };
+
+    // 只有 N(v) 变化的用户v对 C(i,j) 的贡献会变: 减去旧的 1/log(1+|N(v)|), 加上新的
+    for (uint32_t v : graph.itemInterests(i)) {
+        if (!userChanged[v])
+            continue;
+        accumulate( graph.userInterests(v), graph.userFactor(v) );
+        Span<uint32_t> oldNv = oldGraph.userInterests( v );
+        if (std::binary_search( oldNv.begin(), oldNv.end(), i ))
+            accumulate( oldNv, -oldGraph.userFactor(v) );
+    } // for v
+
+    // 原列表中的成员在新图上重新求共现和, 再按新的 |N(i)|, |N(j)| 归一化
+    const Item::SimilarItemArray &old = allItems[i]->similarItems();
+    out.clear();
+    for (const Item::SimilarItem &item : old) {
+        uint32_t j = item.pOther->index();
+        float similarity = item_cooccurrence( graph, i, j )
+                                / std::sqrt( graph.itemDegree(i) * graph.itemDegree(j) );
+        out.push_back( Item::SimilarItem(item.pOther, similarity) );
+        if (!state[j])
+            touched.push_back( j );
+        state[j] = 2;
+    } // for
+    std::sort( out.begin(), out.end(), Item::similarity_greater );
+
+    bool ok = true;
+    if (old.size() < k) {
+        // 原列表包含了所有与i共现的物品, 有新的共现物品时重算
+        for (uint32_t j : touched) {
+            if (state[j] == 1 && delta[j] > 0.0) {
+                ok = false;
+                break;
+            } // if
+        } // for
+    } else if (!out.empty()) {
+        /*
+         * 列表之外的物品j原来 w(i,j) <= w_k (原来的第k个), 即 C(i,j) <= w_k * sqrt(|N(i)||N(j)|).
+         * C(i,j) 没有变的, 新的 w(i,j) 不超过 w_k * sqrt(|N(i)|/|N'(i)|);
+         * C(i,j) 变了的, 不超过 (w_k * sqrt(|N(i)||N(j)|) + delta) / sqrt(|N'(i)||N'(j)|).
+         * 这个上界低于新列表的第k个时列表不变, 否则可能有外面的物品进来, 整行重算.
+         * 有舍入误差的上界放大一点, 宁可多重算.
+         */
+        const float SLACK = 1.0f + 1e-5f;
+        const Item::SimilarItem &oldKth = old.back(), &newKth = out.back();
+        float bound = oldKth.similarity;
+        if (graph.itemDegree(i) != oldGraph.itemDegree(i))
+            bound *= std::sqrt( oldGraph.itemDegree(i) / graph.itemDegree(i) ) * SLACK;
+        // 上界与第k个相等时, 外面的物品原来就因ID较大排在后面, 第k个的ID不变大就仍在后面
+        if (bound > newKth.similarity ||
+                (bound == newKth.similarity && newKth.pOther->ID() > oldKth.pOther->ID()))
+            ok = false;
+
+        for (std::size_t t = 0; ok && t != touched.size(); ++t) {
+            uint32_t j = touched[t];
+            if (state[j] != 1 || delta[j] <= 0.0)
+                continue;
+            float upper = (oldKth.similarity * std::sqrt( oldGraph.itemDegree(i) * oldGraph.itemDegree(j) )
+                                + delta[j]) / std::sqrt( graph.itemDegree(i) * graph.itemDegree(j) );
+            if (upper * SLACK >= newKth.similarity)
+                ok = false;
+        } // for t
+    } // if
+
+    for (uint32_t j : touched) {
+        delta[j] = 0.0;
+        state[j] = 0;
+    } // for
+    touched.clear();
+
+    return ok;
+}
+
+} // namespace
 
-    thrpool.terminate();
 
 /*
- * #pragma omp parallel for
- *     for (size_t i = 0; i < nAllItems-1; ++i) {
- * #pragma omp parallel for
- *         for (size_t j = i+1; j < nAllItems; ++j) {
- *             // LOG(INFO) << "computing similarity between " << i << " and " << j;
- *             float similarity = get_item_similarity( allItems[i], allItems[j] );
- *             allItems[i]->addSimilarItem( allItems[j], similarity, k );
- *             allItems[j]->addSimilarItem( allItems[i], similarity, k );
- *         } // for j
- *     } // for i
+ * w(i,j) = C(i,j) / sqrt(|N(i)||N(j)|), C(i,j) 是 N(i)∩N(j) 中各用户 1/log(1+|N(u)|) 之和.
+ * 交互只增加, 集合只会变大. N(v) 变化的用户v只改变 N(v) 中物品两两之间的 C(i,j),
+ * |N(j)| 变化的物品j只改变含有j的各对的归一化. 所以需要检查的行只有:
+ * |N(i)| 变了的行, 与某个 N(v) 变化的用户共现的行, 原列表中有 |N(j)| 变了的物品的行.
+ * 对这些行, 原列表中的物品在新图上求 C(i,j) (只求 N(i)∩N(j), 不展开整行), 列表之外的物品
+ * 用原来的第k个和 C 的变化量求上界; 只有上界够得着新列表的第k个, 即列表中的物品下降
+ * 或外面的物品上升到可能进入前k个时, 才用 item_similarity_row 整行重算.
+ * 其余各行的输入都没有变, 保留原来的列表.
  */
+std::size_t update_items_similarity( const InteractionGraph &oldGraph, std::size_t k )
+{
+    using namespace std;
+
+    const InteractionGraph &graph = *g_pGraph;
+    const vector<Item*> &allItems = g_pItemDB->items();
+    const size_t nItems = graph.nItems();
+    const size_t nUsers = graph.nUsers();
 
-    LOG(INFO) << "get_all_items_similarity done!";
+    vector<bool> userChanged( nUsers, false );
+    size_t nChangedUsers = 0;
+    for (uint32_t v = 0; v != (uint32_t)nUsers; ++v) {
+        if (graph.userDegree(v) != oldGraph.userDegree(v)) {
+            userChanged[v] = true;
+            ++nChangedUsers;
+        } // if
+    } // for v
+
+    vector<bool> itemChanged( nItems, false );
+    vector<bool> rowMarked( nItems, false );
+    vector<uint32_t> rows;
+    auto markRow = [&]( uint32_t i ) {
+        if (!rowMarked[i]) {
+            rowMarked[i] = true;
+            rows.push_back( i );
+        } // if
+    };
+    for (uint32_t j = 0; j != (uint32_t)nItems; ++j) {
+        if (graph.itemDegree(j) != oldGraph.itemDegree(j)) {
+            itemChanged[j] = true;
+            markRow( j );
+        } // if
+    } // for j
+    for (uint32_t v = 0; v != (uint32_t)nUsers; ++v) {
+        if (!userChanged[v])
+            continue;
+        for (uint32_t i : graph.userInterests(v))
+            markRow( i );
+    } // for v
+    for (uint32_t i = 0; i != (uint32_t)nItems; ++i) {
+        for (const Item::SimilarItem &item : allItems[i]->similarItems()) {
+            if (itemChanged[item.pOther->index()]) {
+                markRow( i );
+                break;
+            } // if
+        } // for
+    } // for i
 
-    return;
+    vector<ItemDeltaScratch> scratches( g_pThreadPool->slots() );
+    g_pThreadPool->parallel_for( 0, rows.size(), 16, [&]( size_t first, size_t last, size_t slot ) {
+        ItemDeltaScratch &sc = scratches[slot];
+        vector<Item::SimilarItem> candidates;
+        for (size_t n = first; n != last; ++n) {
+            if (!update_similarity_row( sc, oldGraph, userChanged, rows[n], k, candidates )) {
+                item_similarity_row( sc.row, rows[n], k, candidates );
+                ++sc.nRecomputed;
+            } // if
+            allItems[rows[n]]->setSimilarItems( candidates );
+        } // for n
+    } );
+
+    size_t nRecomputed = 0;
+    for (const ItemDeltaScratch &sc : scratches)
+        nRecomputed += sc.nRecomputed;
+
+    LOG(INFO) << "update_items_similarity: " << nChangedUsers << " changed users, "
+              << rows.size() << " of " << nItems << " rows updated, "
+              << nRecomputed << " rows recomputed.";
+
+    return rows.size();
+}
+
+
+void get_item_similarity_row( uint32_t i, std::size_t k, std::vector<Item::SimilarItem> &out )
+{
+    static thread_local ItemSimScratch scratch;
+    item_similarity_row( scratch, i, k, out );
 }
 
 
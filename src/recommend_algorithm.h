@@ -15,13 +15,102 @@
 extern std::size_t UserCF( User *user, std::size_t k, std::size_t nItems,
                            std::vector<RcmdItem> &rcmdItems );
 
+/*
+ * UserCF 的数组累加版本, 参数和结果与 UserCF 完全相同.
+ * 相似度和推荐度累加在每个线程私有的稠密数组中, 用 nth_element 选前k个,
+ * 不使用 std::map.
+ */
+extern std::size_t UserCF_dense( User *user, std::size_t k, std::size_t nItems,
+                                 std::vector<RcmdItem> &rcmdItems );
+
+/*
+ * 热门物品的 posting 被截断(见 InteractionGraph::capItemPostings)时, UserCF_dense
+ * 只展开截断后的 posting; UserCF_dense_exact 总是展开完整的 N(i), 用于比较截断的影响.
+ * 未截断时两者相同. UserCF, UserCF_pruned 不受截断影响.
+ */
+extern std::size_t UserCF_dense_exact( User *user, std::size_t k, std::size_t nItems,
+                                       std::vector<RcmdItem> &rcmdItems );
+
+/*
+ * 剪枝的 UserCF, 参数和结果与 UserCF_dense 完全相同.
+ * N(u) 中的物品按 IDF 权重从大到小展开 posting(item->user), 由剩余物品的权重
+ * 估计相似度上界(MaxScore), 新用户的上界低于第k大的下界后不再接纳新候选者,
+ * 候选者的上界低于它时丢弃; 最后对留下的候选者精确计算相似度.
+ */
+extern std::size_t UserCF_pruned( User *user, std::size_t k, std::size_t nItems,
+                                  std::vector<RcmdItem> &rcmdItems );
+
+/**
+ * @brief 离线计算每个用户的前k个最相似用户, 存入 User::similarUsers().
+ *        逐行在稠密数组中计算加权的用户-物品矩阵与其转置之积, 各行由 g_pThreadPool 并行计算.
+ *        相似度与 UserCF_dense_exact 逐位相同.
+ *
+ * @param k             每个用户至多保存k个最相似用户
+ */
+extern void get_all_users_similarity( std::size_t k );
 
 /*
- * ItemCF 目前卡在要事先为每个物品找好相似物品集合，由于数目庞大，计算耗耗时估算数月，无法继续
+ * 使用 get_all_users_similarity 算好(或从快照导入)的相似用户列表的 UserCF,
+ * 在线只做推荐度的汇总. k 不能超过计算列表时的k; 截断 posting 时结果同 UserCF_dense_exact.
+ */
+extern std::size_t UserCF_precomputed( User *user, std::size_t k, std::size_t nItems,
+                                       std::vector<RcmdItem> &rcmdItems );
+
+// 推荐算法函数类型, 如 UserCF, UserCF_dense, ItemCF
+typedef std::size_t (*RecommendFunc)( User*, std::size_t, std::size_t, std::vector<RcmdItem>& );
+
+
+/*
+ * ItemCF 需要事先为每个物品找好相似物品集合，见 get_all_items_similarity
  */
 extern std::size_t ItemCF( User *user, std::size_t k, std::size_t nItems,
                            std::vector<RcmdItem> &rcmdItems );
-extern void get_all_items_similarity(std::size_t);
+
+/*
+ * ItemCF 的数组累加版本, 参数和结果与 ItemCF 完全相同.
+ * 推荐度累加在每个线程私有的稠密数组中, N(u) 用位图排除, 不使用 std::map, 不打日志.
+ */
+extern std::size_t ItemCF_dense( User *user, std::size_t k, std::size_t nItems,
+                                 std::vector<RcmdItem> &rcmdItems );
+
+/*
+ * ItemCF_dense 的按需版本, 相似列表不用 Item::similarItems(), 而是从 g_pSimilarityCache 取,
+ * 物品第一次被用到时才用 get_item_similarity_row 计算. 列表相同时结果与 ItemCF_dense 相同.
+ */
+extern std::size_t ItemCF_lazy( User *user, std::size_t k, std::size_t nItems,
+                                std::vector<RcmdItem> &rcmdItems );
+
+/**
+ * @brief 基于用户兴趣集合的共现关系计算所有物品的相似物品列表
+ *
+ * @param k             每个物品至多保存k个最相似物品
+ */
+extern void get_all_items_similarity(std::size_t k);
+
+/**
+ * @brief 只计算一个物品的相似物品列表, 与 get_all_items_similarity 中该物品的结果相同,
+ *        可多线程同时调用
+ *
+ * @param i             物品下标
+ * @param k             至多保存k个最相似物品
+ * @param out           结果, 按相似度从大到小
+ */
+extern void get_item_similarity_row( uint32_t i, std::size_t k, std::vector<Item::SimilarItem> &out );
+
+/**
+ * @brief 新的交互记录并入 g_pGraph (见 InteractionGraph::buildFrom) 之后, 增量更新相似物品列表.
+ *        只检查输入变了的行, 由原列表和共现和的变化量更新, 列表之外的物品可能进入前k个时才整行重算;
+ *        结果与在新图上调用 get_all_items_similarity 相同.
+ *        不能与读取 Item::similarItems() 的推荐并发执行.
+ *
+ * @param oldGraph      并入之前的图
+ * @param k             与已有列表的k相同
+ * @return              检查过的物品数
+ */
+extern std::size_t update_items_similarity( const InteractionGraph &oldGraph, std::size_t k );
+
+// 两两求交集计算物品相似度，仅用于核对
+extern float get_item_similarity( Item *pItemI, Item *pItemJ );
 
 #endif
 
@@ -0,0 +1,140 @@
+#include "result_sink.h"
+#include <glog/logging.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <chrono>
+
+
+ResultSink::ResultSink( std::size_t nSlots, std::size_t bufferSize )
+        : m_nBufferSize(bufferSize)
+        , m_arrSlots(nSlots ? nSlots : 1, NULL)
+        , m_arrBuffers(m_arrSlots.size() * 3)     // 每个 slot 一个正在用的, 另有两倍在队列中周转
+        , m_FullQueue(m_arrBuffers.size())
+        , m_FreeQueue(m_arrBuffers.size())
+        , m_bClosing(false)
+        , m_bFailed(false)
+        , m_nFd(-1)
+{
+    std::size_t i = 0;
+    for (; i != m_arrSlots.size(); ++i) {
+        m_arrBuffers[i].reserve( m_nBufferSize + 4096 );   // 一条结果不超过4k, 满了才交出, 不再扩容
+        m_arrSlots[i] = &m_arrBuffers[i];
+    } // for
+    for (; i != m_arrBuffers.size(); ++i) {
+        m_arrBuffers[i].reserve( m_nBufferSize + 4096 );
+        m_FreeQueue.try_push( &m_arrBuffers[i] );
+    } // for
+}
+
+ResultSink::~ResultSink()
+{
+    close();
+}
+
+bool ResultSink::open( const char *filename, const std::string &header )
+{
+    m_nFd = ::open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if (m_nFd < 0)
+        return false;
+
+    if (!writeAll(header.data(), header.size())) {
+        ::close( m_nFd );
+        m_nFd = -1;
+        return false;
+    } // if
+
+    m_Writer = boost::thread( &ResultSink::writerRoutine, this );
+    return true;
+}
+
+bool ResultSink::close()
+{
+    if (m_nFd < 0)
+        return false;
+
+    for (std::size_t i = 0; i != m_arrSlots.size(); ++i) {
+        if (!m_arrSlots[i]->empty())
+            push( m_arrSlots[i] );
+    } // for
+
+    m_bClosing = true;
+    m_Writer.join();
+
+    if (::close(m_nFd) != 0)
+        m_bFailed = true;
+    m_nFd = -1;
+
+    return !m_bFailed;
+}
+
+void ResultSink::submit( std::size_t slot )
+{
+    push( m_arrSlots[slot] );
+
+    // 缓冲区总数比 slot 数多出队列容量, 写线程总会还回一个
+    Buffer *pBuf = NULL;
+    for (uint32_t nSpin = 0; !m_FreeQueue.try_pop(pBuf); ++nSpin) {
+        if (nSpin < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for( std::chrono::microseconds(100) );
+    } // for
+    m_arrSlots[slot] = pBuf;
+}
+
+void ResultSink::push( Buffer *pBuf )
+{
+    for (uint32_t nSpin = 0; !m_FullQueue.try_push(pBuf); ++nSpin) {
+        if (nSpin < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for( std::chrono::microseconds(100) );
+    } // for
+}
+
+void ResultSink::writerRoutine()
+{
+    Buffer *pBuf = NULL;
+    uint32_t nIdle = 0;
+
+    while (true) {
+        // close 先交出所有缓冲区再设置 m_bClosing, 取队列之前已看到 m_bClosing 而队列为空就可以结束
+        bool closing = m_bClosing;
+        if (m_FullQueue.try_pop(pBuf)) {
+            nIdle = 0;
+            if (!m_bFailed && !writeAll(pBuf->data(), pBuf->size()))
+                m_bFailed = true;
+            pBuf->clear();
+            m_FreeQueue.try_push( pBuf );
+            continue;
+        } // if
+        if (closing)
+            break;
+
+        // 队列空时逐渐延长等待, 工作线程不需要通知写线程
+        if (++nIdle < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for( std::chrono::microseconds(nIdle < 1024 ? 100 : 1000) );
+    } // while
+}
+
+bool ResultSink::writeAll( const char *p, std::size_t n )
+{
+    while (n) {
+        ssize_t ret = ::write( m_nFd, p, n );
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(ERROR) << "ResultSink write error: " << strerror(errno);
+            return false;
+        } // if
+        p += ret;
+        n -= (std::size_t)ret;
+    } // while
+    return true;
+}
+
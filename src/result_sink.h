@@ -0,0 +1,99 @@
+#ifndef _RESULT_SINK_H_
+#define _RESULT_SINK_H_
+
+#include "bounded_queue.hpp"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <boost/thread.hpp>
+
+/**
+ * @brief 多个工作线程输出到同一个结果文件, 只有一个写线程
+ *
+ * 每个 slot 有自己的缓冲区, 工作线程只往本 slot 的缓冲区里格式化结果, 不加锁.
+ * 缓冲区写满 bufferSize 后通过定长无锁队列交给写线程, 写线程整块写入文件,
+ * 再把清空的缓冲区放回空闲队列供工作线程取用. 缓冲区总数固定,
+ * 写线程跟不上时工作线程在 commit 中等待, 内存占用不会随输出增长.
+ * 不同 slot 的结果在文件中的先后顺序不确定.
+ */
+class ResultSink {
+public:
+    typedef std::string     Buffer;
+
+public:
+    explicit ResultSink( std::size_t nSlots, std::size_t bufferSize = 256 * 1024 );
+    ~ResultSink();
+
+    /**
+     * @brief 创建文件, 写入标题行, 启动写线程
+     * @return 文件无法创建时返回false
+     */
+    bool open( const char *filename, const std::string &header );
+
+    // 本 slot 的缓冲区, commit 之后可能换成另一个, 需要重新获取
+    Buffer& buffer( std::size_t slot )
+    { return *m_arrSlots[slot]; }
+
+    // 一条结果格式化完后调用, 缓冲区满时交给写线程
+    void commit( std::size_t slot )
+    {
+        if (m_arrSlots[slot]->size() >= m_nBufferSize)
+            submit( slot );
+    }
+
+    /**
+     * @brief 交出所有 slot 中剩余的内容, 等写线程写完后关闭文件.
+     *        必须在所有工作线程结束之后调用
+     * @return 所有内容都成功写入时返回true
+     */
+    bool close();
+
+private:
+    ResultSink( const ResultSink& );
+    ResultSink& operator = ( const ResultSink& );
+
+    void submit( std::size_t slot );
+    void push( Buffer *pBuf );
+    void writerRoutine();
+    bool writeAll( const char *p, std::size_t n );
+
+private:
+    std::size_t                 m_nBufferSize;
+    std::vector<Buffer*>        m_arrSlots;
+    std::vector<Buffer>         m_arrBuffers;     // 所有缓冲区, 在 open 之后不再改变
+    BoundedQueue<Buffer*>       m_FullQueue;      // 等待写入的缓冲区
+    BoundedQueue<Buffer*>       m_FreeQueue;      // 已写入, 可以重用的缓冲区
+    boost::thread               m_Writer;
+    std::atomic<bool>           m_bClosing;
+    std::atomic<bool>           m_bFailed;
+    int                         m_nFd;
+};
+
+
+// 以下追加格式与 ostream 一致, 用于代替 ostringstream 格式化结果
+
+inline
+void append_uint( std::string &buf, uint64_t v )
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    buf.append( p, tmp + sizeof(tmp) - p );
+}
+
+// 与 ostream 设置 setprecision(precision) 之后的默认浮点格式相同 (%g)
+inline
+void append_float( std::string &buf, float v, int precision = 3 )
+{
+    char tmp[32];
+    int n = snprintf( tmp, sizeof(tmp), "%.*g", precision, (double)v );
+    buf.append( tmp, n );
+}
+
+#endif
+
@@ -0,0 +1,485 @@
+#include "set_ops.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SET_OPS_X86
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+typedef std::size_t (*IntersectFunc)( const uint32_t*, std::size_t, const uint32_t*, std::size_t, uint32_t* );
+typedef std::size_t (*CountFunc)( const uint32_t*, std::size_t, const uint32_t*, std::size_t );
+typedef std::size_t (*DifferenceFunc)( const uint32_t*, std::size_t, const uint32_t*, std::size_t, uint32_t* );
+
+struct Kernels {
+    IntersectFunc       intersect;
+    CountFunc           intersectCount;
+    DifferenceFunc      difference;
+};
+
+
+// arr[lo, n) 中第一个不小于v的位置, 从lo开始倍增步长, 再在最后一步内二分
+inline
+std::size_t gallop( const uint32_t *arr, std::size_t n, std::size_t lo, uint32_t v )
+{
+    std::size_t hi = lo, step = 1;
+    while (hi < n && arr[hi] < v) {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    } // while
+    if (hi > n)
+        hi = n;
+    return std::lower_bound( arr + lo, arr + hi, v ) - arr;
+}
+
+
+/*
+ * 标量实现, 也用于向量实现处理剩余的尾部
+ */
+
+std::size_t intersect_scalar( const uint32_t *a, std::size_t na,
+                              const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        uint32_t x = a[i], y = b[j];
+        if (x == y) {
+            out[n++] = x;
+            ++i; ++j;
+        } else if (x < y) {
+            ++i;
+        } else {
+            ++j;
+        } // if
+    } // while
+    return n;
+}
+
+std::size_t intersect_count_scalar( const uint32_t *a, std::size_t na,
+                                    const uint32_t *b, std::size_t nb )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        uint32_t x = a[i], y = b[j];
+        n += (x == y);
+        i += (x <= y);
+        j += (y <= x);
+    } // while
+    return n;
+}
+
+std::size_t difference_scalar( const uint32_t *a, std::size_t na,
+                               const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        uint32_t x = a[i], y = b[j];
+        if (x < y) {
+            out[n++] = x;
+            ++i;
+        } else {
+            i += (x == y);
+            ++j;
+        } // if
+    } // while
+    for (; i < na; ++i)
+        out[n++] = a[i];
+    return n;
+}
+
+/*
+ * 向量实现处理完整的块后, a 当前块中已在 b 前面的块中找到的元素由 found 标出,
+ * 逐个处理该块剩余的元素, 返回新的 j
+ */
+std::size_t difference_block_tail( const uint32_t *a, std::size_t width, uint32_t found,
+                                   const uint32_t *b, std::size_t nb, std::size_t j,
+                                   uint32_t *out, std::size_t &n )
+{
+    for (std::size_t t = 0; t != width; ++t) {
+        if (found & (1U << t))
+            continue;
+        uint32_t x = a[t];
+        while (j < nb && b[j] < x)
+            ++j;
+        if (j < nb && b[j] == x)
+            ++j;
+        else
+            out[n++] = x;
+    } // for
+    return j;
+}
+
+
+#ifdef SET_OPS_X86
+
+// mask 中为1的位对应的下标依次排在前面, 用于把匹配的元素压缩到向量开头
+struct CompressTables {
+    uint8_t     sse[16][16];        // _mm_shuffle_epi8 的字节下标
+    uint32_t    avx[256][8];        // _mm256_permutevar8x32_epi32 的下标
+
+    CompressTables()
+    {
+        for (uint32_t mask = 0; mask != 16; ++mask) {
+            uint32_t k = 0;
+            std::memset( sse[mask], 0x80, 16 );
+            for (uint32_t t = 0; t != 4; ++t) {
+                if (mask & (1U << t)) {
+                    for (uint32_t byte = 0; byte != 4; ++byte)
+                        sse[mask][k * 4 + byte] = (uint8_t)(t * 4 + byte);
+                    ++k;
+                } // if
+            } // for t
+        } // for mask
+        for (uint32_t mask = 0; mask != 256; ++mask) {
+            uint32_t k = 0;
+            for (uint32_t t = 0; t != 8; ++t) {
+                if (mask & (1U << t))
+                    avx[mask][k++] = t;
+            } // for t
+            for (; k != 8; ++k)
+                avx[mask][k] = 0;
+        } // for mask
+    }
+};
+
+const CompressTables s_Tables;
+
+
+// va 中每个元素是否在 vb 中出现, 返回4位掩码
+__attribute__((target("sse4.2,popcnt")))
+inline uint32_t match_mask_sse( __m128i va, __m128i vb )
+{
+    __m128i m = _mm_cmpeq_epi32( va, vb );
+    m = _mm_or_si128( m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39)) );
+    m = _mm_or_si128( m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4E)) );
+    m = _mm_or_si128( m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93)) );
+    return (uint32_t)_mm_movemask_ps( _mm_castsi128_ps(m) );
+}
+
+// va 中 mask 标出的元素依次写入 out, 返回个数. out 之后至少有 room 个位置
+__attribute__((target("sse4.2,popcnt")))
+inline std::size_t compress_store_sse( __m128i va, uint32_t mask, uint32_t *out, std::size_t room )
+{
+    __m128i shuffled = _mm_shuffle_epi8( va,
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(s_Tables.sse[mask])) );
+    std::size_t k = (std::size_t)_mm_popcnt_u32( mask );
+    if (room >= 4) {
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(out), shuffled );
+    } else {
+        uint32_t tmp[4];
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(tmp), shuffled );
+        std::memcpy( out, tmp, k * sizeof(uint32_t) );
+    } // if
+    return k;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+std::size_t intersect_sse( const uint32_t *a, std::size_t na,
+                           const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    std::size_t i = 0, j = 0, n = 0, cap = std::min( na, nb );
+    std::size_t na4 = na & ~(std::size_t)3, nb4 = nb & ~(std::size_t)3;
+    while (i < na4 && j < nb4) {
+        __m128i va = _mm_loadu_si128( reinterpret_cast<const __m128i*>(a + i) );
+        __m128i vb = _mm_loadu_si128( reinterpret_cast<const __m128i*>(b + j) );
+        uint32_t mask = match_mask_sse( va, vb );
+        if (mask)
+            n += compress_store_sse( va, mask, out + n, cap - n );
+        uint32_t amax = a[i + 3], bmax = b[j + 3];
+        i += (amax <= bmax) ? 4 : 0;
+        j += (bmax <= amax) ? 4 : 0;
+    } // while
+    return n + intersect_scalar( a + i, na - i, b + j, nb - j, out + n );
+}
+
+__attribute__((target("sse4.2,popcnt")))
+std::size_t intersect_count_sse( const uint32_t *a, std::size_t na,
+                                 const uint32_t *b, std::size_t nb )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    std::size_t na4 = na & ~(std::size_t)3, nb4 = nb & ~(std::size_t)3;
+    while (i < na4 && j < nb4) {
+        __m128i va = _mm_loadu_si128( reinterpret_cast<const __m128i*>(a + i) );
+        __m128i vb = _mm_loadu_si128( reinterpret_cast<const __m128i*>(b + j) );
+        n += (std::size_t)_mm_popcnt_u32( match_mask_sse(va, vb) );
+        uint32_t amax = a[i + 3], bmax = b[j + 3];
+        i += (amax <= bmax) ? 4 : 0;
+        j += (bmax <= amax) ? 4 : 0;
+    } // while
+    return n + intersect_count_scalar( a + i, na - i, b + j, nb - j );
+}
+
+__attribute__((target("sse4.2,popcnt")))
+std::size_t difference_sse( const uint32_t *a, std::size_t na,
+                            const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    std::size_t na4 = na & ~(std::size_t)3, nb4 = nb & ~(std::size_t)3;
+    uint32_t found = 0;     // a 当前块中已在 b 中找到的元素
+    while (i < na4 && j < nb4) {
+        __m128i va = _mm_loadu_si128( reinterpret_cast<const __m128i*>(a + i) );
+        __m128i vb = _mm_loadu_si128( reinterpret_cast<const __m128i*>(b + j) );
+        found |= match_mask_sse( va, vb );
+        uint32_t amax = a[i + 3], bmax = b[j + 3];
+        if (amax <= bmax) {
+            // b 后面的块都比 amax 大, a 当前块处理完毕
+            n += compress_store_sse( va, ~found & 0xF, out + n, na - n );
+            i += 4;
+            found = 0;
+        } // if
+        if (bmax <= amax)
+            j += 4;
+    } // while
+    if (i < na4 && found) {
+        j = difference_block_tail( a + i, 4, found, b, nb, j, out, n );
+        i += 4;
+    } // if
+    return n + difference_scalar( a + i, na - i, b + j, nb - j, out + n );
+}
+
+
+__attribute__((target("avx2,popcnt")))
+inline uint32_t match_mask_avx2( __m256i va, __m256i vb )
+{
+    const __m256i rot = _mm256_setr_epi32( 1, 2, 3, 4, 5, 6, 7, 0 );
+    __m256i m = _mm256_cmpeq_epi32( va, vb );
+    for (int r = 1; r != 8; ++r) {
+        vb = _mm256_permutevar8x32_epi32( vb, rot );
+        m = _mm256_or_si256( m, _mm256_cmpeq_epi32(va, vb) );
+    } // for
+    return (uint32_t)_mm256_movemask_ps( _mm256_castsi256_ps(m) );
+}
+
+__attribute__((target("avx2,popcnt")))
+inline std::size_t compress_store_avx2( __m256i va, uint32_t mask, uint32_t *out, std::size_t room )
+{
+    __m256i shuffled = _mm256_permutevar8x32_epi32( va,
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s_Tables.avx[mask])) );
+    std::size_t k = (std::size_t)_mm_popcnt_u32( mask );
+    if (room >= 8) {
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>(out), shuffled );
+    } else {
+        uint32_t tmp[8];
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>(tmp), shuffled );
+        std::memcpy( out, tmp, k * sizeof(uint32_t) );
+    } // if
+    return k;
+}
+
+__attribute__((target("avx2,popcnt")))
+std::size_t intersect_avx2( const uint32_t *a, std::size_t na,
+                            const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    std::size_t i = 0, j = 0, n = 0, cap = std::min( na, nb );
+    std::size_t na8 = na & ~(std::size_t)7, nb8 = nb & ~(std::size_t)7;
+    while (i < na8 && j < nb8) {
+        __m256i va = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(a + i) );
+        __m256i vb = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(b + j) );
+        uint32_t mask = match_mask_avx2( va, vb );
+        if (mask)
+            n += compress_store_avx2( va, mask, out + n, cap - n );
+        uint32_t amax = a[i + 7], bmax = b[j + 7];
+        i += (amax <= bmax) ? 8 : 0;
+        j += (bmax <= amax) ? 8 : 0;
+    } // while
+    return n + intersect_scalar( a + i, na - i, b + j, nb - j, out + n );
+}
+
+__attribute__((target("avx2,popcnt")))
+std::size_t intersect_count_avx2( const uint32_t *a, std::size_t na,
+                                  const uint32_t *b, std::size_t nb )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    std::size_t na8 = na & ~(std::size_t)7, nb8 = nb & ~(std::size_t)7;
+    while (i < na8 && j < nb8) {
+        __m256i va = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(a + i) );
+        __m256i vb = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(b + j) );
+        n += (std::size_t)_mm_popcnt_u32( match_mask_avx2(va, vb) );
+        uint32_t amax = a[i + 7], bmax = b[j + 7];
+        i += (amax <= bmax) ? 8 : 0;
+        j += (bmax <= amax) ? 8 : 0;
+    } // while
+    return n + intersect_count_scalar( a + i, na - i, b + j, nb - j );
+}
+
+__attribute__((target("avx2,popcnt")))
+std::size_t difference_avx2( const uint32_t *a, std::size_t na,
+                             const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    std::size_t i = 0, j = 0, n = 0;
+    std::size_t na8 = na & ~(std::size_t)7, nb8 = nb & ~(std::size_t)7;
+    uint32_t found = 0;
+    while (i < na8 && j < nb8) {
+        __m256i va = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(a + i) );
+        __m256i vb = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(b + j) );
+        found |= match_mask_avx2( va, vb );
+        uint32_t amax = a[i + 7], bmax = b[j + 7];
+        if (amax <= bmax) {
+            n += compress_store_avx2( va, ~found & 0xFF, out + n, na - n );
+            i += 8;
+            found = 0;
+        } // if
+        if (bmax <= amax)
+            j += 8;
+    } // while
+    if (i < na8 && found) {
+        j = difference_block_tail( a + i, 8, found, b, nb, j, out, n );
+        i += 8;
+    } // if
+    return n + difference_scalar( a + i, na - i, b + j, nb - j, out + n );
+}
+
+#endif  // SET_OPS_X86
+
+
+const Kernels KERNELS[N_SET_OPS_KERNEL] = {
+    { intersect_scalar, intersect_count_scalar, difference_scalar },
+#ifdef SET_OPS_X86
+    { intersect_sse, intersect_count_sse, difference_sse },
+    { intersect_avx2, intersect_count_avx2, difference_avx2 },
+#else
+    { intersect_scalar, intersect_count_scalar, difference_scalar },
+    { intersect_scalar, intersect_count_scalar, difference_scalar },
+#endif
+};
+
+SetOpsKernel detect_kernel()
+{
+#ifdef SET_OPS_X86
+    __builtin_cpu_init();
+#endif
+    if (set_ops_supported(SET_OPS_AVX2))
+        return SET_OPS_AVX2;
+    if (set_ops_supported(SET_OPS_SSE42))
+        return SET_OPS_SSE42;
+    return SET_OPS_SCALAR;
+}
+
+SetOpsKernel  s_Kernel = detect_kernel();
+
+} // namespace
+
+
+bool set_ops_supported( SetOpsKernel kernel )
+{
+    switch (kernel) {
+    case SET_OPS_SCALAR:
+        return true;
+#ifdef SET_OPS_X86
+    case SET_OPS_SSE42:
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+    case SET_OPS_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+    default:
+        return false;
+    } // switch
+}
+
+SetOpsKernel set_ops_kernel()
+{ return s_Kernel; }
+
+const char* set_ops_kernel_name( SetOpsKernel kernel )
+{
+    static const char *NAMES[N_SET_OPS_KERNEL] = { "scalar", "sse4.2", "avx2" };
+    return kernel < N_SET_OPS_KERNEL ? NAMES[kernel] : "unknown";
+}
+
+bool set_ops_use( SetOpsKernel kernel )
+{
+    if (!set_ops_supported(kernel))
+        return false;
+    s_Kernel = kernel;
+    return true;
+}
+
+
+std::size_t sorted_intersect( const uint32_t *a, std::size_t na,
+                              const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    if (na > nb) {
+        std::swap( a, b );
+        std::swap( na, nb );
+    } // if
+    if (!na)
+        return 0;
+
+    if (nb / na >= SET_OPS_GALLOP_RATIO) {
+        std::size_t j = 0, n = 0;
+        for (std::size_t i = 0; i != na && j != nb; ++i) {
+            j = gallop( b, nb, j, a[i] );
+            if (j != nb && b[j] == a[i])
+                out[n++] = b[j++];
+        } // for
+        return n;
+    } // if
+
+    return KERNELS[s_Kernel].intersect( a, na, b, nb, out );
+}
+
+std::size_t sorted_intersect_count( const uint32_t *a, std::size_t na,
+                                    const uint32_t *b, std::size_t nb )
+{
+    if (na > nb) {
+        std::swap( a, b );
+        std::swap( na, nb );
+    } // if
+    if (!na)
+        return 0;
+
+    if (nb / na >= SET_OPS_GALLOP_RATIO) {
+        std::size_t j = 0, n = 0;
+        for (std::size_t i = 0; i != na && j != nb; ++i) {
+            j = gallop( b, nb, j, a[i] );
+            if (j != nb && b[j] == a[i]) {
+                ++n;
+                ++j;
+            } // if
+        } // for
+        return n;
+    } // if
+
+    return KERNELS[s_Kernel].intersectCount( a, na, b, nb );
+}
+
+std::size_t sorted_difference( const uint32_t *a, std::size_t na,
+                               const uint32_t *b, std::size_t nb, uint32_t *out )
+{
+    if (!na)
+        return 0;
+    if (!nb) {
+        std::copy( a, a + na, out );
+        return na;
+    } // if
+
+    // b 很大: a 的每个元素在 b 中查找
+    if (nb / na >= SET_OPS_GALLOP_RATIO) {
+        std::size_t j = 0, n = 0;
+        for (std::size_t i = 0; i != na; ++i) {
+            j = gallop( b, nb, j, a[i] );
+            if (j == nb || b[j] != a[i])
+                out[n++] = a[i];
+        } // for
+        return n;
+    } // if
+
+    // a 很大: 在 a 中找到 b 的每个元素, 中间的整段复制
+    if (na / nb >= SET_OPS_GALLOP_RATIO) {
+        std::size_t pos = 0, n = 0;
+        for (std::size_t j = 0; j != nb && pos != na; ++j) {
+            std::size_t p = gallop( a, na, pos, b[j] );
+            std::copy( a + pos, a + p, out + n );
+            n += p - pos;
+            pos = (p != na && a[p] == b[j]) ? p + 1 : p;
+        } // for
+        std::copy( a + pos, a + na, out + n );
+        return n + (na - pos);
+    } // if
+
+    return KERNELS[s_Kernel].difference( a, na, b, nb, out );
+}
+
@@ -0,0 +1,69 @@
+#ifndef _SET_OPS_H_
+#define _SET_OPS_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * 升序无重复的 uint32_t 数组(如 InteractionGraph 中的兴趣集合)上的集合运算.
+ *
+ * 两个数组大小相近时用向量化的归并, 按 CPU 支持在运行时选择 AVX2, SSE4.2
+ * 或标量实现; 大小相差 SET_OPS_GALLOP_RATIO 倍以上时, 对小数组的每个元素
+ * 在大数组中做 galloping(倍增)查找.
+ * 输出数组由调用者分配: 交集至多 min(na, nb) 个元素, 差集至多 na 个元素.
+ * 结果与 std::set_intersection/std::set_difference 相同.
+ */
+
+enum SetOpsKernel {
+    SET_OPS_SCALAR,
+    SET_OPS_SSE42,
+    SET_OPS_AVX2,
+    N_SET_OPS_KERNEL
+};
+
+const std::size_t SET_OPS_GALLOP_RATIO = 32;
+
+// a ∩ b 写入 out, 返回元素个数
+extern std::size_t sorted_intersect( const uint32_t *a, std::size_t na,
+                                     const uint32_t *b, std::size_t nb, uint32_t *out );
+
+// |a ∩ b|
+extern std::size_t sorted_intersect_count( const uint32_t *a, std::size_t na,
+                                           const uint32_t *b, std::size_t nb );
+
+// a - b 写入 out, 返回元素个数
+extern std::size_t sorted_difference( const uint32_t *a, std::size_t na,
+                                      const uint32_t *b, std::size_t nb, uint32_t *out );
+
+// 当前使用的实现
+extern SetOpsKernel set_ops_kernel();
+extern const char* set_ops_kernel_name( SetOpsKernel kernel );
+// 本机是否支持
+extern bool set_ops_supported( SetOpsKernel kernel );
+// 指定实现, 用于测试和 benchmark, 不支持时返回false. 不要与集合运算并发调用
+extern bool set_ops_use( SetOpsKernel kernel );
+
+
+// 以下用于 Span, std::vector 等有 data() 和 size() 的类型, 结果写入 out(覆盖原内容)
+
+template < typename SetA, typename SetB >
+void sorted_intersect( const SetA &a, const SetB &b, std::vector<uint32_t> &out )
+{
+    out.resize( a.size() < b.size() ? a.size() : b.size() );
+    out.resize( sorted_intersect(a.data(), a.size(), b.data(), b.size(), out.data()) );
+}
+
+template < typename SetA, typename SetB >
+std::size_t sorted_intersect_count( const SetA &a, const SetB &b )
+{ return sorted_intersect_count( a.data(), a.size(), b.data(), b.size() ); }
+
+template < typename SetA, typename SetB >
+void sorted_difference( const SetA &a, const SetB &b, std::vector<uint32_t> &out )
+{
+    out.resize( a.size() );
+    out.resize( sorted_difference(a.data(), a.size(), b.data(), b.size(), out.data()) );
+}
+
+#endif
+
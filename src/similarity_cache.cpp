@@ -0,0 +1,91 @@
+#include "similarity_cache.h"
+
+
+namespace {
+
+// 除列表内容外每项的固定开销: Entry, List 本身, 哈希表和 LRU 链表的节点
+const std::size_t ENTRY_OVERHEAD = 160;
+
+} // namespace
+
+
+SimilarityCache::SimilarityCache( std::size_t budget, Builder builder )
+        : m_nShardBudget(budget / N_SHARDS)
+        , m_Builder(std::move(builder))
+        , m_nHits(0)
+        , m_nMisses(0)
+        , m_nEvictions(0)
+{}
+
+SimilarityCache::ListPtr SimilarityCache::get( uint32_t i )
+{
+    Shard &shard = m_Shards[i % N_SHARDS];
+    EntryPtr pEntry;
+
+    {
+        boost::lock_guard<boost::mutex> lk( shard.lock );
+        auto it = shard.entries.find( i );
+        if (it != shard.entries.end()) {
+            pEntry = it->second;
+            shard.lru.splice( shard.lru.begin(), shard.lru, pEntry->lruPos );
+        } else {
+            pEntry = std::make_shared<Entry>();
+            shard.lru.push_front( i );
+            pEntry->lruPos = shard.lru.begin();
+            shard.entries.insert( std::make_pair(i, pEntry) );
+        } // if
+    }
+
+    // 不持有片的锁计算, 同一物品的其他线程在 call_once 中等待
+    bool built = false;
+    std::call_once( pEntry->once, [&] {
+        List list;
+        m_Builder( i, list );
+        // 复制一份, 不保留 builder 预留的多余容量
+        pEntry->value = std::make_shared<const List>( list );
+        built = true;
+    } );
+
+    if (built) {
+        ++m_nMisses;
+        admit( shard, *pEntry );
+    } else {
+        ++m_nHits;
+    } // if
+
+    return pEntry->value;
+}
+
+void SimilarityCache::admit( Shard &shard, Entry &entry )
+{
+    boost::lock_guard<boost::mutex> lk( shard.lock );
+
+    entry.bytes = ENTRY_OVERHEAD + entry.value->capacity() * sizeof(Item::SimilarItem);
+    entry.ready = true;
+    shard.bytes += entry.bytes;
+
+    // 从最久未访问的开始淘汰, 跳过还在计算的, 刚算好的这一项总是保留
+    auto pos = shard.lru.end();
+    while (shard.bytes > m_nShardBudget && pos != shard.lru.begin()) {
+        --pos;
+        auto it = shard.entries.find( *pos );
+        Entry &victim = *it->second;
+        if (&victim == &entry || !victim.ready)
+            continue;
+        shard.bytes -= victim.bytes;
+        pos = shard.lru.erase( pos );
+        shard.entries.erase( it );
+        ++m_nEvictions;
+    } // while
+}
+
+std::size_t SimilarityCache::bytes() const
+{
+    std::size_t total = 0;
+    for (const Shard &shard : m_Shards) {
+        boost::lock_guard<boost::mutex> lk( shard.lock );
+        total += shard.bytes;
+    } // for
+    return total;
+}
+
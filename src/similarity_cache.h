@@ -0,0 +1,75 @@
+#ifndef _SIMILARITY_CACHE_H_
+#define _SIMILARITY_CACHE_H_
+
+#include "common.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * @brief 按需计算的相似物品列表缓存, 可多线程并发访问
+ *
+ * 第一次访问某个物品时才调用 builder 计算它的列表, 同一物品只计算一次,
+ * 同时访问的其他线程等待计算完成. 列表以 shared_ptr 返回, 被淘汰后
+ * 已取得的列表仍然有效.
+ * 缓存按物品下标分成若干片, 每片有自己的锁和 LRU 链表, 各片平分内存预算,
+ * 超出时淘汰最久未访问的已算好的列表.
+ */
+class SimilarityCache {
+public:
+    typedef std::vector<Item::SimilarItem>              List;
+    typedef std::shared_ptr<const List>                 ListPtr;
+    // 计算下标为 i 的物品的列表, 写入 out
+    typedef std::function<void(uint32_t i, List &out)>  Builder;
+
+    static const std::size_t N_SHARDS = 64;
+
+public:
+    /**
+     * @param budget    列表占用内存的上限(字节), 按列表元素和每项的固定开销估算
+     * @param builder   计算列表, 会被多个线程同时调用
+     */
+    SimilarityCache( std::size_t budget, Builder builder );
+
+    // 下标为 i 的物品的列表, 不在缓存中时计算
+    ListPtr get( uint32_t i );
+
+    std::size_t hits() const { return m_nHits; }
+    std::size_t misses() const { return m_nMisses; }
+    std::size_t evictions() const { return m_nEvictions; }
+    std::size_t bytes() const;
+
+private:
+    struct Entry {
+        std::once_flag                      once;
+        ListPtr                             value;
+        bool                                ready;    // 已算好并计入内存, 可以淘汰. 受所在片的锁保护
+        std::size_t                         bytes;
+        std::list<uint32_t>::iterator       lruPos;
+
+        Entry() : ready(false), bytes(0) {}
+    };
+    typedef std::shared_ptr<Entry>   EntryPtr;
+
+    struct Shard {
+        Shard() : bytes(0) {}
+
+        mutable boost::mutex                    lock;
+        std::unordered_map<uint32_t, EntryPtr>  entries;
+        std::list<uint32_t>                     lru;       // 最近访问的在前
+        std::size_t                             bytes;
+    };
+
+    // 列表算好后计入内存并按需淘汰
+    void admit( Shard &shard, Entry &entry );
+
+    std::size_t                 m_nShardBudget;
+    Builder                     m_Builder;
+    Shard                       m_Shards[N_SHARDS];
+    std::atomic<std::size_t>    m_nHits;
+    std::atomic<std::size_t>    m_nMisses;
+    std::atomic<std::size_t>    m_nEvictions;
+};
+
+#endif
+
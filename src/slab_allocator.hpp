@@ -0,0 +1,282 @@
+#ifndef _SLAB_ALLOCATOR_HPP_
+#define _SLAB_ALLOCATOR_HPP_
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <boost/thread.hpp>
+
+
+/**
+ * @brief 定长内存块的池, 每个线程有自己的空闲链表, 分配和释放一般不加锁
+ *
+ * 内存按 SLAB_SIZE 大块向系统申请, 切成 BlockSize 的小块, 不归还系统.
+ * 线程本地的空闲链表过长时, 把一批还给全局的 depot; 本地用完时从 depot 取一批,
+ * depot 也空时再申请新的大块. 一个线程分配, 另一个线程释放是允许的,
+ * 块进入释放线程的空闲链表.
+ * 线程退出时剩余的空闲块还给 depot, 之后该线程的分配和释放直接操作 depot.
+ */
+template < std::size_t BlockSize >
+class SlabPool {
+    static_assert( BlockSize >= sizeof(void*), "block too small" );
+
+    static const std::size_t SLAB_SIZE = 64 * 1024;
+    static const std::size_t BLOCKS_PER_SLAB = SLAB_SIZE / BlockSize > 0 ? SLAB_SIZE / BlockSize : 1;
+    static const std::size_t BATCH = 256;         // 与 depot 之间每次转移的块数
+
+    struct FreeBlock {
+        FreeBlock   *next;
+    };
+
+    // 线程本地缓存, 必须是平凡类型, 线程内的静态对象析构时仍可能释放内存
+    struct Cache {
+        FreeBlock       *freeList;
+        std::size_t     nFree;
+        char            *bump;       // 当前大块中尚未切分的部分 [bump, bumpEnd)
+        char            *bumpEnd;
+        bool            dead;        // 线程已退出, 缓存已还给 depot
+    };
+
+    struct Depot {
+        Depot() : freeList(NULL), nFree(0), nSlabs(0) {}
+
+        boost::mutex        lock;
+        FreeBlock           *freeList;
+        std::size_t         nFree;
+        std::size_t         nSlabs;
+    };
+
+    // 线程退出时把缓存还给 depot
+    struct Flusher {
+        ~Flusher() { flush(); }
+    };
+
+public:
+    static void* allocate()
+    {
+        Cache &c = s_Cache;
+        if (c.freeList) {
+            FreeBlock *p = c.freeList;
+            c.freeList = p->next;
+            --c.nFree;
+            return p;
+        } // if
+        if (c.bump != c.bumpEnd) {
+            void *p = c.bump;
+            c.bump += BlockSize;
+            return p;
+        } // if
+        return refill();
+    }
+
+    static void deallocate( void *p )
+    {
+        if (!p)
+            return;
+        Cache &c = s_Cache;
+        if (c.nFree < 2 * BATCH) {
+            if (!c.nFree)
+                registerFlusher();
+            FreeBlock *pBlock = static_cast<FreeBlock*>(p);
+            pBlock->next = c.freeList;
+            c.freeList = pBlock;
+            ++c.nFree;
+            return;
+        } // if
+        release( p );
+    }
+
+    // 已向系统申请的内存字节数
+    static std::size_t reserved()
+    {
+        Depot &d = depot();
+        boost::lock_guard<boost::mutex> lk( d.lock );
+        return d.nSlabs * BLOCKS_PER_SLAB * BlockSize;
+    }
+
+private:
+    // depot 不析构, 静态对象析构时仍可以释放内存
+    static Depot& depot()
+    {
+        static Depot *pDepot = new Depot;
+        return *pDepot;
+    }
+
+    static void* refill()
+    {
+        Cache &c = s_Cache;
+        Depot &d = depot();
+
+        if (!c.dead)
+            registerFlusher();
+
+        {
+            boost::lock_guard<boost::mutex> lk( d.lock );
+            if (c.dead && d.freeList) {
+                FreeBlock *p = d.freeList;
+                d.freeList = p->next;
+                --d.nFree;
+                return p;
+            } // if
+            if (d.freeList) {
+                // 取一批, 第一块直接返回
+                FreeBlock *p = d.freeList;
+                FreeBlock *last = p;
+                std::size_t n = 1;
+                for (; n < BATCH && last->next; ++n)
+                    last = last->next;
+                d.freeList = last->next;
+                d.nFree -= n;
+                last->next = NULL;
+                c.freeList = p->next;
+                c.nFree = n - 1;
+                return p;
+            } // if
+            ++d.nSlabs;
+        }
+
+        char *pSlab = static_cast<char*>( ::operator new(BLOCKS_PER_SLAB * BlockSize) );
+        if (c.dead) {
+            // 线程已退出, 其余的块直接放入 depot
+            for (char *q = pSlab + BlockSize; q != pSlab + BLOCKS_PER_SLAB * BlockSize; q += BlockSize)
+                release( q );
+            return pSlab;
+        } // if
+        c.bump = pSlab + BlockSize;
+        c.bumpEnd = pSlab + BLOCKS_PER_SLAB * BlockSize;
+        return pSlab;
+    }
+
+    // 本线程第一次使用时构造, 线程退出时析构
+    static void registerFlusher()
+    {
+        static thread_local Flusher s_Flusher;
+        (void)s_Flusher;
+    }
+
+    // 本地空闲链表已满, 连同 p 还一批给 depot
+    static void release( void *p )
+    {
+        Cache &c = s_Cache;
+        Depot &d = depot();
+
+        FreeBlock *first = static_cast<FreeBlock*>(p);
+        FreeBlock *last = first;
+        std::size_t n = 1;
+        if (!c.dead) {
+            first->next = c.freeList;
+            for (; n < BATCH && last->next; ++n)
+                last = last->next;
+            c.freeList = last->next;
+            c.nFree -= n - 1;
+        } // if
+
+        boost::lock_guard<boost::mutex> lk( d.lock );
+        last->next = d.freeList;
+        d.freeList = first;
+        d.nFree += n;
+    }
+
+    static void flush()
+    {
+        Cache &c = s_Cache;
+        Depot &d = depot();
+
+        // 未切分的部分也切成块还回去
+        for (; c.bump != c.bumpEnd; c.bump += BlockSize) {
+            FreeBlock *p = reinterpret_cast<FreeBlock*>(c.bump);
+            p->next = c.freeList;
+            c.freeList = p;
+            ++c.nFree;
+        } // for
+
+        if (c.freeList) {
+            FreeBlock *last = c.freeList;
+            while (last->next)
+                last = last->next;
+            boost::lock_guard<boost::mutex> lk( d.lock );
+            last->next = d.freeList;
+            d.freeList = c.freeList;
+            d.nFree += c.nFree;
+        } // if
+
+        // 之后的释放都走 release, 分配都走 refill
+        c.freeList = NULL;
+        c.nFree = (std::size_t)-1;
+        c.bump = c.bumpEnd = NULL;
+        c.dead = true;
+    }
+
+    static thread_local Cache   s_Cache;
+};
+
+template < std::size_t BlockSize >
+thread_local typename SlabPool<BlockSize>::Cache SlabPool<BlockSize>::s_Cache = { NULL, 0, NULL, NULL, false };
+
+
+/**
+ * @brief 单个对象的分配走 SlabPool, 用于 std::set 等按节点分配的容器
+ *        和 User, Item 等类的 operator new. 一次分配多个对象时用默认的堆.
+ *
+ * 块大小按16字节向上取整, 大小相近的类型共用一个池.
+ */
+template < typename T >
+class SlabAllocator {
+public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef const T*        const_pointer;
+    typedef T&              reference;
+    typedef const T&        const_reference;
+    typedef std::size_t     size_type;
+    typedef std::ptrdiff_t  difference_type;
+
+    template < typename U >
+    struct rebind { typedef SlabAllocator<U> other; };
+
+    static const std::size_t BLOCK_SIZE = (sizeof(T) + 15) / 16 * 16;
+    typedef SlabPool< BLOCK_SIZE >      Pool;
+
+public:
+    SlabAllocator() {}
+    template < typename U >
+    SlabAllocator( const SlabAllocator<U>& ) {}
+
+    T* allocate( std::size_t n, const void* = 0 )
+    {
+        if (n == 1)
+            return static_cast<T*>( Pool::allocate() );
+        return static_cast<T*>( ::operator new(n * sizeof(T)) );
+    }
+
+    void deallocate( T *p, std::size_t n )
+    {
+        if (n == 1)
+            Pool::deallocate( p );
+        else
+            ::operator delete( p );
+    }
+
+    std::size_t max_size() const
+    { return (std::size_t)-1 / sizeof(T); }
+
+    template < typename U, typename... Args >
+    void construct( U *p, Args&&... args )
+    { ::new((void*)p) U( std::forward<Args>(args)... ); }
+
+    template < typename U >
+    void destroy( U *p )
+    { p->~U(); }
+};
+
+template < typename T, typename U >
+inline bool operator == ( const SlabAllocator<T>&, const SlabAllocator<U>& )
+{ return true; }
+
+template < typename T, typename U >
+inline bool operator != ( const SlabAllocator<T>&, const SlabAllocator<U>& )
+{ return false; }
+
+
+#endif
+
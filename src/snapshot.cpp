@@ -0,0 +1,426 @@
+#include "snapshot.h"
+#include "interaction_graph.h"
+#include <cstdio>
+#include <glog/logging.h>
+
+
+namespace {
+
+const char      SNAPSHOT_MAGIC[8] = { 'X', 'I', 'N', 'G', 'S', 'N', 'A', 'P' };
+const uint32_t  BYTE_ORDER_MARK = 0x01020304;
+
+enum SnapshotFlags {
+    HAS_SIMILAR_ITEMS = 0x1,
+    HAS_SIMILAR_USERS = 0x2
+};
+
+struct SnapshotHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint32_t    flags;
+    uint32_t    similarK;
+    uint32_t    similarUsersK;
+    uint32_t    reserved;
+};
+
+// User 的定长部分, 集合和字符串的内容存放在公共的 pool 中, 按user下标依次排列
+struct UserRecord {
+    uint32_t    ID;
+    uint32_t    careerLevel;
+    uint32_t    discplineID;
+    uint32_t    industryID;
+    uint32_t    region;
+    uint32_t    numOfCvEntry;
+    uint32_t    yearsOfExperience;
+    uint32_t    yearsOfCurrentJob;
+    uint32_t    eduDegree;
+    uint32_t    nJobRoles;
+    uint32_t    nEduFields;
+    uint32_t    nCountry;
+};
+
+struct ItemRecord {
+    int64_t     createTime;
+    uint32_t    ID;
+    uint32_t    careerLevel;
+    uint32_t    discplineID;
+    uint32_t    industryID;
+    uint32_t    region;
+    float       latitude;
+    float       longitude;
+    uint32_t    employmentType;
+    uint32_t    active;
+    uint32_t    nTitle;
+    uint32_t    nTags;
+    uint32_t    nCountry;
+};
+
+struct SimilarItemRecord {
+    uint32_t    index;
+    float       similarity;
+};
+
+struct SimilarUserRecord {
+    uint32_t    index;
+    float       similarity;
+};
+
+void append_set( const UIntSet &s, std::vector<uint32_t> &pool )
+{ pool.insert( pool.end(), s.begin(), s.end() ); }
+
+// 从 pool 中取出n个元素放入集合, pos 移到其后
+void take_set( const Span<uint32_t> &pool, std::size_t &pos, uint32_t n, UIntSet &s )
+{
+    if (n > pool.size() - pos)
+        throw std::runtime_error( "Corrupted snapshot file!" );
+    s.insert( pool.begin() + pos, pool.begin() + pos + n );
+    pos += n;
+}
+
+void take_string( const Span<char> &pool, std::size_t &pos, uint32_t n, String &s )
+{
+    if (n > pool.size() - pos)
+        throw std::runtime_error( "Corrupted snapshot file!" );
+    s.assign( pool.begin() + pos, n );
+    pos += n;
+}
+
+void save_users( SnapshotWriter &writer )
+{
+    const std::vector<User*> &users = g_pUserDB->users();
+
+    std::vector<UserRecord> records( users.size() );
+    std::vector<uint32_t>   pool;
+    std::vector<char>       chars;
+
+    for (std::size_t i = 0; i != users.size(); ++i) {
+        const User *pUser = users[i];
+        UserRecord &rec = records[i];
+        rec.ID = pUser->ID();
+        rec.careerLevel = pUser->careerLevel();
+        rec.discplineID = pUser->discplineID();
+        rec.industryID = pUser->industryID();
+        rec.region = pUser->region();
+        rec.numOfCvEntry = pUser->numOfCvEntry();
+        rec.yearsOfExperience = pUser->yearsOfExperience();
+        rec.yearsOfCurrentJob = pUser->yearsOfCurrentJob();
+        rec.eduDegree = pUser->eduDegree();
+        rec.nJobRoles = (uint32_t)pUser->jobRoles().size();
+        rec.nEduFields = (uint32_t)pUser->eduFields().size();
+        rec.nCountry = (uint32_t)pUser->country().size();
+        append_set( pUser->jobRoles(), pool );
+        append_set( pUser->eduFields(), pool );
+        chars.insert( chars.end(), pUser->country().begin(), pUser->country().end() );
+    } // for i
+
+    writer.writeArray( records );
+    writer.writeArray( pool );
+    writer.writeArray( chars );
+}
+
+void load_users( SnapshotReader &reader )
+{
+    Span<UserRecord> records = reader.readArray<UserRecord>();
+    Span<uint32_t>   pool = reader.readArray<uint32_t>();
+    Span<char>       chars = reader.readArray<char>();
+    std::size_t      poolPos = 0, charPos = 0;
+
+    for (const UserRecord &rec : records) {
+        User_sptr pUser = std::allocate_shared< User >( FAST_ALLOCATOR(User)() );
+        pUser->ID() = rec.ID;
+        pUser->careerLevel() = rec.careerLevel;
+        pUser->discplineID() = rec.discplineID;
+        pUser->industryID() = rec.industryID;
+        pUser->region() = rec.region;
+        pUser->numOfCvEntry() = rec.numOfCvEntry;
+        pUser->yearsOfExperience() = rec.yearsOfExperience;
+        pUser->yearsOfCurrentJob() = rec.yearsOfCurrentJob;
+        pUser->eduDegree() = rec.eduDegree;
+        take_set( pool, poolPos, rec.nJobRoles, pUser->jobRoles() );
+        take_set( pool, poolPos, rec.nEduFields, pUser->eduFields() );
+        take_string( chars, charPos, rec.nCountry, pUser->country() );
+        g_pUserDB->addUser( pUser );
+    } // for rec
+}
+
+void save_items( SnapshotWriter &writer )
+{
+    const std::vector<Item*> &items = g_pItemDB->items();
+
+    std::vector<ItemRecord> records( items.size() );
+    std::vector<uint32_t>   pool;
+    std::vector<char>       chars;
+
+    for (std::size_t i = 0; i != items.size(); ++i) {
+        const Item *pItem = items[i];
+        ItemRecord &rec = records[i];
+        rec.createTime = (int64_t)pItem->createTime();
+        rec.ID = pItem->ID();
+        rec.careerLevel = pItem->careerLevel();
+        rec.discplineID = pItem->discplineID();
+        rec.industryID = pItem->industryID();
+        rec.region = pItem->region();
+        rec.latitude = pItem->latitude();
+        rec.longitude = pItem->longitude();
+        rec.employmentType = pItem->employmentType();
+        rec.active = pItem->isActive() ? 1 : 0;
+        rec.nTitle = (uint32_t)pItem->title().size();
+        rec.nTags = (uint32_t)pItem->tags().size();
+        rec.nCountry = (uint32_t)pItem->country().size();
+        append_set( pItem->title(), pool );
+        append_set( pItem->tags(), pool );
+        chars.insert( chars.end(), pItem->country().begin(), pItem->country().end() );
+    } // for i
+
+    writer.writeArray( records );
+    writer.writeArray( pool );
+    writer.writeArray( chars );
+}
+
+void load_items( SnapshotReader &reader )
+{
+    Span<ItemRecord> records = reader.readArray<ItemRecord>();
+    Span<uint32_t>   pool = reader.readArray<uint32_t>();
+    Span<char>       chars = reader.readArray<char>();
+    std::size_t      poolPos = 0, charPos = 0;
+
+    for (const ItemRecord &rec : records) {
+        Item_sptr pItem = std::allocate_shared< Item >( FAST_ALLOCATOR(Item)() );
+        pItem->createTime() = (time_t)rec.createTime;
+        pItem->ID() = rec.ID;
+        pItem->careerLevel() = rec.careerLevel;
+        pItem->discplineID() = rec.discplineID;
+        pItem->industryID() = rec.industryID;
+        pItem->region() = rec.region;
+        pItem->latitude() = rec.latitude;
+        pItem->longitude() = rec.longitude;
+        pItem->employmentType() = rec.employmentType;
+        pItem->setActive( rec.active ? true : false );
+        take_set( pool, poolPos, rec.nTitle, pItem->title() );
+        take_set( pool, poolPos, rec.nTags, pItem->tags() );
+        take_string( chars, charPos, rec.nCountry, pItem->country() );
+        g_pItemDB->addItem( pItem );
+    } // for rec
+}
+
+// 相似物品列表, 第i个物品的列表是 entries[ offsets[i], offsets[i+1] )
+void save_similar_items( SnapshotWriter &writer )
+{
+    const std::vector<Item*> &items = g_pItemDB->items();
+
+    std::vector<uint32_t>           offsets( items.size() + 1, 0 );
+    std::vector<SimilarItemRecord>  entries;
+
+    for (std::size_t i = 0; i != items.size(); ++i) {
+        for (const Item::SimilarItem &s : items[i]->similarItems()) {
+            SimilarItemRecord rec;
+            rec.index = s.pOther->index();
+            rec.similarity = s.similarity;
+            entries.push_back( rec );
+        } // for s
+        offsets[i + 1] = (uint32_t)entries.size();
+    } // for i
+
+    writer.writeArray( offsets );
+    writer.writeArray( entries );
+}
+
+void load_similar_items( SnapshotReader &reader )
+{
+    Span<uint32_t>          offsets = reader.readArray<uint32_t>();
+    Span<SimilarItemRecord> entries = reader.readArray<SimilarItemRecord>();
+    ItemDB                  &itemDB = *g_pItemDB;
+    std::size_t             nItems = itemDB.size();
+
+    if (offsets.size() != nItems + 1 || offsets[nItems] != entries.size())
+        throw std::runtime_error( "Corrupted snapshot file!" );
+
+    for (uint32_t i = 0; i != (uint32_t)nItems; ++i) {
+        Item::SimilarItemArray &arr = itemDB.itemAt(i)->similarItems();
+        arr.clear();
+        arr.reserve( offsets[i + 1] - offsets[i] );
+        for (uint32_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+            if (entries[j].index >= nItems)
+                throw std::runtime_error( "Corrupted snapshot file!" );
+            arr.push_back( Item::SimilarItem(itemDB.itemAt(entries[j].index),
+                                             entries[j].similarity) );
+        } // for j
+    } // for i
+}
+
+// 相似用户列表, 格式同相似物品列表
+void save_similar_users( SnapshotWriter &writer )
+{
+    const std::vector<User*> &users = g_pUserDB->users();
+
+    std::vector<uint32_t>           offsets( users.size() + 1, 0 );
+    std::vector<SimilarUserRecord>  entries;
+
+    for (std::size_t i = 0; i != users.size(); ++i) {
+        for (const User::SimilarUser &s : users[i]->similarUsers()) {
+            SimilarUserRecord rec;
+            rec.index = s.pOther->index();
+            rec.similarity = s.similarity;
+            entries.push_back( rec );
+        } // for s
+        offsets[i + 1] = (uint32_t)entries.size();
+    } // for i
+
+    writer.writeArray( offsets );
+    writer.writeArray( entries );
+}
+
+void load_similar_users( SnapshotReader &reader )
+{
+    Span<uint32_t>          offsets = reader.readArray<uint32_t>();
+    Span<SimilarUserRecord> entries = reader.readArray<SimilarUserRecord>();
+    UserDB                  &userDB = *g_pUserDB;
+    std::size_t             nUsers = userDB.size();
+
+    if (offsets.size() != nUsers + 1 || offsets[nUsers] != entries.size())
+        throw std::runtime_error( "Corrupted snapshot file!" );
+
+    for (uint32_t i = 0; i != (uint32_t)nUsers; ++i) {
+        User::SimilarUserArray &arr = userDB.userAt(i)->similarUsers();
+        arr.clear();
+        arr.reserve( offsets[i + 1] - offsets[i] );
+        for (uint32_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+            if (entries[j].index >= nUsers)
+                throw std::runtime_error( "Corrupted snapshot file!" );
+            arr.push_back( User::SimilarUser(userDB.userAt(entries[j].index),
+                                             entries[j].similarity) );
+        } // for j
+    } // for i
+}
+
+} // namespace
+
+
+SnapshotWriter::SnapshotWriter( const std::string &filename )
+        : m_strFilename(filename)
+        , m_strTmpFilename(filename + ".tmp")
+        , m_nOffset(0)
+{
+    m_ofs.open( m_strTmpFilename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    if (!m_ofs)
+        throw std::runtime_error( "Cannot open snapshot file " + m_strTmpFilename + " for writing!" );
+}
+
+void SnapshotWriter::write( const void *p, std::size_t n )
+{
+    m_ofs.write( static_cast<const char*>(p), n );
+    if (!m_ofs)
+        throw std::runtime_error( "Error writing snapshot file " + m_strTmpFilename );
+    m_nOffset += n;
+}
+
+void SnapshotWriter::pad()
+{
+    static const char zeros[8] = { 0 };
+    if (m_nOffset % 8)
+        write( zeros, 8 - m_nOffset % 8 );
+}
+
+void SnapshotWriter::commit()
+{
+    m_ofs.close();
+    if (!m_ofs)
+        throw std::runtime_error( "Error writing snapshot file " + m_strTmpFilename );
+    if (std::rename(m_strTmpFilename.c_str(), m_strFilename.c_str()) != 0)
+        throw std::runtime_error( "Cannot rename snapshot file to " + m_strFilename );
+}
+
+
+SnapshotReader::SnapshotReader( const std::string &filename )
+        : m_pFile(std::make_shared<MappedFile>())
+        , m_nOffset(0)
+{
+    if (!m_pFile->open(filename.c_str()))
+        throw std::runtime_error( "Cannot open snapshot file " + filename );
+}
+
+const void* SnapshotReader::read( std::size_t n )
+{
+    if (n > m_pFile->size() - m_nOffset)
+        throw std::runtime_error( "Corrupted snapshot file!" );
+    const void *p = m_pFile->data() + m_nOffset;
+    m_nOffset += n;
+    return p;
+}
+
+void SnapshotReader::skipPad()
+{
+    std::size_t n = (8 - m_nOffset % 8) % 8;
+    if (n > m_pFile->size() - m_nOffset)
+        throw std::runtime_error( "Corrupted snapshot file!" );
+    m_nOffset += n;
+}
+
+
+void save_snapshot( const char *filename, std::size_t similarK, std::size_t similarUsersK )
+{
+    SnapshotWriter writer( filename );
+
+    SnapshotHeader header;
+    memcpy( header.magic, SNAPSHOT_MAGIC, sizeof(header.magic) );
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.flags = (similarK ? HAS_SIMILAR_ITEMS : 0) | (similarUsersK ? HAS_SIMILAR_USERS : 0);
+    header.similarK = (uint32_t)similarK;
+    header.similarUsersK = (uint32_t)similarUsersK;
+    header.reserved = 0;
+    writer.writeValue( header );
+
+    save_users( writer );
+    save_items( writer );
+    g_pGraph->save( writer );
+    if (similarK)
+        save_similar_items( writer );
+    if (similarUsersK)
+        save_similar_users( writer );
+
+    writer.commit();
+
+    LOG(INFO) << "Snapshot " << filename << " saved.";
+}
+
+std::size_t load_snapshot( const char *filename, bool dense, std::size_t *pSimilarUsersK )
+{
+    SnapshotReader reader( filename );
+
+    const SnapshotHeader &header = reader.readValue<SnapshotHeader>();
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error( std::string(filename) + " is not a snapshot file!" );
+    if (header.version != SNAPSHOT_VERSION || header.byteOrder != BYTE_ORDER_MARK)
+        throw std::runtime_error( std::string("Incompatible snapshot version or byte order: ") + filename );
+
+    load_users( reader );
+    g_pUserDB->buildIndex( dense );
+    g_nMaxUserID = g_pUserDB->maxID();
+
+    load_items( reader );
+    g_pItemDB->buildIndex( dense );
+    g_nMaxItemID = g_pItemDB->maxID();
+
+    g_pGraph.reset( new InteractionGraph );
+    g_pGraph->load( reader, g_pUserDB->size(), g_pItemDB->size() );
+
+    std::size_t similarK = 0;
+    if (header.flags & HAS_SIMILAR_ITEMS) {
+        load_similar_items( reader );
+        similarK = header.similarK;
+    } // if
+    if (pSimilarUsersK)
+        *pSimilarUsersK = 0;
+    if (header.flags & HAS_SIMILAR_USERS) {
+        load_similar_users( reader );
+        if (pSimilarUsersK)
+            *pSimilarUsersK = header.similarUsersK;
+    } // if
+
+    LOG(INFO) << "Snapshot " << filename << " loaded.";
+
+    return similarK;
+}
+
@@ -0,0 +1,117 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "common.h"
+#include "mapped_file.h"
+#include <fstream>
+#include <stdexcept>
+
+/*
+ * 二进制快照, 保存导入完成后的 UserDB, ItemDB, InteractionGraph,
+ * 以及可选的 Item::similarItems(), User::similarUsers() 列表,
+ * 下次启动时直接导入而不必重新解析csv.
+ *
+ * 文件由文件头和若干数组组成, 每个数组是 uint64 元素个数 + 元素内容,
+ * 补齐到8字节边界. 导入时整个文件用 mmap 映射, InteractionGraph 的各数组
+ * 直接引用映射的内容, 不复制.
+ * 数据按本机字节序和内存布局保存, 文件头中的版本号和字节序标记不符时拒绝导入.
+ */
+
+// 2: 文件头增加 similarUsersK, 可选保存相似用户列表
+const uint32_t SNAPSHOT_VERSION = 2;
+
+// 写入快照, 先写到临时文件, 完成后再改名, 不会留下写了一半的快照
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter( const std::string &filename );
+
+    // 写完所有内容后调用
+    void commit();
+
+    template < typename T >
+    void writeValue( const T &value )
+    { write( &value, sizeof(T) ); }
+
+    template < typename T >
+    void writeArray( const T *pData, std::size_t n )
+    {
+        uint64_t count = n;
+        writeValue( count );
+        write( pData, n * sizeof(T) );
+        pad();
+    }
+
+    template < typename T >
+    void writeArray( const std::vector<T> &arr )
+    { writeArray( arr.data(), arr.size() ); }
+
+private:
+    void write( const void *p, std::size_t n );
+    void pad();
+
+    std::string     m_strFilename;
+    std::string     m_strTmpFilename;
+    std::ofstream   m_ofs;
+    uint64_t        m_nOffset;
+};
+
+
+// 从映射的快照文件中顺序读取, 越界或格式不符时抛出 runtime_error
+class SnapshotReader {
+public:
+    explicit SnapshotReader( const std::string &filename );
+
+    template < typename T >
+    const T& readValue()
+    { return *static_cast<const T*>( read(sizeof(T)) ); }
+
+    template < typename T >
+    Span<T> readArray()
+    {
+        uint64_t n = readValue<uint64_t>();
+        if (n > (m_pFile->size() - m_nOffset) / sizeof(T))
+            throw std::runtime_error( "Corrupted snapshot file!" );
+        const T *pData = static_cast<const T*>( read((std::size_t)n * sizeof(T)) );
+        skipPad();
+        return Span<T>( pData, (std::size_t)n );
+    }
+
+    // 快照文件的映射, 引用其中数据的对象应持有它
+    const std::shared_ptr<MappedFile>& file() const
+    { return m_pFile; }
+
+private:
+    const void* read( std::size_t n );
+    void skipPad();
+
+    std::shared_ptr<MappedFile>   m_pFile;
+    std::size_t                   m_nOffset;
+};
+
+
+/**
+ * @brief 把当前的 g_pUserDB, g_pItemDB, g_pGraph 写入快照文件
+ *
+ * @param filename    快照文件名
+ * @param similarK    非0时同时保存每个物品的相似物品列表,
+ *                    应为调用 get_all_items_similarity 时的k
+ * @param similarUsersK  非0时同时保存每个用户的相似用户列表,
+ *                    应为调用 get_all_users_similarity 时的k
+ */
+extern void save_snapshot( const char *filename, std::size_t similarK = 0,
+                           std::size_t similarUsersK = 0 );
+
+/**
+ * @brief 从快照文件导入数据, 代替导入 users.csv, items.csv, interactions_train.csv
+ *        并建立 InteractionGraph 的全过程
+ *
+ * @param filename    快照文件名
+ * @param dense       同 UserDB::buildIndex
+ * @param pSimilarUsersK  非NULL时返回快照中相似用户列表的k, 没有保存时为0
+ * @return            快照中相似物品列表的k, 没有保存相似物品列表时为0
+ */
+extern std::size_t load_snapshot( const char *filename, bool dense = false,
+                                  std::size_t *pSimilarUsersK = NULL );
+
+#endif
+
@@ -0,0 +1,124 @@
+#ifndef _TEXT_PARSER_H_
+#define _TEXT_PARSER_H_
+
+#include "common.h"
+
+/*
+ * 解析数据文件文本的工具函数.
+ * 都在 [b, e) 上操作, 不要求以'\0'结尾, 不修改原文本, 也不分配内存,
+ * 可以直接用于 mmap 映射的文件内容.
+ * 语义与 read_from_string 相同: "NULL"/"null" 读作默认值并返回true.
+ */
+
+// 与 strtok_r 相同, 跳过开头的分隔符, 取出下一个字段 [field, fieldEnd), p 移到字段之后
+inline
+bool next_token( const char *&p, const char *end, char delim,
+                 const char *&field, const char *&fieldEnd )
+{
+    while (p < end && *p == delim)
+        ++p;
+    if (p == end)
+        return false;
+    field = p;
+    while (p < end && *p != delim)
+        ++p;
+    fieldEnd = p;
+    return true;
+}
+
+inline
+bool is_null_text( const char *b, const char *e )
+{
+    return (e - b == 4) && (strncmp(b, "NULL", 4) == 0 || strncmp(b, "null", 4) == 0);
+}
+
+// 读入整数, 忽略数字之后的内容
+template < typename T >
+bool parse_number( const char *b, const char *e, T &value )
+{
+    value = T();
+    if (is_null_text(b, e))
+        return true;
+
+    const char *p = b;
+    bool negative = false;
+    if (p < e && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    const char *digits = p;
+    T v = 0;
+    for (; p < e && (unsigned)(*p - '0') < 10; ++p)
+        v = v * 10 + (T)(*p - '0');
+    if (p == digits)
+        return false;
+
+    value = negative ? (T)(0 - v) : v;
+    return true;
+}
+
+// 读入浮点数, 形如 -12.34e5
+inline
+bool parse_number( const char *b, const char *e, float &value )
+{
+    value = 0.0;
+    if (is_null_text(b, e))
+        return true;
+
+    const char *p = b;
+    bool negative = false;
+    if (p < e && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    double mantissa = 0.0;
+    int    exponent = 0;
+    bool   hasDigit = false;
+    for (; p < e && (unsigned)(*p - '0') < 10; ++p, hasDigit = true)
+        mantissa = mantissa * 10 + (*p - '0');
+    if (p < e && *p == '.') {
+        for (++p; p < e && (unsigned)(*p - '0') < 10; ++p, hasDigit = true) {
+            mantissa = mantissa * 10 + (*p - '0');
+            --exponent;
+        } // for
+    } // if
+    if (!hasDigit)
+        return false;
+
+    if (p < e && (*p == 'e' || *p == 'E')) {
+        int exp = 0;
+        if (parse_number(p + 1, e, exp))
+            exponent += exp;
+    } // if
+
+    double v = mantissa * std::pow( 10.0, exponent );
+    value = (float)(negative ? -v : v);
+    return true;
+}
+
+inline
+bool parse_number( const char *b, const char *e, String &value )
+{
+    if (is_null_text(b, e))
+        value.clear();
+    else
+        value.assign( b, e );
+    return true;
+}
+
+// 将一系列 uint 数据，逗号分隔，读入到set集合中
+inline
+bool parse_uint_set( const char *b, const char *e, UIntSet &uintSet )
+{
+    const char *field, *fieldEnd;
+    uint32_t id;
+    bool ret = true;
+    while (next_token(b, e, ',', field, fieldEnd)) {
+        if (parse_number(field, fieldEnd, id))
+            uintSet.insert( id );
+        else
+            ret = false;
+    } // while
+    return ret;
+}
+
+#endif
+
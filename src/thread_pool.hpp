@@ -7,6 +7,11 @@
 #include <memory>
 #include <functional>
 #include <ctime>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <future>
 
 
 template < typename T >
@@ -48,55 +53,643 @@ protected:
 };
 
 
+/**
+ * @brief Chase-Lev work stealing 双端队列, 无锁
+ *
+ * 只有所有者线程可以 push/pop, 在底部操作(后进先出);
+ * 其他线程用 steal 从顶部取(先进先出). 容量不够时自动加倍,
+ * 旧的数组保留到析构时再释放, 正在 steal 的线程仍可以安全读取.
+ *
+ * T 必须是指针类型, 空指针表示队列为空.
+ */
+template < typename T >
+class WorkStealingDeque {
+    struct Buffer {
+        int64_t                 capacity;    // 2的幂
+        std::atomic<T>          *data;
+
+        explicit Buffer( int64_t _capacity )
+                : capacity(_capacity), data(new std::atomic<T>[_capacity]) {}
+        ~Buffer() { delete [] data; }
+
+        T get( int64_t i ) const
+        { return data[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put( int64_t i, T x )
+        { data[i & (capacity - 1)].store(x, std::memory_order_relaxed); }
+    };
+
+public:
+    explicit WorkStealingDeque( int64_t capacity = 256 )
+            : m_nTop(0), m_nBottom(0)
+    {
+        Buffer *pBuf = new Buffer( capacity );
+        m_arrBuffers.push_back( std::unique_ptr<Buffer>(pBuf) );
+        m_pBuffer.store( pBuf, std::memory_order_relaxed );
+    }
+
+    // 仅所有者线程调用
+    void push( T x )
+    {
+        int64_t b = m_nBottom.load( std::memory_order_relaxed );
+        int64_t t = m_nTop.load( std::memory_order_acquire );
+        Buffer *pBuf = m_pBuffer.load( std::memory_order_relaxed );
+        if (b - t > pBuf->capacity - 1)
+            pBuf = grow( pBuf, t, b );
+        pBuf->put( b, x );
+        m_nBottom.store( b + 1, std::memory_order_release );
+    }
+
+    // 仅所有者线程调用, 队列空时返回NULL
+    T pop()
+    {
+        int64_t b = m_nBottom.load( std::memory_order_relaxed ) - 1;
+        Buffer *pBuf = m_pBuffer.load( std::memory_order_relaxed );
+        m_nBottom.store( b, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64_t t = m_nTop.load( std::memory_order_relaxed );
+
+        T x = NULL;
+        if (t <= b) {
+            x = pBuf->get( b );
+            if (t == b) {
+                // 最后一个元素, 和 steal 竞争
+                if (!m_nTop.compare_exchange_strong(t, t + 1,
+                            std::memory_order_seq_cst, std::memory_order_relaxed))
+                    x = NULL;
+                m_nBottom.store( b + 1, std::memory_order_relaxed );
+            } // if
+        } else {
+            m_nBottom.store( b + 1, std::memory_order_relaxed );
+        } // if
+        return x;
+    }
+
+    // 任意线程调用, 队列空或与其他线程竞争失败时返回NULL
+    T steal()
+    {
+        int64_t t = m_nTop.load( std::memory_order_acquire );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64_t b = m_nBottom.load( std::memory_order_acquire );
+
+        if (t >= b)
+            return NULL;
+        Buffer *pBuf = m_pBuffer.load( std::memory_order_acquire );
+        T x = pBuf->get( t );
+        if (!m_nTop.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+            return NULL;
+        return x;
+    }
+
+private:
+    Buffer* grow( Buffer *pOld, int64_t t, int64_t b )
+    {
+        Buffer *pBuf = new Buffer( pOld->capacity * 2 );
+        for (int64_t i = t; i < b; ++i)
+            pBuf->put( i, pOld->get(i) );
+        m_arrBuffers.push_back( std::unique_ptr<Buffer>(pBuf) );
+        m_pBuffer.store( pBuf, std::memory_order_release );
+        return pBuf;
+    }
+
+    WorkStealingDeque( const WorkStealingDeque& );
+    WorkStealingDeque& operator = ( const WorkStealingDeque& );
+
+    std::atomic<int64_t>                    m_nTop;
+    std::atomic<int64_t>                    m_nBottom;
+    std::atomic<Buffer*>                    m_pBuffer;
+    std::vector< std::unique_ptr<Buffer> >  m_arrBuffers;   // 只有所有者线程修改
+};
+
+
+/**
+ * @brief 每线程的上下文, 含义由使用者决定(如 common.h 中固定模型版本的 ModelPin).
+ *        parallel_for 在执行区间的线程上用调用者上下文的 run 执行区间, 使这些线程有同样的上下文;
+ *        addJob 提交的任务不继承上下文.
+ */
+class ThreadContext {
+public:
+    // 在本线程建立与本上下文相同的上下文, 执行 fn, 之后恢复原来的上下文
+    virtual void run( const std::function<void()> &fn ) const = 0;
+
+protected:
+    ~ThreadContext() {}
+};
+
+// 本线程当前的上下文, 没有时为NULL
+inline const ThreadContext*& thread_context()
+{
+    static thread_local const ThreadContext *s_pContext = NULL;
+    return s_pContext;
+}
+
+
+namespace detail {
+
+// parallel_for 的回调可以是 fn(first, last, slot) 或 fn(first, last)
+template < typename Fn >
+auto invoke_range( const Fn &fn, std::size_t first, std::size_t last, std::size_t slot, int )
+        -> decltype( fn(first, last, slot), void() )
+{ fn( first, last, slot ); }
+
+template < typename Fn >
+void invoke_range( const Fn &fn, std::size_t first, std::size_t last, std::size_t, long )
+{ fn( first, last ); }
+
+// parallel_reduce 的回调可以是 fn(first, last, slot, partial) 或 fn(first, last, partial)
+template < typename Fn, typename T >
+auto invoke_reduce( const Fn &fn, std::size_t first, std::size_t last, std::size_t slot, T &partial, int )
+        -> decltype( fn(first, last, slot, partial), void() )
+{ fn( first, last, slot, partial ); }
+
+template < typename Fn, typename T >
+void invoke_reduce( const Fn &fn, std::size_t first, std::size_t last, std::size_t, T &partial, long )
+{ fn( first, last, partial ); }
+
+} // namespace detail
+
+
+/**
+ * @brief work stealing 线程池
+ *
+ * 每个工作线程有一个 WorkStealingDeque 和一个无锁的提交栈(inbox).
+ * 池外线程提交的任务轮流压入各线程的 inbox, 工作线程自己提交的任务直接进自己的队列.
+ * 工作线程先取自己的队列, 再取自己的 inbox, 都空时随机选其他线程,
+ * 偷它队列顶部的任务或整个 inbox. 一直找不到任务时在条件变量上休眠.
+ *
+ * addJob 返回 Future 用于等待单个任务, parallel_for 等待它的所有区间.
+ * 在本池的工作线程中等待时会执行池中的其他任务, 而不是阻塞.
+ */
 template < typename JobType, typename JobPtr = std::shared_ptr<JobType> >
 class ThreadPool {
-    typedef SharedQueue<JobPtr>     WorkQueue;
+    struct Node {
+        JobPtr                  job;
+        Node                    *next;
+        std::atomic<int>        refs;     // 线程池和 Future 各持有一个引用
+        std::atomic<bool>       done;
+        std::exception_ptr      error;    // 有 Future 时保存任务抛出的异常
+
+        Node( const JobPtr &_job, int _refs ) : job(_job), next(NULL), refs(_refs), done(false) {}
+    };
+
+    struct Worker {
+        WorkStealingDeque<Node*>    deque;
+        std::atomic<Node*>          inbox;     // 后进先出的链表
+        uint32_t                    seed;      // 选偷取对象的随机数种子
+
+        Worker() : inbox(NULL), seed(0) {}
+    };
+
+    // 当前线程是哪个线程池的第几个工作线程
+    struct WorkerContext {
+        const void      *pPool;
+        std::size_t     index;
+    };
+
+public:
+    /**
+     * @brief addJob 返回的任务完成通知, 可复制, 不额外分配内存(引用任务节点)
+     */
+    class Future {
+    public:
+        Future() : m_pPool(NULL), m_pNode(NULL) {}
+        Future( const Future &rhs ) : m_pPool(rhs.m_pPool), m_pNode(rhs.m_pNode)
+        { if (m_pNode) m_pNode->refs.fetch_add( 1 ); }
+        ~Future()
+        { if (m_pNode) release( m_pNode ); }
+
+        Future& operator = ( Future rhs )
+        {
+            std::swap( m_pPool, rhs.m_pPool );
+            std::swap( m_pNode, rhs.m_pNode );
+            return *this;
+        }
+
+        bool valid() const
+        { return m_pNode != NULL; }
+
+        // 任务是否已执行完, 无效的 Future 视为已完成
+        bool ready() const
+        { return !m_pNode || m_pNode->done.load(); }
+
+        void wait() const
+        {
+            if (!m_pNode)
+                return;
+            const Future *self = this;
+            m_pPool->waitUntil( [self]{ return self->ready(); } );
+        }
+
+        // 等待任务完成, 任务抛出异常时在这里重新抛出. 无效的 Future 抛出 std::future_error
+        void get() const
+        {
+            if (!m_pNode)
+                throw std::future_error( std::future_errc::no_state );
+            wait();
+            if (m_pNode->error)
+                std::rethrow_exception( m_pNode->error );
+        }
+
+    private:
+        friend class ThreadPool;
+        Future( ThreadPool *pPool, Node *pNode ) : m_pPool(pPool), m_pNode(pNode) {}
+
+        ThreadPool  *m_pPool;
+        Node        *m_pNode;
+    };
+
 public:
     explicit ThreadPool( std::size_t _Size )
-            : m_nSize(_Size)
-            , m_arrWorkQueue(_Size)
+            : m_nSize(_Size ? _Size : 1)
+            , m_nNextWorker(0)
+            , m_nPending(0)
+            , m_nVersion(0)
+            , m_nSleeping(0)
+            , m_nWaiters(0)
+            , m_bStop(false)
+            , m_bTerminated(false)
     {
-        ::srand(::time(0));
+        for (std::size_t i = 0; i < m_nSize; ++i) {
+            m_arrWorkers.push_back( std::unique_ptr<Worker>(new Worker) );
+            m_arrWorkers[i]->seed = (uint32_t)(i * 2654435761u + 1);
+        } // for
 
         for (std::size_t i = 0; i < m_nSize; ++i)
             m_Thrgrp.create_thread( 
                     std::bind(&ThreadPool<JobType, JobPtr>::doWork, this, i) );
     }
 
-    void addJob( const JobPtr &pJob )
+    // 新的实现中工作线程引用池内的队列, 必须在析构前结束
+    ~ThreadPool()
+    { terminate(); }
+
+    Future addJob( const JobPtr &pJob )
     {
-        std::size_t idx = ::rand() % m_nSize;
-        m_arrWorkQueue[idx].push( pJob );
+        Node *pNode = new Node( pJob, 2 );
+        m_nPending.fetch_add( 1 );
+
+        WorkerContext &ctx = context();
+        if (ctx.pPool == this) {
+            m_arrWorkers[ctx.index]->deque.push( pNode );
+        } else {
+            std::size_t idx = m_nNextWorker.fetch_add(1, std::memory_order_relaxed) % m_nSize;
+            pushInbox( *m_arrWorkers[idx], pNode, pNode );
+        } // if
+
+        signal( false );
+        return Future( this, pNode );
     }
 
-    void addJob( const JobType &job )
-    { addJob( std::make_shared<JobType>(job) ); }
+    Future addJob( const JobType &job )
+    { return addJob( std::make_shared<JobType>(job) ); }
+
+    /**
+     * @brief 批量提交任务, 分成每个工作线程一串, 每串只做一次原子操作.
+     *        不返回 Future, 任务抛出异常时结束程序. parallel_for 用它提交各 slot
+     *
+     * @param first, last   任务序列, 元素为 JobType 或 JobPtr
+     */
+    template < typename Iter >
+    void addJobs( Iter first, Iter last )
+    {
+        std::vector<Node*> heads( m_nSize, (Node*)NULL ), tails( m_nSize, (Node*)NULL );
+        std::size_t n = 0;
+        for (; first != last; ++first, ++n) {
+            Node *pNode = new Node( makeJobPtr(*first), 1 );
+            std::size_t idx = n % m_nSize;
+            pNode->next = heads[idx];
+            heads[idx] = pNode;
+            if (!tails[idx])
+                tails[idx] = pNode;
+        } // for
+        if (!n)
+            return;
 
+        m_nPending.fetch_add( n );
+        std::size_t start = m_nNextWorker.fetch_add(n, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < m_nSize; ++i) {
+            if (heads[i])
+                pushInbox( *m_arrWorkers[(start + i) % m_nSize], heads[i], tails[i] );
+        } // for
+        
+        signal( true );
+    }
+
+    // parallel_for 的 slot 个数上限, 即工作线程数
+    std::size_t slots() const
+    { return m_nSize; }
+
+    /**
+     * @brief 把 [begin, end) 切成大小为 grain 的区间并行处理, 全部处理完才返回
+     *
+     * 每个 slot 是一个任务, 依次用原子计数器领取区间, 不加锁, 也不为每个区间分配内存.
+     * 同一 slot 的区间只会被一个线程顺序处理, 所以 slot 可以作为下标访问
+     * 调用者准备的每线程私有数据(大小为 slots()), 用于归约等.
+     * 在工作线程中调用时, 等待期间会执行池中的其他任务, 不会死锁.
+     * fn 在调用者的 thread_context() 下执行.
+     * fn 抛出异常时不再领取新的区间, 等所有 slot 结束后在调用者中重新抛出第一个异常.
+     *
+     * @param begin, end    下标范围
+     * @param grain         每次领取的区间大小
+     * @param fn            fn(first, last, slot) 或 fn(first, last)
+     *
+     * JobType 需要能由无参函数对象构造, 如 std::function<void(void)>
+     */
+    template < typename Fn >
+    void parallel_for( std::size_t begin, std::size_t end, std::size_t grain, const Fn &fn )
+    {
+        if (begin >= end)
+            return;
+        if (!grain)
+            grain = 1;
+
+        std::size_t nChunks = (end - begin + grain - 1) / grain;
+        std::size_t nTasks = std::min( nChunks, m_nSize );
+
+        std::atomic<std::size_t> next( begin );
+        std::atomic<std::size_t> remaining( nTasks );
+        const ThreadContext      *pContext = thread_context();
+        std::atomic<bool>        failed( false );
+        std::exception_ptr       error;
+
+        // 各 slot 引用本函数的局部变量, 所以 body 不能抛出异常, 必须在计数减到0之后才能返回
+        auto body = [&]( std::size_t slot ) {
+            auto loop = [&] {
+                try {
+                    while (true) {
+                        std::size_t first = next.fetch_add( grain );
+                        if (first >= end)
+                            break;
+                        detail::invoke_range( fn, first, std::min(first + grain, end), slot, 0 );
+                    } // while
+                } catch (...) {
+                    if (!failed.exchange( true ))
+                        error = std::current_exception();
+                    next.store( end );
+                } // try
+            };
+            const ThreadContext *pSaved = thread_context();
+            if (pSaved == pContext) {
+                loop();
+            } else if (pContext) {
+                pContext->run( loop );
+            } else {
+                // 调用者没有上下文, 本线程(等待中执行别的任务时)的上下文不带入区间
+                thread_context() = NULL;
+                loop();
+                thread_context() = pSaved;
+            } // if
+            if (remaining.fetch_sub(1) == 1)
+                notifyDone();
+        };
+
+        // slot 0 由调用者自己处理, 其余的一次批量提交, 不需要 Future
+        std::vector<JobType> jobs;
+        jobs.reserve( nTasks - 1 );
+        for (std::size_t slot = 1; slot < nTasks; ++slot)
+            jobs.push_back( JobType(std::bind(body, slot)) );
+        addJobs( jobs.begin(), jobs.end() );
+        body( 0 );
+
+        waitUntil( [&remaining]{ return remaining.load() == 0; } );
+        if (error)
+            std::rethrow_exception( error );
+    }
+
+    /**
+     * @brief 并行归约, 每个 slot 有自己的部分结果, 最后按 slot 顺序合并
+     *
+     * @param identity      部分结果的初值
+     * @param fn            fn(first, last, T &partial) 或 fn(first, last, slot, T &partial)
+     * @param combine       combine(T, T) -> T
+     */
+    template < typename T, typename Fn, typename Combine >
+    T parallel_reduce( std::size_t begin, std::size_t end, std::size_t grain,
+                       const T &identity, const Fn &fn, const Combine &combine )
+    {
+        std::vector<T> partials( m_nSize, identity );
+        parallel_for( begin, end, grain,
+            [&]( std::size_t first, std::size_t last, std::size_t slot ) {
+                detail::invoke_reduce( fn, first, last, slot, partials[slot], 0 );
+            } );
+
+        T result = identity;
+        for (const T &v : partials)
+            result = combine( result, v );
+        return result;
+    }
+
+    // 等所有已提交的任务完成后结束工作线程, 之后不能再提交任务
     void terminate()
     {
-        for (std::size_t i = 0; i < m_nSize; ++i)
-            m_arrWorkQueue[i].push( JobPtr() );
+        if (m_bTerminated)
+            return;
+        m_bTerminated = true;
+
+        m_bStop.store( true );
+        signal( true );
         m_Thrgrp.join_all();
     }
 
 private:
+    static WorkerContext& context()
+    {
+        static thread_local WorkerContext ctx = { NULL, 0 };
+        return ctx;
+    }
+
+    static JobPtr makeJobPtr( const JobPtr &pJob )
+    { return pJob; }
+    static JobPtr makeJobPtr( const JobType &job )
+    { return std::make_shared<JobType>(job); }
+
+    // 把链表 [head, tail] 整串压入 w 的 inbox
+    static void pushInbox( Worker &w, Node *head, Node *tail )
+    {
+        Node *old = w.inbox.load( std::memory_order_relaxed );
+        do {
+            tail->next = old;
+        } while (!w.inbox.compare_exchange_weak(old, head,
+                        std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // 取走 victim 的整个 inbox 放入 self 的队列, 返回其中一个任务
+    static Node* takeInbox( Worker &victim, Worker &self )
+    {
+        Node *p = victim.inbox.exchange( NULL, std::memory_order_acquire );
+        if (!p)
+            return NULL;
+        // 链表头是最后提交的, 按链表顺序压入后 pop 先取到最早提交的
+        for (; p; ) {
+            Node *next = p->next;
+            self.deque.push( p );
+            p = next;
+        } // for
+        return self.deque.pop();
+    }
+
+    // 有新任务或要结束时唤醒休眠的工作线程
+    void signal( bool all )
+    {
+        m_nVersion.fetch_add( 1 );
+        if (m_nSleeping.load() > 0) {
+            boost::lock_guard<boost::mutex> lk(m_SleepMtx);
+            if (all)
+                m_condWake.notify_all();
+            else
+                m_condWake.notify_one();
+        } // if
+    }
+
+    static void release( Node *pNode )
+    {
+        if (pNode->refs.fetch_sub(1) == 1)
+            delete pNode;
+    }
+
+    // 有任务完成时唤醒 waitUntil 中阻塞的线程
+    void notifyDone()
+    {
+        if (m_nWaiters.load() > 0) {
+            boost::lock_guard<boost::mutex> lk(m_DoneMtx);
+            m_condDone.notify_all();
+        } // if
+    }
+
+    /**
+     * @brief 等待 pred() 为真. pred 所依赖的状态改变后必须调用 notifyDone.
+     *        在本池的工作线程中调用时帮忙执行其他任务, 否则在条件变量上阻塞.
+     */
+    template < typename Pred >
+    void waitUntil( const Pred &pred )
+    {
+        WorkerContext &ctx = context();
+        if (ctx.pPool == this) {
+            while (!pred()) {
+                Node *pNode = findWork( ctx.index );
+                if (pNode)
+                    runNode( pNode );
+                else
+                    boost::this_thread::yield();
+            } // while
+            return;
+        } // if
+
+        if (pred())
+            return;
+        boost::unique_lock<boost::mutex> lk(m_DoneMtx);
+        m_nWaiters.fetch_add( 1 );
+        while (!pred())
+            m_condDone.wait( lk );
+        m_nWaiters.fetch_sub( 1 );
+    }
+
+    void runNode( Node *pNode )
+    {
+        JobPtr pWork = std::move( pNode->job );
+        try {
+            (*pWork)();
+        } catch (...) {
+            // 没有 Future 等待结果时和原来一样直接结束程序
+            if (pNode->refs.load() == 1)
+                throw;
+            pNode->error = std::current_exception();
+        } // try
+        pWork.reset();
+        pNode->done.store( true );
+        release( pNode );
+
+        std::size_t left = m_nPending.fetch_sub(1) - 1;
+        notifyDone();
+        // 全部完成时唤醒等待结束的工作线程
+        if (!left)
+            signal( true );
+    }
+
+    Node* findWork( std::size_t i )
+    {
+        Worker &self = *m_arrWorkers[i];
+
+        Node *p = self.deque.pop();
+        if (p)
+            return p;
+        if ((p = takeInbox(self, self)) != NULL)
+            return p;
+
+        // 随机选择偷取对象
+        for (std::size_t round = 0; round < 2 * m_nSize; ++round) {
+            self.seed ^= self.seed << 13;
+            self.seed ^= self.seed >> 17;
+            self.seed ^= self.seed << 5;
+            std::size_t v = self.seed % m_nSize;
+            if (v == i)
+                continue;
+            Worker &victim = *m_arrWorkers[v];
+            if ((p = victim.deque.steal()) != NULL)
+                return p;
+            if ((p = takeInbox(victim, self)) != NULL)
+                return p;
+        } // for
+
+        /*
+         * 随机选择可能漏掉某个线程, 最后依次检查一遍所有线程.
+         * 被唤醒的线程可能不是 inbox 的所有者, 不检查全部就休眠会使任务没人执行.
+         */
+        for (std::size_t n = 1; n < m_nSize; ++n) {
+            Worker &victim = *m_arrWorkers[(i + n) % m_nSize];
+            if ((p = victim.deque.steal()) != NULL)
+                return p;
+            if ((p = takeInbox(victim, self)) != NULL)
+                return p;
+        } // for
+
+        return NULL;
+    }
+
     void doWork( std::size_t i )
     {
+        WorkerContext &ctx = context();
+        ctx.pPool = this;
+        ctx.index = i;
+
         while (true) {
-            JobPtr pWork = m_arrWorkQueue[i].pop();
-            // 空指针表示结束工作线程
-            if (!pWork)
-                return;
-            (*pWork)();
+            uint64_t version = m_nVersion.load();
+
+            Node *pNode = findWork( i );
+            if (pNode) {
+                runNode( pNode );
+                continue;
+            } // if
+
+            if (m_bStop.load() && m_nPending.load() == 0)
+                break;
+
+            boost::unique_lock<boost::mutex> lk(m_SleepMtx);
+            m_nSleeping.fetch_add( 1 );
+            while (m_nVersion.load() == version)
+                m_condWake.wait( lk );
+            m_nSleeping.fetch_sub( 1 );
         } // while
+
+        ctx.pPool = NULL;
     }
 
 private:
-    std::size_t             m_nSize;
-    std::vector<WorkQueue>  m_arrWorkQueue;
-    boost::thread_group     m_Thrgrp;
+    std::size_t                             m_nSize;
+    std::vector< std::unique_ptr<Worker> >  m_arrWorkers;
+    std::atomic<std::size_t>                m_nNextWorker;   // 池外提交时轮流选择 inbox
+    std::atomic<std::size_t>                m_nPending;      // 已提交未完成的任务数
+    std::atomic<uint64_t>                   m_nVersion;      // 每次提交或状态变化加一
+    std::atomic<std::size_t>                m_nSleeping;
+    std::atomic<std::size_t>                m_nWaiters;      // 在 waitUntil 中阻塞的线程数
+    std::atomic<bool>                       m_bStop;
+    bool                                    m_bTerminated;
+    boost::mutex                            m_SleepMtx;
+    boost::condition_variable               m_condWake;
+    boost::mutex                            m_DoneMtx;
+    boost::condition_variable               m_condDone;
+    boost::thread_group                     m_Thrgrp;
 };
 
 
 #endif
-